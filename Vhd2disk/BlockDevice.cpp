@@ -0,0 +1,1154 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "BlockDevice.h"
+
+#ifdef _WIN32
+#include <winioctl.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
+#endif
+
+CBlockDevice::CBlockDevice(void)
+{
+#ifdef _WIN32
+	m_hFile = NULL;
+#else
+	m_fd = -1;
+#endif
+	m_dwFlags = 0;
+	m_dwLastError = 0;
+	m_nStreamPos = 0;
+}
+
+CBlockDevice::~CBlockDevice(void)
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+BOOL CBlockDevice::Open(LPCPATH sPath, DWORD dwFlags)
+{
+	DWORD dwAccess = 0;
+	DWORD dwShare = 0;
+	DWORD dwCreation = OPEN_EXISTING;
+	DWORD dwAttributes = 0;
+
+	Close();
+
+	if(dwFlags & BDEV_READ) dwAccess |= GENERIC_READ;
+	if(dwFlags & BDEV_WRITE) dwAccess |= GENERIC_WRITE;
+
+	if(!(dwFlags & BDEV_EXCLUSIVE))
+	{
+		dwShare = FILE_SHARE_READ;
+		if(dwFlags & BDEV_SHARE_WRITE) dwShare |= FILE_SHARE_WRITE;
+	}
+
+	if(dwFlags & BDEV_CREATE)
+	{
+		dwCreation = CREATE_ALWAYS;
+		dwAttributes |= FILE_ATTRIBUTE_NORMAL;
+	}
+
+	if(dwFlags & BDEV_WRITE_THROUGH) dwAttributes |= FILE_FLAG_WRITE_THROUGH;
+	if(dwFlags & BDEV_NO_BUFFERING) dwAttributes |= FILE_FLAG_NO_BUFFERING;
+	if(dwFlags & BDEV_SEQUENTIAL) dwAttributes |= FILE_FLAG_SEQUENTIAL_SCAN;
+	if(dwFlags & BDEV_OVERLAPPED) dwAttributes |= FILE_FLAG_OVERLAPPED;
+	if(dwAttributes == 0) dwAttributes = FILE_ATTRIBUTE_NORMAL;
+
+	m_hFile = CreateFile(sPath, dwAccess, dwShare, NULL, dwCreation, dwAttributes, NULL);
+
+	if(m_hFile == INVALID_HANDLE_VALUE && (dwFlags & BDEV_BACKUP_SEMANTICS))
+	{
+		// Try with backup privileges for better access
+		m_hFile = CreateFile(sPath, dwAccess, dwShare, NULL, dwCreation
+			, dwAttributes | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	}
+
+	if(m_hFile == INVALID_HANDLE_VALUE)
+	{
+		m_dwLastError = ::GetLastError();
+		m_hFile = NULL;
+		return FALSE;
+	}
+
+	m_dwFlags = dwFlags;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::OpenStdin()
+{
+	Close();
+
+	// own a duplicate so Close() leaves the process handle alone
+	if(!DuplicateHandle(GetCurrentProcess(), GetStdHandle(STD_INPUT_HANDLE)
+		, GetCurrentProcess(), &m_hFile, 0, FALSE, DUPLICATE_SAME_ACCESS))
+	{
+		m_dwLastError = ::GetLastError();
+		m_hFile = NULL;
+		return FALSE;
+	}
+
+	m_dwFlags = BDEV_READ | BDEV_STREAM;
+	m_nStreamPos = 0;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::OpenStdout()
+{
+	Close();
+
+	if(!DuplicateHandle(GetCurrentProcess(), GetStdHandle(STD_OUTPUT_HANDLE)
+		, GetCurrentProcess(), &m_hFile, 0, FALSE, DUPLICATE_SAME_ACCESS))
+	{
+		m_dwLastError = ::GetLastError();
+		m_hFile = NULL;
+		return FALSE;
+	}
+
+	m_dwFlags = BDEV_WRITE | BDEV_STREAM;
+	m_nStreamPos = 0;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::Close()
+{
+	BOOL bReturn = TRUE;
+
+	if(m_hFile)
+		bReturn = CloseHandle(m_hFile);
+
+	m_hFile = NULL;
+	m_dwFlags = 0;
+
+	return bReturn;
+}
+
+BOOL CBlockDevice::IsOpen() const
+{
+	return m_hFile != NULL;
+}
+
+BOOL CBlockDevice::Seek(UINT64 nOffset)
+{
+	LARGE_INTEGER filepointer;
+	filepointer.QuadPart = nOffset;
+
+	if(!SetFilePointerEx(m_hFile, filepointer, NULL, FILE_BEGIN))
+	{
+		m_dwLastError = ::GetLastError();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::SeekEnd()
+{
+	LARGE_INTEGER filepointer;
+	filepointer.QuadPart = 0;
+
+	if(!SetFilePointerEx(m_hFile, filepointer, NULL, FILE_END))
+	{
+		m_dwLastError = ::GetLastError();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::Read(void* pBuff, DWORD nBytes, DWORD* pnRead)
+{
+	DWORD dwDone = 0;
+
+	// pipes return whatever is buffered, loop until EOF
+	while(dwDone < nBytes)
+	{
+		DWORD dwRead = 0;
+
+		if(!ReadFile(m_hFile, (BYTE*)pBuff + dwDone, nBytes - dwDone, &dwRead, NULL))
+		{
+			// the writer closing its end is EOF on a pipe
+			if(::GetLastError() == ERROR_BROKEN_PIPE)
+				break;
+
+			m_dwLastError = ::GetLastError();
+			if(pnRead) *pnRead = dwDone;
+			return FALSE;
+		}
+		if(dwRead == 0) break;
+		dwDone += dwRead;
+	}
+
+	if(pnRead) *pnRead = dwDone;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::Write(const void* pBuff, DWORD nBytes, DWORD* pnWritten)
+{
+	DWORD dwWritten = 0;
+
+	if(!WriteFile(m_hFile, pBuff, nBytes, &dwWritten, NULL))
+	{
+		m_dwLastError = ::GetLastError();
+		if(pnWritten) *pnWritten = dwWritten;
+		return FALSE;
+	}
+
+	if(pnWritten) *pnWritten = dwWritten;
+
+	return dwWritten == nBytes;
+}
+
+BOOL CBlockDevice::Flush()
+{
+	// pipes have nothing to sync
+	if(m_dwFlags & BDEV_STREAM)
+		return TRUE;
+
+	if(!FlushFileBuffers(m_hFile))
+	{
+		m_dwLastError = ::GetLastError();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+UINT64 CBlockDevice::GetSize()
+{
+	LARGE_INTEGER size;
+
+	if(!m_hFile)
+		return 0;
+
+	if(GetFileSizeEx(m_hFile, &size))
+		return size.QuadPart;
+
+	// Try alternative method for physical drives
+	DISK_GEOMETRY_EX geometry;
+	DWORD bytesReturned;
+
+	if(DeviceIoControl(m_hFile, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
+		NULL, 0, &geometry, sizeof(geometry), &bytesReturned, NULL))
+	{
+		return geometry.DiskSize.QuadPart;
+	}
+
+	m_dwLastError = ::GetLastError();
+
+	return 0;
+}
+
+#else // !_WIN32
+
+BOOL CBlockDevice::Open(LPCPATH sPath, DWORD dwFlags)
+{
+	int nFlags = O_CLOEXEC;
+	struct stat st;
+
+	Close();
+
+	if((dwFlags & BDEV_READ) && (dwFlags & BDEV_WRITE))
+		nFlags |= O_RDWR;
+	else if(dwFlags & BDEV_WRITE)
+		nFlags |= O_WRONLY;
+	else
+		nFlags |= O_RDONLY;
+
+	if(dwFlags & BDEV_CREATE) nFlags |= O_CREAT | O_TRUNC;
+	if(dwFlags & BDEV_WRITE_THROUGH) nFlags |= O_DSYNC;
+
+	// O_EXCL on a block device refuses it while mounted, like share mode 0 does on Windows
+	if((dwFlags & BDEV_EXCLUSIVE) && stat(sPath, &st) == 0 && S_ISBLK(st.st_mode))
+		nFlags |= O_EXCL;
+
+#ifdef O_DIRECT
+	if(dwFlags & BDEV_NO_BUFFERING)
+	{
+		m_fd = open(sPath, nFlags | O_DIRECT, 0644);
+
+		// tmpfs and a few others refuse O_DIRECT, fall back to the page cache
+		if(m_fd < 0 && errno == EINVAL)
+		{
+			TRACE("O_DIRECT refused on %s, using buffered I/O\n", sPath);
+			dwFlags &= ~BDEV_NO_BUFFERING;
+		}
+	}
+#else
+	dwFlags &= ~BDEV_NO_BUFFERING;
+#endif
+
+	if(m_fd < 0)
+		m_fd = open(sPath, nFlags, 0644);
+
+	if(m_fd < 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	if(dwFlags & BDEV_SEQUENTIAL)
+		posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	m_dwFlags = dwFlags;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::OpenStdin()
+{
+	Close();
+
+	// own a duplicate so Close() leaves fd 0 alone
+	m_fd = fcntl(0, F_DUPFD_CLOEXEC, 0);
+	if(m_fd < 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	m_dwFlags = BDEV_READ | BDEV_STREAM;
+	m_nStreamPos = 0;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::OpenStdout()
+{
+	Close();
+
+	m_fd = fcntl(1, F_DUPFD_CLOEXEC, 0);
+	if(m_fd < 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	m_dwFlags = BDEV_WRITE | BDEV_STREAM;
+	m_nStreamPos = 0;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::Close()
+{
+	BOOL bReturn = TRUE;
+
+	if(m_fd >= 0)
+		bReturn = (close(m_fd) == 0);
+
+	m_fd = -1;
+	m_dwFlags = 0;
+
+	return bReturn;
+}
+
+BOOL CBlockDevice::IsOpen() const
+{
+	return m_fd >= 0;
+}
+
+BOOL CBlockDevice::Seek(UINT64 nOffset)
+{
+	if(lseek(m_fd, (off_t)nOffset, SEEK_SET) < 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::SeekEnd()
+{
+	if(lseek(m_fd, 0, SEEK_END) < 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::Read(void* pBuff, DWORD nBytes, DWORD* pnRead)
+{
+	DWORD dwDone = 0;
+
+	// read() may return short counts on pipes and devices, loop until EOF
+	while(dwDone < nBytes)
+	{
+		ssize_t n = read(m_fd, (BYTE*)pBuff + dwDone, nBytes - dwDone);
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			m_dwLastError = errno;
+			if(pnRead) *pnRead = dwDone;
+			return FALSE;
+		}
+		if(n == 0) break;
+		dwDone += (DWORD)n;
+	}
+
+	if(pnRead) *pnRead = dwDone;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::Write(const void* pBuff, DWORD nBytes, DWORD* pnWritten)
+{
+	DWORD dwDone = 0;
+
+	while(dwDone < nBytes)
+	{
+		ssize_t n = write(m_fd, (const BYTE*)pBuff + dwDone, nBytes - dwDone);
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			m_dwLastError = errno;
+			break;
+		}
+		if(n == 0)
+		{
+			m_dwLastError = ENOSPC;
+			break;
+		}
+		dwDone += (DWORD)n;
+	}
+
+	if(pnWritten) *pnWritten = dwDone;
+
+	return dwDone == nBytes;
+}
+
+BOOL CBlockDevice::Flush()
+{
+	// pipes have nothing to sync
+	if(m_dwFlags & BDEV_STREAM)
+		return TRUE;
+
+	if(fsync(m_fd) != 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+UINT64 CBlockDevice::GetSize()
+{
+	struct stat st;
+
+	if(m_fd < 0)
+		return 0;
+
+	if(fstat(m_fd, &st) != 0)
+	{
+		m_dwLastError = errno;
+		return 0;
+	}
+
+#ifdef BLKGETSIZE64
+	if(S_ISBLK(st.st_mode))
+	{
+		UINT64 nSize = 0;
+		if(ioctl(m_fd, BLKGETSIZE64, &nSize) != 0)
+		{
+			m_dwLastError = errno;
+			return 0;
+		}
+		return nSize;
+	}
+#endif
+
+	return (UINT64)st.st_size;
+}
+
+#endif // _WIN32
+
+#ifdef _WIN32
+
+// Explicit offsets through an OVERLAPPED block work on both plain and
+// overlapped handles and don't touch the shared file pointer.
+static BOOL OverlappedTransfer(HANDLE hFile, BOOL bWrite, UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pnDone)
+{
+	OVERLAPPED ov;
+	DWORD dwDone = 0;
+	BOOL bReturn;
+
+	ZeroMemory(&ov, sizeof(ov));
+	ov.Offset = (DWORD)nOffset;
+	ov.OffsetHigh = (DWORD)(nOffset >> 32);
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(!ov.hEvent) return FALSE;
+
+	HANDLE hEvent = ov.hEvent;
+
+	// low bit set: no completion packet if the handle is bound to a CIoQueue port
+	ov.hEvent = (HANDLE)((ULONG_PTR)hEvent | 1);
+
+	if(bWrite)
+		bReturn = WriteFile(hFile, pBuff, nBytes, NULL, &ov);
+	else
+		bReturn = ReadFile(hFile, pBuff, nBytes, NULL, &ov);
+
+	if(bReturn || ::GetLastError() == ERROR_IO_PENDING)
+		bReturn = GetOverlappedResult(hFile, &ov, &dwDone, TRUE);
+
+	if(!bReturn && !bWrite && ::GetLastError() == ERROR_HANDLE_EOF)
+		bReturn = TRUE;
+
+	DWORD dwError = ::GetLastError();
+	CloseHandle(hEvent);
+	SetLastError(dwError);
+
+	if(pnDone) *pnDone = dwDone;
+
+	return bReturn;
+}
+
+BOOL CBlockDevice::ReadAt(UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pnRead)
+{
+	if(m_dwFlags & BDEV_STREAM)
+		return StreamReadAt(nOffset, pBuff, nBytes, pnRead);
+
+	if(!OverlappedTransfer(m_hFile, FALSE, nOffset, pBuff, nBytes, pnRead))
+	{
+		m_dwLastError = ::GetLastError();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::WriteAt(UINT64 nOffset, const void* pBuff, DWORD nBytes, DWORD* pnWritten)
+{
+	DWORD dwWritten = 0;
+
+	if(m_dwFlags & BDEV_STREAM)
+		return StreamWriteAt(nOffset, pBuff, nBytes, pnWritten);
+
+	if(!OverlappedTransfer(m_hFile, TRUE, nOffset, (void*)pBuff, nBytes, &dwWritten))
+	{
+		m_dwLastError = ::GetLastError();
+		if(pnWritten) *pnWritten = dwWritten;
+		return FALSE;
+	}
+
+	if(pnWritten) *pnWritten = dwWritten;
+
+	return dwWritten == nBytes;
+}
+
+// No general scatter read on Win32 (ReadFileScatter wants page sized,
+// unbuffered segments): one positioned read per segment.
+BOOL CBlockDevice::ReadV(UINT64 nOffset, const IO_SEGMENT* pSegments, UINT32 nSegments, DWORD* pnRead)
+{
+	DWORD dwDone = 0;
+
+	for(UINT32 i = 0; i < nSegments; i++)
+	{
+		DWORD dwRead = 0;
+
+		if(!ReadAt(nOffset + dwDone, pSegments[i].pBuff, pSegments[i].nBytes, &dwRead))
+		{
+			if(pnRead) *pnRead = dwDone + dwRead;
+			return FALSE;
+		}
+
+		dwDone += dwRead;
+		if(dwRead < pSegments[i].nBytes) break;
+	}
+
+	if(pnRead) *pnRead = dwDone;
+
+	return TRUE;
+}
+
+// Same for writes (WriteFileGather has the same limits): one positioned write
+// per segment.
+BOOL CBlockDevice::WriteV(UINT64 nOffset, const IO_SEGMENT* pSegments, UINT32 nSegments, DWORD* pnWritten)
+{
+	DWORD dwDone = 0;
+
+	for(UINT32 i = 0; i < nSegments; i++)
+	{
+		DWORD dwWritten = 0;
+
+		if(!WriteAt(nOffset + dwDone, pSegments[i].pBuff, pSegments[i].nBytes, &dwWritten))
+		{
+			if(pnWritten) *pnWritten = dwDone + dwWritten;
+			return FALSE;
+		}
+
+		dwDone += dwWritten;
+	}
+
+	if(pnWritten) *pnWritten = dwDone;
+
+	return TRUE;
+}
+
+// DeviceIoControl on a handle that may have been opened overlapped
+static BOOL DeviceControl(HANDLE hFile, DWORD dwCode, void* pIn, DWORD nIn)
+{
+	OVERLAPPED ov;
+	DWORD dwDone = 0;
+	BOOL bReturn;
+
+	ZeroMemory(&ov, sizeof(ov));
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(!ov.hEvent) return FALSE;
+
+	HANDLE hEvent = ov.hEvent;
+	ov.hEvent = (HANDLE)((ULONG_PTR)hEvent | 1);
+
+	bReturn = DeviceIoControl(hFile, dwCode, pIn, nIn, NULL, 0, NULL, &ov);
+	if(bReturn || ::GetLastError() == ERROR_IO_PENDING)
+		bReturn = GetOverlappedResult(hFile, &ov, &dwDone, TRUE);
+
+	DWORD dwError = ::GetLastError();
+	CloseHandle(hEvent);
+	SetLastError(dwError);
+
+	return bReturn;
+}
+
+static BOOL SetZeroData(HANDLE hFile, UINT64 nOffset, UINT64 nBytes)
+{
+	FILE_ZERO_DATA_INFORMATION zero;
+
+	zero.FileOffset.QuadPart = nOffset;
+	zero.BeyondFinalZero.QuadPart = nOffset + nBytes;
+
+	return DeviceControl(hFile, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero));
+}
+
+BOOL CBlockDevice::ZeroRange(UINT64 nOffset, UINT64 nBytes)
+{
+	LARGE_INTEGER size;
+
+	// only files report a size here, disks fall through to zero buffers
+	if(GetFileSizeEx(m_hFile, &size))
+	{
+		if((UINT64)size.QuadPart < nOffset + nBytes)
+		{
+			FILE_END_OF_FILE_INFO eof;
+			eof.EndOfFile.QuadPart = nOffset + nBytes;
+
+			if(!SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &eof, sizeof(eof)))
+			{
+				m_dwLastError = ::GetLastError();
+				return FALSE;
+			}
+		}
+
+		if(SetZeroData(m_hFile, nOffset, nBytes))
+			return TRUE;
+
+		TRACE("FSCTL_SET_ZERO_DATA failed with error 0x%08X\n", ::GetLastError());
+	}
+
+	return WriteZeroes(nOffset, nBytes);
+}
+
+// IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES input with a single range
+typedef struct _TRIM_REQUEST
+{
+	DEVICE_MANAGE_DATA_SET_ATTRIBUTES	attr;
+	DEVICE_DATA_SET_RANGE				range;
+} TRIM_REQUEST;
+
+BOOL CBlockDevice::Discard(UINT64 nOffset, UINT64 nBytes)
+{
+	TRIM_REQUEST trim;
+
+	while(nBytes)
+	{
+		// keep each TRIM range well under what drivers accept
+		UINT64 nChunk = nBytes < 0x40000000 ? nBytes : 0x40000000;
+
+		ZeroMemory(&trim, sizeof(trim));
+		trim.attr.Size = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES);
+		trim.attr.Action = DeviceDsmAction_Trim;
+		trim.attr.Flags = DEVICE_DSM_FLAG_TRIM_NOT_FS_ALLOCATED;
+		trim.attr.DataSetRangesOffset = offsetof(TRIM_REQUEST, range);
+		trim.attr.DataSetRangesLength = sizeof(DEVICE_DATA_SET_RANGE);
+		trim.range.StartingOffset = nOffset;
+		trim.range.LengthInBytes = nChunk;
+
+		if(!DeviceControl(m_hFile, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &trim, sizeof(trim)))
+		{
+			// not a disk: deallocate the range of a (sparse) file instead
+			if(!SetZeroData(m_hFile, nOffset, nBytes))
+			{
+				m_dwLastError = ::GetLastError();
+				return FALSE;
+			}
+			return TRUE;
+		}
+
+		nOffset += nChunk;
+		nBytes -= nChunk;
+	}
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::Preallocate(UINT64 nOffset, UINT64 nBytes)
+{
+	LARGE_INTEGER size;
+
+	if(!GetFileSizeEx(m_hFile, &size))
+	{
+		m_dwLastError = ::GetLastError();
+		return FALSE;
+	}
+
+	// NTFS allocates the clusters at once, the valid data length stays put so
+	// the new range still reads as zeroes without being written
+	if((UINT64)size.QuadPart >= nOffset + nBytes)
+		return TRUE;
+
+	return SetSize(nOffset + nBytes);
+}
+
+BOOL CBlockDevice::SetSize(UINT64 nSize)
+{
+	FILE_END_OF_FILE_INFO eof;
+
+	eof.EndOfFile.QuadPart = nSize;
+
+	if(!SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &eof, sizeof(eof)))
+	{
+		m_dwLastError = ::GetLastError();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#else // !_WIN32
+
+BOOL CBlockDevice::ReadAt(UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pnRead)
+{
+	DWORD dwDone = 0;
+
+	if(m_dwFlags & BDEV_STREAM)
+		return StreamReadAt(nOffset, pBuff, nBytes, pnRead);
+
+	while(dwDone < nBytes)
+	{
+		ssize_t n = pread(m_fd, (BYTE*)pBuff + dwDone, nBytes - dwDone, (off_t)(nOffset + dwDone));
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			m_dwLastError = errno;
+			if(pnRead) *pnRead = dwDone;
+			return FALSE;
+		}
+		if(n == 0) break;
+		dwDone += (DWORD)n;
+	}
+
+	if(pnRead) *pnRead = dwDone;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::WriteAt(UINT64 nOffset, const void* pBuff, DWORD nBytes, DWORD* pnWritten)
+{
+	DWORD dwDone = 0;
+
+	if(m_dwFlags & BDEV_STREAM)
+		return StreamWriteAt(nOffset, pBuff, nBytes, pnWritten);
+
+	while(dwDone < nBytes)
+	{
+		ssize_t n = pwrite(m_fd, (const BYTE*)pBuff + dwDone, nBytes - dwDone, (off_t)(nOffset + dwDone));
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			m_dwLastError = errno;
+			break;
+		}
+		if(n == 0)
+		{
+			m_dwLastError = ENOSPC;
+			break;
+		}
+		dwDone += (DWORD)n;
+	}
+
+	if(pnWritten) *pnWritten = dwDone;
+
+	return dwDone == nBytes;
+}
+
+BOOL CBlockDevice::ReadV(UINT64 nOffset, const IO_SEGMENT* pSegments, UINT32 nSegments, DWORD* pnRead)
+{
+	DWORD dwDone = 0;
+	struct iovec iov[64];
+
+	// preadv in batches, resuming inside a segment after a short read
+	UINT32 nSeg = 0;
+	DWORD nSkip = 0;
+
+	if(m_dwFlags & BDEV_STREAM)
+	{
+		for(; nSeg < nSegments; nSeg++)
+		{
+			DWORD dwRead = 0;
+
+			if(!StreamReadAt(nOffset + dwDone, pSegments[nSeg].pBuff, pSegments[nSeg].nBytes, &dwRead))
+			{
+				if(pnRead) *pnRead = dwDone + dwRead;
+				return FALSE;
+			}
+
+			dwDone += dwRead;
+			if(dwRead < pSegments[nSeg].nBytes) break;
+		}
+
+		if(pnRead) *pnRead = dwDone;
+		return TRUE;
+	}
+
+	while(nSeg < nSegments)
+	{
+		UINT32 nIov = 0;
+		for(UINT32 i = nSeg; i < nSegments && nIov < 64; i++, nIov++)
+		{
+			iov[nIov].iov_base = (BYTE*)pSegments[i].pBuff + (i == nSeg ? nSkip : 0);
+			iov[nIov].iov_len = pSegments[i].nBytes - (i == nSeg ? nSkip : 0);
+		}
+
+		ssize_t n = preadv(m_fd, iov, nIov, (off_t)(nOffset + dwDone));
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			m_dwLastError = errno;
+			if(pnRead) *pnRead = dwDone;
+			return FALSE;
+		}
+		if(n == 0) break;
+
+		dwDone += (DWORD)n;
+
+		// advance the segment cursor by n bytes
+		while(n > 0 && nSeg < nSegments)
+		{
+			DWORD nLeft = pSegments[nSeg].nBytes - nSkip;
+			if((DWORD)n < nLeft)
+			{
+				nSkip += (DWORD)n;
+				n = 0;
+			}
+			else
+			{
+				n -= nLeft;
+				nSeg++;
+				nSkip = 0;
+			}
+		}
+	}
+
+	if(pnRead) *pnRead = dwDone;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::WriteV(UINT64 nOffset, const IO_SEGMENT* pSegments, UINT32 nSegments, DWORD* pnWritten)
+{
+	DWORD dwDone = 0;
+	struct iovec iov[64];
+
+	// pwritev in batches, resuming inside a segment after a short write
+	UINT32 nSeg = 0;
+	DWORD nSkip = 0;
+
+	if(m_dwFlags & BDEV_STREAM)
+	{
+		for(; nSeg < nSegments; nSeg++)
+		{
+			DWORD dwWritten = 0;
+
+			if(!StreamWriteAt(nOffset + dwDone, pSegments[nSeg].pBuff, pSegments[nSeg].nBytes, &dwWritten))
+			{
+				if(pnWritten) *pnWritten = dwDone + dwWritten;
+				return FALSE;
+			}
+
+			dwDone += dwWritten;
+		}
+
+		if(pnWritten) *pnWritten = dwDone;
+		return TRUE;
+	}
+
+	while(nSeg < nSegments)
+	{
+		UINT32 nIov = 0;
+		for(UINT32 i = nSeg; i < nSegments && nIov < 64; i++, nIov++)
+		{
+			iov[nIov].iov_base = (BYTE*)pSegments[i].pBuff + (i == nSeg ? nSkip : 0);
+			iov[nIov].iov_len = pSegments[i].nBytes - (i == nSeg ? nSkip : 0);
+		}
+
+		ssize_t n = pwritev(m_fd, iov, nIov, (off_t)(nOffset + dwDone));
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			m_dwLastError = errno;
+			if(pnWritten) *pnWritten = dwDone;
+			return FALSE;
+		}
+		if(n == 0)
+		{
+			m_dwLastError = ENOSPC;
+			if(pnWritten) *pnWritten = dwDone;
+			return FALSE;
+		}
+
+		dwDone += (DWORD)n;
+
+		// advance the segment cursor by n bytes
+		while(n > 0 && nSeg < nSegments)
+		{
+			DWORD nLeft = pSegments[nSeg].nBytes - nSkip;
+			if((DWORD)n < nLeft)
+			{
+				nSkip += (DWORD)n;
+				n = 0;
+			}
+			else
+			{
+				n -= nLeft;
+				nSeg++;
+				nSkip = 0;
+			}
+		}
+	}
+
+	if(pnWritten) *pnWritten = dwDone;
+
+	return TRUE;
+}
+
+BOOL CBlockDevice::ZeroRange(UINT64 nOffset, UINT64 nBytes)
+{
+#ifdef __linux__
+	struct stat st;
+
+	if(fstat(m_fd, &st) != 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	if(S_ISBLK(st.st_mode))
+	{
+		// write-zeroes offload; the kernel falls back to writing zero pages itself
+		UINT64 range[2] = { nOffset, nBytes };
+		if(ioctl(m_fd, BLKZEROOUT, range) == 0)
+			return TRUE;
+
+		TRACE("BLKZEROOUT failed with error %d\n", errno);
+	}
+	else if(S_ISREG(st.st_mode))
+	{
+		if((UINT64)st.st_size < nOffset + nBytes && ftruncate(m_fd, (off_t)(nOffset + nBytes)) != 0)
+		{
+			m_dwLastError = errno;
+			return FALSE;
+		}
+
+		if(fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)nOffset, (off_t)nBytes) == 0)
+			return TRUE;
+
+		if(fallocate(m_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, (off_t)nOffset, (off_t)nBytes) == 0)
+			return TRUE;
+
+		TRACE("fallocate failed with error %d\n", errno);
+	}
+#endif
+
+	return WriteZeroes(nOffset, nBytes);
+}
+
+BOOL CBlockDevice::Discard(UINT64 nOffset, UINT64 nBytes)
+{
+#ifdef __linux__
+	struct stat st;
+
+	if(fstat(m_fd, &st) != 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	if(S_ISBLK(st.st_mode))
+	{
+		UINT64 range[2] = { nOffset, nBytes };
+		if(ioctl(m_fd, BLKDISCARD, range) == 0)
+			return TRUE;
+	}
+	else if(fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)nOffset, (off_t)nBytes) == 0)
+		return TRUE;
+
+	m_dwLastError = errno;
+#else
+	m_dwLastError = ENOTSUP;
+#endif
+
+	return FALSE;
+}
+
+BOOL CBlockDevice::Preallocate(UINT64 nOffset, UINT64 nBytes)
+{
+#ifdef __linux__
+	if(fallocate(m_fd, 0, (off_t)nOffset, (off_t)nBytes) == 0)
+		return TRUE;
+
+	m_dwLastError = errno;
+#else
+	m_dwLastError = ENOTSUP;
+#endif
+
+	return FALSE;
+}
+
+BOOL CBlockDevice::SetSize(UINT64 nSize)
+{
+	if(ftruncate(m_fd, (off_t)nSize) != 0)
+	{
+		m_dwLastError = errno;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#endif // _WIN32
+
+// ReadAt on a forward-only stream: skip up to nOffset, then read sequentially
+BOOL CBlockDevice::StreamReadAt(UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pnRead)
+{
+	BYTE skip[4096];
+	DWORD dwRead = 0;
+
+	if(pnRead) *pnRead = 0;
+
+	if(nOffset < m_nStreamPos)
+	{
+		TRACE("Stream read at %llu, already past %llu\n", (unsigned long long)nOffset, (unsigned long long)m_nStreamPos);
+#ifdef _WIN32
+		m_dwLastError = ERROR_SEEK;
+#else
+		m_dwLastError = ESPIPE;
+#endif
+		return FALSE;
+	}
+
+	while(m_nStreamPos < nOffset)
+	{
+		DWORD n = (nOffset - m_nStreamPos) < sizeof(skip) ? (DWORD)(nOffset - m_nStreamPos) : sizeof(skip);
+
+		if(!Read(skip, n, &dwRead))
+			return FALSE;
+
+		m_nStreamPos += dwRead;
+		if(dwRead < n)
+			return TRUE;	// EOF before the range
+	}
+
+	BOOL bReturn = Read(pBuff, nBytes, &dwRead);
+
+	m_nStreamPos += dwRead;
+	if(pnRead) *pnRead = dwRead;
+
+	return bReturn;
+}
+
+// WriteAt on a forward-only stream: zeroes up to nOffset, then write sequentially
+BOOL CBlockDevice::StreamWriteAt(UINT64 nOffset, const void* pBuff, DWORD nBytes, DWORD* pnWritten)
+{
+	BYTE zero[4096];
+	DWORD dwWritten = 0;
+
+	if(pnWritten) *pnWritten = 0;
+
+	if(nOffset < m_nStreamPos)
+	{
+		TRACE("Stream write at %llu, already past %llu\n", (unsigned long long)nOffset, (unsigned long long)m_nStreamPos);
+#ifdef _WIN32
+		m_dwLastError = ERROR_SEEK;
+#else
+		m_dwLastError = ESPIPE;
+#endif
+		return FALSE;
+	}
+
+	ZeroMemory(zero, sizeof(zero));
+
+	while(m_nStreamPos < nOffset)
+	{
+		DWORD n = (nOffset - m_nStreamPos) < sizeof(zero) ? (DWORD)(nOffset - m_nStreamPos) : sizeof(zero);
+
+		BOOL bReturn = Write(zero, n, &dwWritten);
+		m_nStreamPos += dwWritten;
+		if(!bReturn)
+			return FALSE;
+	}
+
+	BOOL bReturn = Write(pBuff, nBytes, &dwWritten);
+
+	m_nStreamPos += dwWritten;
+	if(pnWritten) *pnWritten = dwWritten;
+
+	return bReturn;
+}
+
+// Fallback for ZeroRange: plain writes from an aligned zero buffer
+BOOL CBlockDevice::WriteZeroes(UINT64 nOffset, UINT64 nBytes)
+{
+	const DWORD nChunk = 1024 * 1024;
+	BOOL bReturn = TRUE;
+
+	BYTE* pZero = (BYTE*)AllocAligned(nChunk);
+	if(!pZero) return FALSE;
+
+	ZeroMemory(pZero, nChunk);
+
+	while(bReturn && nBytes)
+	{
+		DWORD n = nBytes < nChunk ? (DWORD)nBytes : nChunk;
+
+		bReturn = WriteAt(nOffset, pZero, n, NULL);
+
+		nOffset += n;
+		nBytes -= n;
+	}
+
+	FreeAligned(pZero);
+
+	return bReturn;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+// Thin wrapper over a file or a raw block device.
+// Win32: HANDLE from CreateFile (\\.\PhysicalDriveN or a regular file)
+// POSIX: file descriptor (/dev/sdX, /dev/nvme0n1 or a regular image file)
+
+#define BDEV_READ			0x0001
+#define BDEV_WRITE			0x0002
+#define BDEV_CREATE			0x0004	// create or truncate
+#define BDEV_WRITE_THROUGH	0x0010	// FILE_FLAG_WRITE_THROUGH / O_DSYNC
+#define BDEV_NO_BUFFERING	0x0020	// FILE_FLAG_NO_BUFFERING / O_DIRECT
+#define BDEV_SEQUENTIAL		0x0040	// FILE_FLAG_SEQUENTIAL_SCAN / POSIX_FADV_SEQUENTIAL
+#define BDEV_SHARE_WRITE	0x0100	// let other handles write (source drive left online)
+#define BDEV_EXCLUSIVE		0x0200	// no sharing; refuses a mounted block device on Linux
+#define BDEV_BACKUP_SEMANTICS	0x0400	// Win32 only: retry with FILE_FLAG_BACKUP_SEMANTICS
+#define BDEV_OVERLAPPED		0x0800	// Win32 only: FILE_FLAG_OVERLAPPED, for CIoQueue
+#define BDEV_STREAM			0x1000	// set by OpenStdin/OpenStdout: forward-only transfers, see ReadAt/WriteAt
+
+// One piece of a scatter/gather transfer
+typedef struct _IO_SEGMENT
+{
+	void*		pBuff;
+	DWORD		nBytes;
+} IO_SEGMENT;
+
+class CBlockDevice
+{
+#ifdef _WIN32
+	HANDLE		m_hFile;
+#else
+	int			m_fd;
+#endif
+	DWORD		m_dwFlags;
+	DWORD		m_dwLastError;
+	UINT64		m_nStreamPos;	// BDEV_STREAM: bytes consumed so far
+
+public:
+	CBlockDevice(void);
+	~CBlockDevice(void);
+
+	BOOL Open(LPCPATH sPath, DWORD dwFlags);
+
+	// Read from standard input (a pipe, most likely). Positional reads still
+	// work as long as offsets never go backwards: gaps are read and dropped.
+	BOOL OpenStdin();
+
+	// Write to standard output. Positional writes work as long as offsets never
+	// go backwards: gaps are filled with zeroes.
+	BOOL OpenStdout();
+	BOOL Close();
+	BOOL IsOpen() const;
+
+	BOOL Seek(UINT64 nOffset);
+	BOOL SeekEnd();
+
+	// Sequential I/O at the current position (not on BDEV_OVERLAPPED handles)
+	BOOL Read(void* pBuff, DWORD nBytes, DWORD* pnRead);
+	BOOL Write(const void* pBuff, DWORD nBytes, DWORD* pnWritten);
+
+	// Positional I/O, safe to call from several threads at once
+	BOOL ReadAt(UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pnRead);
+	BOOL WriteAt(UINT64 nOffset, const void* pBuff, DWORD nBytes, DWORD* pnWritten);
+
+	// Vectored read of one contiguous file range into nSegments buffers
+	BOOL ReadV(UINT64 nOffset, const IO_SEGMENT* pSegments, UINT32 nSegments, DWORD* pnRead);
+
+	// Vectored write of nSegments buffers to one contiguous file range
+	BOOL WriteV(UINT64 nOffset, const IO_SEGMENT* pSegments, UINT32 nSegments, DWORD* pnWritten);
+
+	// Make a range read back as zeroes: offloaded to the device (write-zeroes,
+	// hole punching) where possible, zero buffers written otherwise.
+	// A regular file is extended to cover the range.
+	BOOL ZeroRange(UINT64 nOffset, UINT64 nBytes);
+
+	// Tell the device a range is unused (TRIM/UNMAP, hole punching). Contents
+	// read back afterwards are unspecified on block devices. FALSE if unsupported.
+	BOOL Discard(UINT64 nOffset, UINT64 nBytes);
+
+	// Allocate space for a range of a regular file in one go (fallocate, or
+	// extending the end of file on Win32), so it isn't laid out piecemeal as
+	// writes arrive. The file grows to cover the range, reading back zeroes.
+	BOOL Preallocate(UINT64 nOffset, UINT64 nBytes);
+
+	// Set the size of a regular file, cutting off or zero-extending its end
+	BOOL SetSize(UINT64 nSize);
+
+	BOOL Flush();
+
+	// Size in bytes of the file or of the whole device, 0 on failure
+	UINT64 GetSize();
+
+	DWORD GetFlags() const { return m_dwFlags; }
+	DWORD GetLastError() const { return m_dwLastError; }
+
+#ifdef _WIN32
+	HANDLE GetHandle() const { return m_hFile; }
+#else
+	int GetFd() const { return m_fd; }
+#endif
+
+private:
+	BOOL WriteZeroes(UINT64 nOffset, UINT64 nBytes);
+	BOOL StreamReadAt(UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pnRead);
+	BOOL StreamWriteAt(UINT64 nOffset, const void* pBuff, DWORD nBytes, DWORD* pnWritten);
+
+	CBlockDevice(const CBlockDevice&);
+	CBlockDevice& operator=(const CBlockDevice&);
+};
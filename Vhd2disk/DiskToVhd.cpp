@@ -1,124 +1,511 @@
-#include "StdAfx.h"
+#include "stdafx.h"
 #include "Trace.h"
 #include "DiskToVhd.h"
-#include "resource.h"
+#include "ZeroScan.h"
+#include "IoQueue.h"
+#include "WriteBehind.h"
 #include <time.h>
-#include <winioctl.h>
 
-CDiskToVhd::CDiskToVhd(void)
+// Offset, size and memory alignment of unbuffered I/O, good for 512e and 4Kn
+#define CAPTURE_DIRECT_ALIGN	4096
+
+// Auto block size: windows of 32 MB read in full, up to 16 of them spread
+// over the disk and no more than 1/16 of it, each granule checked for data
+#define SAMPLE_WINDOWS			16
+#define SAMPLE_WINDOW			(32 * 1024 * 1024)
+#define SAMPLE_GRANULE			(64 * 1024)
+#define SAMPLE_CHUNK			(4 * 1024 * 1024)		// read at a time
+#define SAMPLE_SIZES			6		// 1 MB to SAMPLE_WINDOW
+
+#define CAPTURE_PATH_MAX		1024	// parent locator paths, in characters
+
+// Preallocation: at least this much more each time the writes outgrow it
+#define CAPTURE_PREALLOC_STEP	(1024ULL * 1024 * 1024)
+
+// One block travelling through the capture queue: read into the data part of
+// pBuff, then written out with its bitmap in front
+typedef struct _CAPTURE_SLOT
+{
+	IO_REQUEST	req;
+	BYTE*		pBuff;		// bitmap, then the block data
+	UINT32		nBlock;
+	BOOL		bReady;		// read done, waiting for its turn to be appended
+	BOOL		bFree;		// not read at all, the filesystems don't use it
+	UINT32		nPending;	// reads in flight, the parent's included
+
+	// Differencing capture: the parent's content of the block, one read per run
+	BYTE*		pParent;
+	VHD_RUN*	pRuns;
+	IO_REQUEST*	pParentReqs;
+} CAPTURE_SLOT;
+
+void InitCaptureOptions(CAPTURE_OPTIONS* pOptions)
 {
-	m_hVhdFile = NULL;
-	m_hPhysicalDrive = NULL;
+	ZeroMemory(pOptions, sizeof(CAPTURE_OPTIONS));
+	pOptions->dwDiskType = VHD_TYPE_DYNAMIC;
+	pOptions->nQueueDepth = 4;
+	pOptions->nBlockSize = 0;
+	pOptions->nLogicalSector = 512;
+	pOptions->nPhysicalSector = 4096;
+}
+
+// Captures to a path ending in .vhdx are written as VHDX
+static BOOL IsVhdxPath(LPCPATH sPath)
+{
+	size_t n = 0;
+
+	while(sPath[n]) n++;
+	if(n < 5)
+		return FALSE;
+
+	sPath += n - 5;
+	return sPath[0] == '.' && (sPath[1] | 0x20) == 'v' && (sPath[2] | 0x20) == 'h'
+		&& (sPath[3] | 0x20) == 'd' && (sPath[4] | 0x20) == 'x';
+}
+
 
+CDiskToVhd::CDiskToVhd(void)
+{
 	ZeroMemory(&m_Foot, sizeof(VHD_FOOTER));
 	ZeroMemory(&m_Dyn, sizeof(VHD_DYNAMIC));
+	InitCaptureOptions(&m_Options);
+	m_sVhdPath = NULL;
+	m_bStream = FALSE;
+	m_nReserved = 0;
+	m_pLocators = NULL;
+	m_nLocatorBytes = 0;
 }
 
 CDiskToVhd::~CDiskToVhd(void)
 {
-	if(m_hVhdFile)
+	if(m_VhdFile.IsOpen())
 		CloseVhdFile();
 
-	if(m_hPhysicalDrive)
+	if(m_PhysicalDrive.IsOpen())
 		ClosePhysicalDrive();
+
+	delete[] m_pLocators;
 }
 
-BOOL CDiskToVhd::OpenPhysicalDrive(LPWSTR sDrive)
+BOOL CDiskToVhd::OpenPhysicalDrive(LPCPATH sDrive)
 {
-	m_hPhysicalDrive = CreateFile(sDrive
-		, GENERIC_READ
-		, FILE_SHARE_READ | FILE_SHARE_WRITE
-		, NULL
-		, OPEN_EXISTING
-		, FILE_FLAG_SEQUENTIAL_SCAN
-		, NULL);
-
-	if(m_hPhysicalDrive == INVALID_HANDLE_VALUE)
-	{
-		DWORD error = GetLastError();
-		m_hPhysicalDrive = NULL;
-		
-		// Try with backup privileges for better access
-		m_hPhysicalDrive = CreateFile(sDrive
-			, GENERIC_READ
-			, FILE_SHARE_READ | FILE_SHARE_WRITE
-			, NULL
-			, OPEN_EXISTING
-			, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_SEQUENTIAL_SCAN
-			, NULL);
-			
-		if(m_hPhysicalDrive == INVALID_HANDLE_VALUE)
-		{
-			m_hPhysicalDrive = NULL;
-			return FALSE;
-		}
-	}
+	return m_PhysicalDrive.Open(sDrive
+		, BDEV_READ | BDEV_SHARE_WRITE | BDEV_SEQUENTIAL | BDEV_BACKUP_SEMANTICS | BDEV_OVERLAPPED
+		| (m_Options.bUnbuffered ? BDEV_NO_BUFFERING : 0));
+}
+
+BOOL CDiskToVhd::ClosePhysicalDrive()
+{
+	m_PhysicalDrive.Close();
+
+	// the parent is read alongside the source
+	m_Parent.Close();
 
 	return TRUE;
 }
 
-BOOL CDiskToVhd::ClosePhysicalDrive()
+BOOL CDiskToVhd::CreateVhdFile(LPCPATH sPath)
 {
-	if(m_hPhysicalDrive)
+	m_sVhdPath = sPath;
+	m_nReserved = 0;
+
+	// "-" writes the VHD to standard output
+	m_bStream = sPath[0] == '-' && sPath[1] == 0;
+	if(m_bStream)
+		return m_VhdFile.OpenStdout();
+
+	return m_VhdFile.Open(sPath, BDEV_WRITE | BDEV_EXCLUSIVE | BDEV_CREATE | BDEV_OVERLAPPED);
+}
+
+// Unbuffered captures write the payload through an unbuffered handle and the
+// headers, BAT, footer and an unaligned tail through a buffered one
+BOOL CDiskToVhd::ReopenVhdFile(BOOL bUnbuffered)
+{
+	// a pipe can't be reopened, nor bypass any cache
+	if(m_bStream)
+		return TRUE;
+
+	if(!m_VhdFile.Flush())
+		return FALSE;
+
+	return m_VhdFile.Open(m_sVhdPath, BDEV_WRITE | BDEV_EXCLUSIVE | BDEV_OVERLAPPED
+		| (bUnbuffered ? BDEV_NO_BUFFERING : 0));
+}
+
+BOOL CDiskToVhd::CloseVhdFile()
+{
+	m_VhdFile.Close();
+
+	return TRUE;
+}
+
+UINT64 CDiskToVhd::GetDiskSize()
+{
+	if(!m_PhysicalDrive.IsOpen())
+		return 0;
+
+	return m_PhysicalDrive.GetSize();
+}
+
+// Bytes stored in front of each block's data: its bitmap, which an unbuffered
+// capture pads at the front so block data stays aligned in the file
+UINT32 CDiskToVhd::GetBlockHeadSize(UINT32 blockSize)
+{
+	UINT32 bitmapSize = (blockSize / 512 / 8 + 511) & ~511;
+
+	if(m_Options.bUnbuffered)
+		return (bitmapSize + CAPTURE_DIRECT_ALIGN - 1) & ~(CAPTURE_DIRECT_ALIGN - 1);
+
+	return bitmapSize;
+}
+
+// First block offset: the BAT (a stream's places, see WriteBlockAllocationTable),
+// then any parent locators
+UINT64 CDiskToVhd::GetDataStart(UINT32 totalBlocks)
+{
+	UINT64 nStart = ((1536 + (UINT64)totalBlocks * 4 + 511) & ~511ULL) + m_nLocatorBytes;
+
+	if(m_Options.bUnbuffered)
+		nStart = (nStart + CAPTURE_DIRECT_ALIGN - 1) & ~(UINT64)(CAPTURE_DIRECT_ALIGN - 1);
+
+	return nStart;
+}
+
+// Grows the preallocated part of the VHD file to nEnd, or by a whole step
+// once the first estimate falls short. Failing only costs the layout, the
+// writes extend the file as usual.
+void CDiskToVhd::ReserveVhdSpace(UINT64 nEnd)
+{
+	if(!m_Options.bPreallocate || m_bStream || nEnd <= m_nReserved)
+		return;
+
+	if(m_nReserved && nEnd < m_nReserved + CAPTURE_PREALLOC_STEP)
+		nEnd = m_nReserved + CAPTURE_PREALLOC_STEP;
+
+	UINT64 nOffset = m_nReserved;
+	m_nReserved = nEnd;
+
+	if(!m_VhdFile.Preallocate(nOffset, nEnd - nOffset))
+		TRACE("Failed to preallocate %llu bytes at %llu with error 0x%08X\n"
+			, (unsigned long long)(nEnd - nOffset), (unsigned long long)nOffset, m_VhdFile.GetLastError());
+}
+
+// Cuts off what was preallocated past nSize, where the footer goes
+BOOL CDiskToVhd::TrimVhdFile(UINT64 nSize)
+{
+	if(!m_nReserved)
+		return TRUE;
+
+	return m_VhdFile.SetSize(nSize);
+}
+
+// Blocks holding anything the filesystems use according to map, all of them
+// where it knows nothing
+static UINT64 CountBlocksInUse(const CFreeSpaceMap& map, UINT64 diskSize, UINT32 blockSize)
+{
+	UINT64 nInUse = 0;
+
+	for(UINT64 diskPos = 0; diskPos < diskSize; diskPos += blockSize)
+	{
+		if(!map.IsFree(diskPos, (diskSize - diskPos) < blockSize ? diskSize - diskPos : blockSize))
+			nInUse++;
+	}
+
+	return nInUse;
+}
+
+static BOOL IsPathSeparator(PATHCHAR c)
+{
+#ifdef _WIN32
+	return c == '\\' || c == '/';
+#else
+	return c == '/';
+#endif
+}
+
+static BOOL GetFullPath(LPCPATH sPath, PATHCHAR* sFull, size_t nMax)
+{
+#ifdef _WIN32
+	DWORD n = GetFullPathNameW(sPath, (DWORD)nMax, sFull, NULL);
+	return n > 0 && n < nMax;
+#else
+	char* sReal = realpath(sPath, NULL);
+	size_t n = sReal ? strlen(sReal) : 0;
+	BOOL bReturn = sReal && n < nMax;
+
+	if(bReturn)
+		memcpy(sFull, sReal, n + 1);
+
+	free(sReal);
+	return bReturn;
+#endif
+}
+
+// Path of sTo relative to the directory holding sFrom, both full paths, in
+// the ".\\name" or "..\\dir\\name" form of the W2ru locator
+static BOOL GetRelativePath(LPCPATH sFrom, LPCPATH sTo, PATHCHAR* sOut, size_t nMax)
+{
+	size_t nCommon = 0;
+	size_t nLen = 0;
+
+	for(size_t i = 0; sFrom[i] && sFrom[i] == sTo[i]; i++)
+		if(IsPathSeparator(sFrom[i]))
+			nCommon = i + 1;
+
+	// not even a root in common (another drive)
+	if(!nCommon)
+		return FALSE;
+
+	for(size_t i = nCommon; sFrom[i]; i++)
+	{
+		if(!IsPathSeparator(sFrom[i]))
+			continue;
+
+		if(nLen + 3 >= nMax)
+			return FALSE;
+		sOut[nLen++] = '.';
+		sOut[nLen++] = '.';
+		sOut[nLen++] = '\\';
+	}
+
+	if(!nLen)
 	{
-		CloseHandle(m_hPhysicalDrive);
-		m_hPhysicalDrive = NULL;
+		sOut[nLen++] = '.';
+		sOut[nLen++] = '\\';
 	}
 
+	for(size_t i = nCommon; sTo[i]; i++)
+	{
+		if(nLen + 1 >= nMax)
+			return FALSE;
+		sOut[nLen++] = sTo[i];
+	}
+
+	sOut[nLen] = 0;
 	return TRUE;
 }
 
-BOOL CDiskToVhd::CreateVhdFile(LPWSTR sPath)
+// UTF-16 (POSIX paths are UTF-8) with Windows separators, no terminator.
+// Returns the byte count.
+static UINT32 EncodeUtf16(LPCPATH sPath, BYTE* pOut, UINT32 nMax, BOOL bBigEndian)
 {
-	m_hVhdFile = CreateFile(sPath
-		, GENERIC_WRITE
-		, 0
-		, NULL
-		, CREATE_ALWAYS
-		, FILE_ATTRIBUTE_NORMAL
-		, NULL);
+	UINT32 nBytes = 0;
 
-	if(m_hVhdFile == INVALID_HANDLE_VALUE)
+	for(size_t i = 0; sPath[i]; i++)
 	{
-		m_hVhdFile = NULL;
+		UINT32 c = (UINT32)sPath[i];
+
+#ifndef _WIN32
+		BYTE b = (BYTE)sPath[i];
+		UINT32 nMore = b >= 0xF0 ? 3 : b >= 0xE0 ? 2 : b >= 0xC0 ? 1 : 0;
+
+		c = nMore ? b & (0x3F >> nMore) : b;
+		for(UINT32 n = 0; n < nMore && (sPath[i + 1] & 0xC0) == 0x80; n++)
+			c = (c << 6) | (sPath[++i] & 0x3F);
+#endif
+
+		if(c == '/')
+			c = '\\';
+
+		UINT32 units[2] = { c, 0 };
+		UINT32 nUnits = 1;
+		if(c >= 0x10000)
+		{
+			units[0] = 0xD800 + ((c - 0x10000) >> 10);
+			units[1] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+			nUnits = 2;
+		}
+
+		for(UINT32 u = 0; u < nUnits; u++)
+		{
+			if(nBytes + 2 > nMax)
+				return nBytes;
+
+			pOut[nBytes++] = (BYTE)(bBigEndian ? units[u] >> 8 : units[u]);
+			pOut[nBytes++] = (BYTE)(bBigEndian ? units[u] : units[u] >> 8);
+		}
+	}
+
+	return nBytes;
+}
+
+// Differencing header: the parent's file name, then an absolute (W2ku) and a
+// relative (W2ru) locator stored right after the BAT
+BOOL CDiskToVhd::InitializeParentLocators()
+{
+	PATHCHAR sParent[CAPTURE_PATH_MAX];
+	PATHCHAR sChild[CAPTURE_PATH_MAX];
+	PATHCHAR sRelative[CAPTURE_PATH_MAX];
+	BYTE data[2][CAPTURE_PATH_MAX * 2];
+	UINT32 nData[2] = {0};
+	UINT32 nLocators = 0;
+
+	if(!GetFullPath(m_Options.sParentPath, sParent, CAPTURE_PATH_MAX))
 		return FALSE;
+
+	size_t nName = 0;
+	for(size_t i = 0; sParent[i]; i++)
+		if(IsPathSeparator(sParent[i]))
+			nName = i + 1;
+
+	ZeroMemory(m_Dyn.parentUnicodeName, sizeof(m_Dyn.parentUnicodeName));
+	EncodeUtf16(sParent + nName, m_Dyn.parentUnicodeName, sizeof(m_Dyn.parentUnicodeName) - 2, TRUE);
+
+	nData[0] = EncodeUtf16(sParent, data[0], sizeof(data[0]), FALSE);
+	// where a stream ends up is unknown, it only gets the absolute locator
+	if(!m_bStream && GetFullPath(m_sVhdPath, sChild, CAPTURE_PATH_MAX) && GetRelativePath(sChild, sParent, sRelative, CAPTURE_PATH_MAX))
+		nData[1] = EncodeUtf16(sRelative, data[1], sizeof(data[1]), FALSE);
+
+	delete[] m_pLocators;
+	m_pLocators = new BYTE[sizeof(data)];
+	m_nLocatorBytes = 0;
+	if(!m_pLocators)
+		return FALSE;
+
+	UINT64 nOffset = (1536 + (UINT64)_byteswap_ulong(m_Dyn.maxTableEntries) * 4 + 511) & ~511ULL;
+
+	for(UINT32 i = 0; i < 2; i++)
+	{
+		if(!nData[i])
+			continue;
+
+		UINT32 nSpace = (nData[i] + 511) & ~511U;
+
+		memcpy(m_Dyn.partentLocator[nLocators].platformCode, i ? "W2ru" : "W2ku", 4);
+		m_Dyn.partentLocator[nLocators].platformDataSpace = _byteswap_ulong(nSpace);
+		m_Dyn.partentLocator[nLocators].platformDataLength = _byteswap_ulong(nData[i]);
+		m_Dyn.partentLocator[nLocators].platformDataOffset = _byteswap_uint64(nOffset + m_nLocatorBytes);
+
+		ZeroMemory(m_pLocators + m_nLocatorBytes, nSpace);
+		memcpy(m_pLocators + m_nLocatorBytes, data[i], nData[i]);
+		m_nLocatorBytes += nSpace;
+		nLocators++;
 	}
 
-	return TRUE;
+	return nLocators > 0;
 }
 
-BOOL CDiskToVhd::CloseVhdFile()
+// Largest block size storing barely more than 1 MB blocks would (within 1/32
+// of the disk): big blocks on full disks, small ones where data is scattered
+UINT32 CDiskToVhd::SampleBlockSize(UINT64 diskSize, CProgressSink* pSink)
 {
-	if(m_hVhdFile)
+	UINT64 nBlocks[SAMPLE_SIZES] = {0};
+	UINT64 nUsed[SAMPLE_SIZES] = {0};
+	BYTE used[SAMPLE_WINDOW / SAMPLE_GRANULE];
+	UINT32 nWindows = (UINT32)(diskSize / 16 / SAMPLE_WINDOW);
+	UINT64 nSampled = 0;
+	UINT32 blockSize = CAPTURE_BLOCK_MIN;
+	BOOL bDirectIn = (m_PhysicalDrive.GetFlags() & BDEV_NO_BUFFERING) != 0;
+	DWORD bytesRead;
+
+	BYTE* pChunk = (BYTE*)AllocAligned(SAMPLE_CHUNK, CAPTURE_DIRECT_ALIGN);
+	if(!pChunk)
+		return 2 * 1024 * 1024;
+
+	pSink->Status("Sampling the disk to pick a block size...");
+
+	if(nWindows < 1)
+		nWindows = 1;
+	if(nWindows > SAMPLE_WINDOWS)
+		nWindows = SAMPLE_WINDOWS;
+
+	// Windows start on a multiple of every block size sampled
+	UINT64 nSpacing = (diskSize / nWindows) & ~(UINT64)(SAMPLE_WINDOW - 1);
+	if(nSpacing < SAMPLE_WINDOW)
+		nSpacing = SAMPLE_WINDOW;
+
+	for(UINT32 w = 0; w < nWindows; w++)
+	{
+		UINT64 nStart = w * nSpacing;
+
+		ZeroMemory(used, sizeof(used));
+
+		for(UINT32 c = 0; c < SAMPLE_WINDOW; c += SAMPLE_CHUNK)
+		{
+			UINT64 nOffset = nStart + c;
+			if(nOffset >= diskSize)
+				break;
+
+			DWORD nBytes = diskSize - nOffset < SAMPLE_CHUNK ? (DWORD)(diskSize - nOffset) : SAMPLE_CHUNK;
+			DWORD nAsked = bDirectIn ? (nBytes + CAPTURE_DIRECT_ALIGN - 1) & ~(CAPTURE_DIRECT_ALIGN - 1) : nBytes;
+
+			if(m_FreeSpace.IsFree(nOffset, nBytes))
+				continue;
+
+			// An unreadable chunk counts as data
+			if(!m_PhysicalDrive.ReadAt(nOffset, pChunk, nAsked, &bytesRead) || bytesRead < nBytes)
+			{
+				memset(used + c / SAMPLE_GRANULE, 1, SAMPLE_CHUNK / SAMPLE_GRANULE);
+				continue;
+			}
+
+			m_FreeSpace.ZeroFree(nOffset, pChunk, nBytes);
+			nSampled += nBytes;
+
+			for(DWORD g = 0; g < nBytes; g += SAMPLE_GRANULE)
+				used[(c + g) / SAMPLE_GRANULE] = !IsZeroBlock(pChunk + g, nBytes - g < SAMPLE_GRANULE ? nBytes - g : SAMPLE_GRANULE);
+		}
+
+		for(UINT32 i = 0; i < SAMPLE_SIZES; i++)
+		{
+			UINT32 nPer = (CAPTURE_BLOCK_MIN << i) / SAMPLE_GRANULE;
+
+			for(UINT32 b = 0; b < sizeof(used); b += nPer)
+			{
+				if(nStart + (UINT64)b * SAMPLE_GRANULE >= diskSize)
+					break;
+
+				nBlocks[i]++;
+				for(UINT32 g = b; g < b + nPer; g++)
+				{
+					if(used[g])
+					{
+						nUsed[i]++;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	FreeAligned(pChunk);
+
+	// Fraction of the disk stored at each size, in 1/1024ths
+	UINT64 nBase = nBlocks[0] ? nUsed[0] * 1024 / nBlocks[0] : 0;
+	for(UINT32 i = 1; i < SAMPLE_SIZES; i++)
 	{
-		CloseHandle(m_hVhdFile);
-		m_hVhdFile = NULL;
+		if(!nBlocks[i] || nUsed[i] * 1024 / nBlocks[i] > nBase + 1024 / 32)
+			break;
+
+		blockSize = CAPTURE_BLOCK_MIN << i;
 	}
 
-	return TRUE;
+	char statusMsg[256];
+	snprintf(statusMsg, sizeof(statusMsg), "Block size %u MB picked, about %u%% of the disk holds data (%llu MB sampled)"
+		, blockSize >> 20, (UINT32)(nBase * 100 / 1024), (unsigned long long)(nSampled >> 20));
+	pSink->Status(statusMsg);
+
+	return blockSize;
 }
 
-UINT64 CDiskToVhd::GetDiskSize()
+// Bitmap (MSB first) of the sectors of pData that differ from pParent, the
+// last one possibly partial. Returns how many.
+static UINT32 GetChangedSectorMask(const BYTE* pData, const BYTE* pParent, DWORD nBytes, BYTE* pMask)
 {
-	if(!m_hPhysicalDrive)
-		return 0;
+	UINT32 nChanged = 0;
 
-	LARGE_INTEGER diskSize;
-	if(!GetFileSizeEx(m_hPhysicalDrive, &diskSize))
+	for(DWORD s = 0; s * 512 < nBytes; s++)
 	{
-		// Try alternative method for physical drives
-		DISK_GEOMETRY_EX geometry;
-		DWORD bytesReturned;
-		
-		if(DeviceIoControl(m_hPhysicalDrive, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
-			NULL, 0, &geometry, sizeof(geometry), &bytesReturned, NULL))
+		DWORD nLength = nBytes - s * 512 < 512 ? nBytes - s * 512 : 512;
+
+		if(memcmp(pData + s * 512, pParent + s * 512, nLength) != 0)
 		{
-			return geometry.DiskSize.QuadPart;
+			pMask[s / 8] |= (BYTE)(0x80 >> (s % 8));
+			nChanged++;
 		}
-		return 0;
 	}
 
-	return diskSize.QuadPart;
+	return nChanged;
 }
 
 BOOL CDiskToVhd::InitializeVhdStructures(UINT64 diskSize)
@@ -128,6 +515,11 @@ BOOL CDiskToVhd::InitializeVhdStructures(UINT64 diskSize)
 	m_Foot.features = _byteswap_ulong(0x00000002); // No features enabled
 	m_Foot.version = _byteswap_ulong(0x00010000); // Version 1.0
 	m_Foot.dataOffset = _byteswap_uint64(512); // Header starts at offset 512
+	if(m_Options.dwDiskType == VHD_TYPE_FIXED)
+	{
+		m_Foot.dataOffset = _byteswap_uint64(0xFFFFFFFFFFFFFFFFULL); // No header
+		diskSize = (diskSize + 511) & ~511ULL; // whole sectors of raw data
+	}
 	
 	// Set timestamp (seconds since Jan 1, 2000 00:00:00 UTC)
 	time_t currentTime;
@@ -163,7 +555,7 @@ BOOL CDiskToVhd::InitializeVhdStructures(UINT64 diskSize)
 		m_Foot.diskGeometry.sectors = (UCHAR)sectorsPerTrack;
 	}
 	
-	m_Foot.diskType = _byteswap_ulong(3); // Dynamic disk
+	m_Foot.diskType = _byteswap_ulong(m_Options.dwDiskType);
 	
 	// Generate UUID (simplified)
 	srand((unsigned int)time(NULL));
@@ -176,28 +568,41 @@ BOOL CDiskToVhd::InitializeVhdStructures(UINT64 diskSize)
 	m_Dyn.tableOffset = _byteswap_uint64(1536); // BAT starts after header
 	m_Dyn.headerVersion = _byteswap_ulong(0x00010000);
 	
-	UINT32 blockSize = 2 * 1024 * 1024; // 2MB blocks
+	// fixed disks have no blocks, the header is never written
+	UINT32 blockSize = m_Options.nBlockSize ? m_Options.nBlockSize : 2 * 1024 * 1024;
 	UINT32 maxTableEntries = (UINT32)((diskSize + blockSize - 1) / blockSize);
 	
 	m_Dyn.maxTableEntries = _byteswap_ulong(maxTableEntries);
 	m_Dyn.blockSize = _byteswap_ulong(blockSize);
 	
-	// Copy parent UUID from footer
-	memcpy(m_Dyn.parentUniqueId, m_Foot.uniqueId, 16);
-	m_Dyn.parentTimeStamp = m_Foot.timeStamp;
+	if(m_Options.sParentPath)
+	{
+		// Differencing: sectors not in this file come from the parent
+		const VHD_LAYER* pParent = m_Parent.GetLayer(0);
+
+		m_Foot.diskType = _byteswap_ulong(VHD_TYPE_DIFFERENCING);
+		memcpy(m_Dyn.parentUniqueId, pParent->foot.uniqueId, 16);
+		m_Dyn.parentTimeStamp = pParent->foot.timeStamp;
+	}
+	else
+	{
+		// Copy parent UUID from footer
+		memcpy(m_Dyn.parentUniqueId, m_Foot.uniqueId, 16);
+		m_Dyn.parentTimeStamp = m_Foot.timeStamp;
+	}
 
 	return TRUE;
 }
 
-BOOL CDiskToVhd::WriteFooter()
+BOOL CDiskToVhd::WriteFooter(UINT64 nOffset)
 {
-	if(!m_hVhdFile)
+	if(!m_VhdFile.IsOpen())
 		return FALSE;
 
 	// Calculate checksum
 	UINT32 checksum = 0;
 	UCHAR* footerBytes = (UCHAR*)&m_Foot;
-	for(int i = 0; i < sizeof(VHD_FOOTER); i++)
+	for(UINT32 i = 0; i < sizeof(VHD_FOOTER); i++)
 	{
 		if(i < 64 || i >= 68) // Skip checksum field
 			checksum += footerBytes[i];
@@ -205,19 +610,19 @@ BOOL CDiskToVhd::WriteFooter()
 	m_Foot.checksum = _byteswap_ulong(~checksum);
 
 	DWORD bytesWritten;
-	return WriteFile(m_hVhdFile, &m_Foot, sizeof(VHD_FOOTER), &bytesWritten, NULL) &&
+	return m_VhdFile.WriteAt(nOffset, &m_Foot, sizeof(VHD_FOOTER), &bytesWritten) &&
 		   bytesWritten == sizeof(VHD_FOOTER);
 }
 
 BOOL CDiskToVhd::WriteDynHeader()
 {
-	if(!m_hVhdFile)
+	if(!m_VhdFile.IsOpen())
 		return FALSE;
 
 	// Calculate checksum
 	UINT32 checksum = 0;
 	UCHAR* headerBytes = (UCHAR*)&m_Dyn;
-	for(int i = 0; i < sizeof(VHD_DYNAMIC); i++)
+	for(UINT32 i = 0; i < sizeof(VHD_DYNAMIC); i++)
 	{
 		if(i < 36 || i >= 40) // Skip checksum field
 			checksum += headerBytes[i];
@@ -225,13 +630,13 @@ BOOL CDiskToVhd::WriteDynHeader()
 	m_Dyn.checksum = _byteswap_ulong(~checksum);
 
 	DWORD bytesWritten;
-	return WriteFile(m_hVhdFile, &m_Dyn, sizeof(VHD_DYNAMIC), &bytesWritten, NULL) &&
+	return m_VhdFile.WriteAt(512, &m_Dyn, sizeof(VHD_DYNAMIC), &bytesWritten) &&
 		   bytesWritten == sizeof(VHD_DYNAMIC);
 }
 
 BOOL CDiskToVhd::WriteBlockAllocationTable()
 {
-	if(!m_hVhdFile)
+	if(!m_VhdFile.IsOpen())
 		return FALSE;
 
 	UINT32 maxEntries = _byteswap_ulong(m_Dyn.maxTableEntries);
@@ -243,19 +648,43 @@ BOOL CDiskToVhd::WriteBlockAllocationTable()
 	for(UINT32 i = 0; i < maxEntries; i++)
 		bat[i] = 0xFFFFFFFF;
 
+	// A stream's BAT follows the data, here goes the place each block that
+	// may hold any gets in it, so that a reader of the stream knows where
+	// blocks land before they arrive. Empty ones go out as zeroes there.
+	if(m_bStream)
+	{
+		UINT64 diskSize = GetDiskSize();
+		UINT32 blockSize = _byteswap_ulong(m_Dyn.blockSize);
+		UINT32 headSize = GetBlockHeadSize(blockSize);
+		UINT32 bitmapSize = (blockSize / 512 / 8 + 511) & ~511;
+		UINT64 nPlace = GetDataStart(maxEntries);
+
+		for(UINT32 i = 0; i < maxEntries; i++)
+		{
+			UINT64 diskPos = (UINT64)i * blockSize;
+
+			if(m_FreeSpace.IsFree(diskPos, (diskSize - diskPos) < blockSize ? diskSize - diskPos : blockSize))
+				continue;
+
+			// the bitmap sits right in front of the data, past any padding
+			bat[i] = _byteswap_ulong((UINT32)((nPlace + headSize - bitmapSize) / 512));
+			nPlace += headSize + blockSize;
+		}
+	}
+
 	DWORD bytesWritten;
-	BOOL result = WriteFile(m_hVhdFile, bat, maxEntries * sizeof(UINT32), &bytesWritten, NULL) &&
+	BOOL result = m_VhdFile.WriteAt(1536, bat, maxEntries * sizeof(UINT32), &bytesWritten) &&
 				  bytesWritten == maxEntries * sizeof(UINT32);
 
 	delete[] bat;
 	return result;
 }
 
-BOOL CDiskToVhd::DumpDiskToVhd(const LPWSTR sDrive, const LPWSTR sVhdPath, const HWND hDlg)
+BOOL CDiskToVhd::DumpDiskToVhd(LPCPATH sDrive, LPCPATH sVhdPath, CProgressSink* pSink)
 {
-	if(!OpenPhysicalDrive((LPWSTR)sDrive))
+	if(!OpenPhysicalDrive(sDrive))
 	{
-		SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to open physical drive. Administrator privileges may be required.", 1);
+		pSink->Status("Failed to open physical drive. Administrator privileges may be required.", TRUE);
 		return FALSE;
 	}
 
@@ -263,31 +692,166 @@ BOOL CDiskToVhd::DumpDiskToVhd(const LPWSTR sDrive, const LPWSTR sVhdPath, const
 	if(diskSize == 0)
 	{
 		ClosePhysicalDrive();
-		SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to determine disk size.", 1);
+		pSink->Status("Failed to determine disk size.", TRUE);
 		return FALSE;
 	}
 
-	if(!CreateVhdFile((LPWSTR)sVhdPath))
+	// Anything the map can't vouch for is captured as before
+	m_FreeSpace.Clear();
+	if(m_Options.bSkipFree)
+	{
+		char statusMsg[256];
+
+		pSink->Status("Reading filesystem allocation maps...");
+		if(!m_FreeSpace.Build(&m_PhysicalDrive, diskSize))
+			m_FreeSpace.Clear();
+
+		snprintf(statusMsg, sizeof(statusMsg), "%u filesystems found, %llu MB of free space will be skipped"
+			, m_FreeSpace.GetFileSystems(), (unsigned long long)(m_FreeSpace.GetFreeBytes() >> 20));
+		pSink->Status(statusMsg);
+	}
+
+	if(m_Options.sParentPath)
+	{
+		if(m_Options.dwDiskType == VHD_TYPE_FIXED || IsVhdxPath(sVhdPath))
+		{
+			ClosePhysicalDrive();
+			pSink->Status("Captures against a parent are written as differencing VHDs, not fixed VHDs or VHDX.", TRUE);
+			return FALSE;
+		}
+
+		if(!m_Parent.Open(m_Options.sParentPath))
+		{
+			ClosePhysicalDrive();
+			pSink->Status("Can't open the parent VHD, or one of its own parents.", TRUE);
+			return FALSE;
+		}
+
+		if(_byteswap_uint64(m_Parent.GetLayer(0)->foot.currentSize) != diskSize)
+		{
+			ClosePhysicalDrive();
+			pSink->Status("The parent VHD is not the size of the disk.", TRUE);
+			return FALSE;
+		}
+	}
+
+	// Fixed VHDs have no blocks
+	if(m_Options.dwDiskType != VHD_TYPE_FIXED)
+	{
+		const VHD_LAYER* pParent = m_Options.sParentPath ? m_Parent.GetLayer(0) : NULL;
+
+		if(m_Options.nBlockSize == CAPTURE_BLOCK_AUTO)
+			m_Options.nBlockSize = SampleBlockSize(diskSize, pSink);
+		else if(!m_Options.nBlockSize && pParent && pParent->dwType != VHD_TYPE_FIXED)
+			m_Options.nBlockSize = _byteswap_ulong(pParent->dyn.blockSize);	// the parent's blocks line up with ours
+		else if(!m_Options.nBlockSize)
+			m_Options.nBlockSize = IsVhdxPath(sVhdPath) ? 32 * 1024 * 1024 : 2 * 1024 * 1024;
+
+		if(m_Options.nBlockSize < CAPTURE_BLOCK_MIN || m_Options.nBlockSize > CAPTURE_BLOCK_MAX
+			|| (m_Options.nBlockSize & (m_Options.nBlockSize - 1)))
+		{
+			ClosePhysicalDrive();
+			pSink->Status("Invalid block size, it must be a power of two from 1 MB to 256 MB.", TRUE);
+			return FALSE;
+		}
+	}
+
+	if(!CreateVhdFile(sVhdPath))
 	{
 		ClosePhysicalDrive();
-		SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to create VHD file. Check path and permissions.", 1);
+		pSink->Status("Failed to create VHD file. Check path and permissions.", TRUE);
 		return FALSE;
 	}
 
+	if(IsVhdxPath(sVhdPath))
+	{
+		BOOL result = FALSE;
+
+		if(m_Options.dwDiskType == VHD_TYPE_FIXED)
+			pSink->Status("Fixed VHDX files are not supported, only dynamic ones.", TRUE);
+		else
+			result = DumpDiskToVhdx(pSink);
+
+		CloseVhdFile();
+		ClosePhysicalDrive();
+
+		return result;
+	}
+
 	if(!InitializeVhdStructures(diskSize))
 	{
 		CloseVhdFile();
 		ClosePhysicalDrive();
-		SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to initialize VHD structures.", 1);
+		pSink->Status("Failed to initialize VHD structures.", TRUE);
+		return FALSE;
+	}
+
+	if(m_Options.sParentPath && !InitializeParentLocators())
+	{
+		CloseVhdFile();
+		ClosePhysicalDrive();
+		pSink->Status("Failed to record where the parent VHD is.", TRUE);
 		return FALSE;
 	}
 
+	if(m_Options.dwDiskType == VHD_TYPE_FIXED)
+	{
+		BOOL result = DumpDiskToFixedVhd(pSink);
+
+		CloseVhdFile();
+		ClosePhysicalDrive();
+
+		return result;
+	}
+
+	// BAT entries are 32-bit sector offsets: refuse a disk that may not fit
+	// now rather than hours into the capture
+	{
+		UINT64 nBlocks = _byteswap_ulong(m_Dyn.maxTableEntries);
+		UINT32 blockSize = _byteswap_ulong(m_Dyn.blockSize);
+		UINT64 lastBlock = GetDataStart((UINT32)nBlocks)
+			+ (nBlocks - 1) * ((UINT64)GetBlockHeadSize(blockSize) + blockSize);
+
+		if(lastBlock / 512 > 0xFFFFFFFF)
+		{
+			CloseVhdFile();
+			ClosePhysicalDrive();
+			pSink->Status("Disk too large for a dynamic VHD (2TB maximum). Capture to a .vhdx file instead.", TRUE);
+			return FALSE;
+		}
+		
+		// A stream can't come back to fill in the BAT, so it goes after the data,
+		// past a place for each block that may hold any: the blocks that turn out
+		// empty are left unallocated and their place goes out as zeroes
+		if(m_bStream)
+		{
+			m_Dyn.tableOffset = _byteswap_uint64(GetDataStart((UINT32)nBlocks)
+				+ CountBlocksInUse(m_FreeSpace, diskSize, blockSize) * ((UINT64)GetBlockHeadSize(blockSize) + blockSize));
+		}
+		
+		// Preallocation starts from the blocks the filesystems use, read from their
+		// allocation maps even when free space gets captured; it grows in steps
+		// if stale data in free clusters has to be stored too
+		if(m_Options.bPreallocate && !m_bStream)
+		{
+			CFreeSpaceMap map;
+			UINT64 nInUse;
+			
+			if(m_Options.bSkipFree || !map.Build(&m_PhysicalDrive, diskSize))
+				nInUse = CountBlocksInUse(m_FreeSpace, diskSize, blockSize);
+			else
+				nInUse = CountBlocksInUse(map, diskSize, blockSize);
+			
+			ReserveVhdSpace(GetDataStart((UINT32)nBlocks) + nInUse * ((UINT64)GetBlockHeadSize(blockSize) + blockSize));
+		}
+	}
+
 	// Write VHD footer first
-	if(!WriteFooter())
+	if(!WriteFooter(0))
 	{
 		CloseVhdFile();
 		ClosePhysicalDrive();
-		SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to write VHD footer.", 1);
+		pSink->Status("Failed to write VHD footer.", TRUE);
 		return FALSE;
 	}
 
@@ -296,7 +860,7 @@ BOOL CDiskToVhd::DumpDiskToVhd(const LPWSTR sDrive, const LPWSTR sVhdPath, const
 	{
 		CloseVhdFile();
 		ClosePhysicalDrive();
-		SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to write VHD dynamic header.", 1);
+		pSink->Status("Failed to write VHD dynamic header.", TRUE);
 		return FALSE;
 	}
 
@@ -305,12 +869,27 @@ BOOL CDiskToVhd::DumpDiskToVhd(const LPWSTR sDrive, const LPWSTR sVhdPath, const
 	{
 		CloseVhdFile();
 		ClosePhysicalDrive();
-		SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to write VHD block allocation table.", 1);
+		pSink->Status("Failed to write VHD block allocation table.", TRUE);
 		return FALSE;
 	}
 
+	// Parent locators sit between the BAT and the first block
+	if(m_nLocatorBytes)
+	{
+		DWORD bytesWritten;
+		UINT64 nOffset = _byteswap_uint64(m_Dyn.partentLocator[0].platformDataOffset);
+
+		if(!m_VhdFile.WriteAt(nOffset, m_pLocators, m_nLocatorBytes, &bytesWritten) || bytesWritten != m_nLocatorBytes)
+		{
+			CloseVhdFile();
+			ClosePhysicalDrive();
+			pSink->Status("Failed to write the VHD parent locators.", TRUE);
+			return FALSE;
+		}
+	}
+
 	// Read disk data and write to VHD
-	BOOL result = DumpDiskToVhdData(hDlg);
+	BOOL result = DumpDiskToVhdData(pSink);
 
 	CloseVhdFile();
 	ClosePhysicalDrive();
@@ -318,78 +897,307 @@ BOOL CDiskToVhd::DumpDiskToVhd(const LPWSTR sDrive, const LPWSTR sVhdPath, const
 	return result;
 }
 
-BOOL CDiskToVhd::DumpDiskToVhdData(HWND hDlg)
+// Dynamic VHD capture runs as a pipeline over a fixed pool of block buffers:
+// reads run ahead on the queue, completed blocks are scanned and appended in
+// disk order (each one getting its BAT entry as it commits), and the appends
+// are gathered by a write-behind into large writes, straight from the block
+// buffers, that land while the next reads are in flight.
+BOOL CDiskToVhd::DumpDiskToVhdData(CProgressSink* pSink)
 {
-	SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Initializing disk to VHD conversion...", 0);
+	pSink->Status("Initializing disk to VHD conversion...");
 	
 	UINT64 diskSize = GetDiskSize();
 	UINT32 blockSize = _byteswap_ulong(m_Dyn.blockSize);
 	UINT32 totalBlocks = (UINT32)((diskSize + blockSize - 1) / blockSize);
 	UINT32 sectorsPerBlock = blockSize / 512;
 	UINT32 bitmapSize = (sectorsPerBlock / 8 + 511) & ~511; // Align to 512 bytes
+	UINT32 headSize = GetBlockHeadSize(blockSize);
+	UINT32 nDepth = m_Options.nQueueDepth ? m_Options.nQueueDepth : 1;
+	UINT32 nSlots = nDepth * 2; // reads of the next blocks while the last ones wait their turn
+	
+	// The write-behind writes blocks straight from their slots: as many more
+	// slots as its writes in flight hold
+	UINT32 nWriting = (WRITE_BEHIND_BATCH * WRITE_BEHIND_BATCHES) / (headSize + blockSize);
+	nSlots += nWriting ? nWriting : 1;
 	
 	// Initialize timing for progress estimation
-	DWORD startTime = GetTickCount();
-	DWORD lastStatusUpdate = startTime;
+	UINT64 startTime = GetTickCountMs();
+	UINT64 lastStatusUpdate = 0;
 	UINT64 totalDataProcessed = 0;
+	UINT64 usedSectors = 0;
+	UINT64 zeroSectors = 0;
+	UINT64 skippedBytes = 0;	// free clusters never read
 	
-	// Allocate buffers for reading disk data and block bitmap
-	BYTE* diskBuffer = new BYTE[blockSize];
-	BYTE* bitmapBuffer = new BYTE[bitmapSize];
-	UINT32* bat = new UINT32[totalBlocks];
+	BOOL result = FALSE;
+	BOOL bFailed = FALSE;
+	UINT32 nextRead = 0;		// next block to read
+	UINT32 nextCommit = 0;		// next block to append, blocks commit in disk order
+	UINT32 nFree = 0;
+	DWORD bytesWritten;
+	BOOL bDirectIn = (m_PhysicalDrive.GetFlags() & BDEV_NO_BUFFERING) != 0;
+	BOOL bDirectOut = FALSE;
+	BOOL bParent = m_Options.sParentPath != NULL;
+	BOOL bStream = m_bStream;
 	
-	if(!diskBuffer || !bitmapBuffer || !bat)
-	{
-		delete[] diskBuffer;
-		delete[] bitmapBuffer;
-		delete[] bat;
-		return FALSE;
-	}
+	CIoQueue* pQueue = NULL;
+	CWriteBehind writer;
+	CAPTURE_SLOT* pSlots = NULL;
+	CAPTURE_SLOT** ppFree = NULL;
+	CAPTURE_SLOT** ppOrder = NULL;	// slot of block n at n % nSlots while not committed
+	UINT32* bat = new UINT32[totalBlocks];
 	
 	// Initialize BAT with all entries as unused
 	for(UINT32 i = 0; i < totalBlocks; i++)
 		bat[i] = 0xFFFFFFFF;
 	
 	// Calculate starting offset for data blocks (after headers and BAT)
-	UINT64 dataStartOffset = 1536 + ((UINT64)totalBlocks * 4);
-	dataStartOffset = (dataStartOffset + 511) & ~511; // Align to 512 bytes
-	UINT64 currentDataOffset = dataStartOffset;
+	UINT64 currentDataOffset = GetDataStart(totalBlocks);
+	
+	if(m_Options.bUnbuffered)
+	{
+		if(!ReopenVhdFile(TRUE))
+		{
+			pSink->Status("Failed to reopen the VHD file for unbuffered writes.", TRUE);
+			goto clean;
+		}
+		
+		bDirectOut = (m_VhdFile.GetFlags() & BDEV_NO_BUFFERING) != 0;
+	}
 	
-	LARGE_INTEGER diskPos, vhdPos;
-	DWORD bytesRead, bytesWritten;
+	pQueue = CIoQueue::Create(nDepth);
+	if(!pQueue)
+		goto clean;
 	
-	// Process each block
-	for(UINT32 blockIndex = 0; blockIndex < totalBlocks; blockIndex++)
+	// Bitmaps and data of consecutive blocks go out together; a pipe takes
+	// them one write at a time, in order
+	if(!writer.Create(&m_VhdFile, !bStream, nSlots))
+		goto clean;
+	
+	// Each buffer holds a block's (padded) bitmap followed by its data, appended with one write
+	pSlots = new CAPTURE_SLOT[nSlots];
+	ppFree = new CAPTURE_SLOT*[nSlots];
+	ppOrder = new CAPTURE_SLOT*[nSlots];
+	ZeroMemory(pSlots, nSlots * sizeof(CAPTURE_SLOT));
+	
+	for(UINT32 i = 0; i < nSlots; i++)
+	{
+		pSlots[i].pBuff = (BYTE*)AllocAligned(headSize + blockSize, CAPTURE_DIRECT_ALIGN);
+		if(!pSlots[i].pBuff)
+			goto clean;
+		
+		pSlots[i].req.pContext = &pSlots[i];
+		ppFree[nFree++] = &pSlots[i];
+		
+		if(!bParent)
+			continue;
+		
+		pSlots[i].pParent = (BYTE*)AllocAligned(blockSize, CAPTURE_DIRECT_ALIGN);
+		pSlots[i].pRuns = new VHD_RUN[sectorsPerBlock];
+		pSlots[i].pParentReqs = new IO_REQUEST[sectorsPerBlock];
+		if(!pSlots[i].pParent || !pSlots[i].pRuns || !pSlots[i].pParentReqs)
+			goto clean;
+		
+		ZeroMemory(pSlots[i].pParentReqs, sectorsPerBlock * sizeof(IO_REQUEST));
+		for(UINT32 j = 0; j < sectorsPerBlock; j++)
+			pSlots[i].pParentReqs[j].pContext = &pSlots[i];
+	}
+	
+	{
+		// blocks are read into the slot buffers, pinned once where the backend can
+		IO_SEGMENT* pFixed = new IO_SEGMENT[nSlots];
+		
+		for(UINT32 i = 0; i < nSlots; i++)
+		{
+			pFixed[i].pBuff = pSlots[i].pBuff;
+			pFixed[i].nBytes = headSize + blockSize;
+		}
+		
+		pQueue->RegisterBuffers(pFixed, nSlots);
+		writer.RegisterBuffers(pFixed, nSlots);
+		delete[] pFixed;
+	}
+	
+	for(;;)
 	{
+		// Slots whose block landed in the file take reads again
+		void* pWritten;
+		while((pWritten = writer.GetReleased()) != NULL)
+			ppFree[nFree++] = (CAPTURE_SLOT*)pWritten;
+		
+		// Keep reads in flight
+		while(!bFailed && nFree && nextRead < totalBlocks)
+		{
+			CAPTURE_SLOT* pSlot = ppFree[--nFree];
+			UINT64 diskPos = (UINT64)nextRead * blockSize;
+			
+			pSlot->nBlock = nextRead;
+			pSlot->bReady = FALSE;
+			pSlot->bFree = FALSE;
+			pSlot->req.dwOp = IOQ_READ;
+			pSlot->req.pDevice = &m_PhysicalDrive;
+			pSlot->req.nOffset = diskPos;
+			pSlot->req.pBuff = pSlot->pBuff + headSize;
+			pSlot->req.nBytes = (diskSize - diskPos) < blockSize ? (DWORD)(diskSize - diskPos) : blockSize;
+			
+			// A block of free clusters only is never read, it commits as empty
+			// (or as unchanged, against a parent)
+			if(m_FreeSpace.IsFree(diskPos, pSlot->req.nBytes))
+			{
+				totalDataProcessed += pSlot->req.nBytes;
+				skippedBytes += pSlot->req.nBytes;
+				pSlot->req.nDone = 0;
+				pSlot->bReady = TRUE;
+				pSlot->bFree = TRUE;
+				ppOrder[nextRead++ % nSlots] = pSlot;
+				continue;
+			}
+			
+			// Unbuffered reads of the tail are rounded up, the read comes back short
+			if(bDirectIn)
+				pSlot->req.nBytes = (pSlot->req.nBytes + CAPTURE_DIRECT_ALIGN - 1) & ~(CAPTURE_DIRECT_ALIGN - 1);
+			
+			if(!pQueue->Submit(&pSlot->req))
+			{
+				ppFree[nFree++] = pSlot;
+				bFailed = TRUE;
+				break;
+			}
+			
+			ppOrder[nextRead % nSlots] = pSlot;
+			nextRead++;
+			pSlot->nPending = 1;
+			
+			if(!bParent)
+				continue;
+			
+			// The parent's content of the same range, read from whichever layer of
+			// its chain holds each sector
+			UINT32 nRuns = 0;
+			UINT32 nSectors = (UINT32)((((diskSize - diskPos) < blockSize ? diskSize - diskPos : blockSize) + 511) / 512);
+			
+			if(!m_Parent.MapSectors(diskPos / 512, nSectors, pSlot->pRuns, &nRuns))
+			{
+				pSink->Status("Failed to read the parent VHD.", TRUE);
+				bFailed = TRUE;
+				break;
+			}
+			
+			for(UINT32 r = 0; r < nRuns; r++)
+			{
+				VHD_RUN* pRun = &pSlot->pRuns[r];
+				BYTE* pDest = pSlot->pParent + (pRun->nSector * 512 - diskPos);
+				
+				if(!pRun->pFile)
+				{
+					memset(pDest, 0, pRun->nCount * 512);
+					continue;
+				}
+				
+				IO_REQUEST* pReq = &pSlot->pParentReqs[r];
+				pReq->dwOp = IOQ_READ;
+				pReq->pDevice = pRun->pFile;
+				pReq->nOffset = pRun->nOffset;
+				pReq->pBuff = pDest;
+				pReq->nBytes = pRun->nCount * 512;
+				
+				if(!pQueue->Submit(pReq))
+				{
+					bFailed = TRUE;
+					break;
+				}
+				pSlot->nPending++;
+			}
+		}
+		
+		// Append the blocks read so far, in disk order
+		while(!bFailed && nextCommit < nextRead && ppOrder[nextCommit % nSlots]->bReady)
+		{
+			CAPTURE_SLOT* pSlot = ppOrder[nextCommit++ % nSlots];
+			BYTE* diskBuffer = pSlot->pBuff + headSize;
+			DWORD bytesRead = pSlot->req.nDone;
+			
+			// Stale data in free clusters is dropped, it reads back as zeroes; against
+			// a parent, free clusters count as unchanged
+			m_FreeSpace.ZeroFree(pSlot->req.nOffset, diskBuffer, bytesRead);
+			if(bParent)
+				m_FreeSpace.ZeroFree(pSlot->req.nOffset, pSlot->pParent, bytesRead);
+			
+			// Skip empty blocks to save space (sparse VHD), or unchanged ones in a
+			// differencing VHD: the parent shows through
+			if(bParent ? !bytesRead || memcmp(diskBuffer, pSlot->pParent, bytesRead) == 0 : IsZeroBlock(diskBuffer, bytesRead))
+			{
+				// a stream still fills the place the BAT offset counted on
+				if(bStream && !pSlot->bFree)
+					currentDataOffset += headSize + blockSize;
+				
+				ppFree[nFree++] = pSlot;
+				continue;
+			}
+			
+			// Pad partial blocks to sector boundary
+			UINT32 paddedSize = (bytesRead + 511) & ~511;
+			if(bDirectOut)
+				paddedSize = (bytesRead + CAPTURE_DIRECT_ALIGN - 1) & ~(CAPTURE_DIRECT_ALIGN - 1);
+			if(paddedSize > bytesRead)
+				memset(diskBuffer + bytesRead, 0, paddedSize - bytesRead);
+			
+			// Create block bitmap - only sectors holding data are marked used, zero
+			// sectors are still stored but bitmap-aware readers can skip them
+			memset(pSlot->pBuff, 0, headSize);
+			UINT32 blockUsed = bParent ? GetChangedSectorMask(diskBuffer, pSlot->pParent, bytesRead, diskBuffer - bitmapSize)
+				: GetDataSectorMask(diskBuffer, paddedSize / 512, diskBuffer - bitmapSize);
+			usedSectors += blockUsed;
+			zeroSectors += paddedSize / 512 - blockUsed;
+			
+			// The block starts at its bitmap, after any alignment padding
+			bat[pSlot->nBlock] = _byteswap_ulong((UINT32)((currentDataOffset + headSize - bitmapSize) / 512));
+			
+			ReserveVhdSpace(currentDataOffset + headSize + paddedSize);
+			
+			// Written from the slot, which takes reads again once GetReleased hands it back
+			if(!writer.Append(currentDataOffset, pSlot->pBuff, headSize + paddedSize, pSlot))
+			{
+				ppFree[nFree++] = pSlot;
+				TRACE("Failed to write block %u with error 0x%08X\n", pSlot->nBlock, writer.GetLastError());
+				pSink->Status("Failed to write the VHD file.", TRUE);
+				bFailed = TRUE;
+				break;
+			}
+			
+			// Advance data offset for next block (a stream keeps to the places it
+			// announced, the rest of a short block goes out as zeroes)
+			currentDataOffset += headSize + (bStream ? blockSize : paddedSize);
+		}
+		
 		// Update progress (time-based throttling to reduce flicker)
-		DWORD currentTime = GetTickCount();
-		if(currentTime - lastStatusUpdate >= 500 || blockIndex == 0 || blockIndex == totalBlocks - 1) // Update every 500ms, first block, or last block
+		UINT64 currentTime = GetTickCountMs();
+		if(!bFailed && (currentTime - lastStatusUpdate >= 500 || nextCommit == totalBlocks))
 		{
 			lastStatusUpdate = currentTime;
 			// Calculate progress and timing information
-			int progressPercent = (blockIndex * 100) / totalBlocks;
-			DWORD elapsedTime = GetTickCount() - startTime;
+			int progressPercent = (int)(((UINT64)nextCommit * 100) / totalBlocks);
+			UINT64 elapsedTime = currentTime - startTime;
 			
-			WCHAR statusMsg[512];
-			WCHAR timeRemaining[128] = L"";
+			char statusMsg[512];
+			char timeRemaining[128] = "";
 			
 			// Calculate remaining time if we have meaningful progress
 			if(progressPercent > 0 && elapsedTime > 1000) // At least 1 second elapsed
 			{
-				DWORD estimatedTotalTime = (elapsedTime * 100) / progressPercent;
-				DWORD remainingTime = estimatedTotalTime - elapsedTime;
+				UINT64 estimatedTotalTime = (elapsedTime * 100) / progressPercent;
+				UINT64 remainingTime = estimatedTotalTime - elapsedTime;
 				
 				// Convert to hours, minutes, seconds
-				DWORD hours = remainingTime / (1000 * 60 * 60);
-				DWORD minutes = (remainingTime % (1000 * 60 * 60)) / (1000 * 60);
-				DWORD seconds = (remainingTime % (1000 * 60)) / 1000;
+				DWORD hours = (DWORD)(remainingTime / (1000 * 60 * 60));
+				DWORD minutes = (DWORD)((remainingTime % (1000 * 60 * 60)) / (1000 * 60));
+				DWORD seconds = (DWORD)((remainingTime % (1000 * 60)) / 1000);
 				
 				if(hours > 0)
-					wsprintf(timeRemaining, L", %d:%02d:%02d remaining", hours, minutes, seconds);
+					snprintf(timeRemaining, sizeof(timeRemaining), ", %u:%02u:%02u remaining", hours, minutes, seconds);
 				else if(minutes > 0)
-					wsprintf(timeRemaining, L", %d:%02d remaining", minutes, seconds);
+					snprintf(timeRemaining, sizeof(timeRemaining), ", %u:%02u remaining", minutes, seconds);
 				else
-					wsprintf(timeRemaining, L", %d seconds remaining", seconds);
+					snprintf(timeRemaining, sizeof(timeRemaining), ", %u seconds remaining", seconds);
 			}
 			
 			// Format user-friendly message with data processed
@@ -401,124 +1209,431 @@ BOOL CDiskToVhd::DumpDiskToVhdData(HWND hDlg)
 				// Show in GB for large drives
 				UINT64 processedGB = processedMB / 1024;
 				UINT64 totalGB = totalMB / 1024;
-				wsprintf(statusMsg, L"Converting disk data... %d%% complete (%I64u GB of %I64u GB processed%s)", 
-					progressPercent, processedGB, totalGB, timeRemaining);
+				snprintf(statusMsg, sizeof(statusMsg), "Converting disk data... %d%% complete (%llu GB of %llu GB processed%s)", 
+					progressPercent, (unsigned long long)processedGB, (unsigned long long)totalGB, timeRemaining);
 			}
 			else
 			{
 				// Show in MB for smaller drives
-				wsprintf(statusMsg, L"Converting disk data... %d%% complete (%I64u MB of %I64u MB processed%s)", 
-					progressPercent, processedMB, totalMB, timeRemaining);
+				snprintf(statusMsg, sizeof(statusMsg), "Converting disk data... %d%% complete (%llu MB of %llu MB processed%s)", 
+					progressPercent, (unsigned long long)processedMB, (unsigned long long)totalMB, timeRemaining);
 			}
 			
-			SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)statusMsg, 0);
+			pSink->Status(statusMsg);
 			
 			// Update progress bar
-			SendMessage(hDlg, MYWM_UPDATE_PROGRESSBAR, progressPercent, 0);
+			pSink->Progress(totalDataProcessed, diskSize);
 		}
 		
-		// Calculate disk position for this block
-		diskPos.QuadPart = (UINT64)blockIndex * blockSize;
-		
-		// Read block from disk
-		if(!SetFilePointerEx(m_hPhysicalDrive, diskPos, NULL, FILE_BEGIN))
-			continue; // Skip this block if seek fails
-		
-		UINT32 bytesToRead = blockSize;
-		if(diskPos.QuadPart + blockSize > diskSize)
-			bytesToRead = (UINT32)(diskSize - diskPos.QuadPart);
-		
-		if(!ReadFile(m_hPhysicalDrive, diskBuffer, bytesToRead, &bytesRead, NULL) || bytesRead == 0)
-			continue; // Skip this block if read fails
-		
-		// Track total data processed for progress reporting
-		totalDataProcessed += bytesRead;
-		
-		// Check if block contains any non-zero data
-		BOOL isEmptyBlock = TRUE;
-		for(UINT32 i = 0; i < bytesRead && isEmptyBlock; i++)
+		// Nothing in flight: done, the blocks just handed out were all free ones,
+		// or every slot waits for its write
+		IO_REQUEST* pReq = pQueue->WaitCompletion();
+		if(!pReq && !bFailed && nextCommit < totalBlocks)
 		{
-			if(diskBuffer[i] != 0)
-				isEmptyBlock = FALSE;
+			if(!nFree && !writer.WaitReleased())
+			{
+				TRACE("Failed to write the VHD file with error 0x%08X\n", writer.GetLastError());
+				pSink->Status("Failed to write the VHD file.", TRUE);
+				bFailed = TRUE;
+				break;
+			}
+			continue;
 		}
+		if(!pReq)
+			break;
 		
-		// Skip empty blocks to save space (sparse VHD)
-		if(isEmptyBlock)
+		CAPTURE_SLOT* pSlot = (CAPTURE_SLOT*)pReq->pContext;
+		
+		if(pReq != &pSlot->req)
+		{
+			// The parent must read back in full, or changes would be judged wrongly
+			if(!pReq->bSuccess || pReq->nDone != pReq->nBytes)
+			{
+				TRACE("Failed to read the parent of block %u with error 0x%08X\n", pSlot->nBlock, pReq->dwError);
+				if(!bFailed)
+					pSink->Status("Failed to read the parent VHD.", TRUE);
+				bFailed = TRUE;
+			}
+			
+			if(--pSlot->nPending == 0)
+				pSlot->bReady = TRUE;
 			continue;
+		}
 		
-		// Create block bitmap - mark sectors as used
-		memset(bitmapBuffer, 0, bitmapSize);
-		UINT32 usedSectors = (bytesRead + 511) / 512;
-		for(UINT32 sector = 0; sector < usedSectors; sector++)
+		// An unreadable block is left unallocated, as it always was
+		if(!pReq->bSuccess)
 		{
-			UINT32 byteIndex = sector / 8;
-			UINT32 bitIndex = 7 - (sector % 8);
-			if(byteIndex < bitmapSize)
-				bitmapBuffer[byteIndex] |= (1 << bitIndex);
+			TRACE("Failed to read block %u with error 0x%08X\n", pSlot->nBlock, pReq->dwError);
+			pReq->nDone = 0;
 		}
 		
-		// Write block to VHD file
-		vhdPos.QuadPart = currentDataOffset;
-		if(SetFilePointerEx(m_hVhdFile, vhdPos, NULL, FILE_BEGIN))
+		if(pReq->nDone > diskSize - pReq->nOffset)
+			pReq->nDone = (DWORD)(diskSize - pReq->nOffset);
+		
+		// Against a parent an unallocated block means unchanged, which an unreadable
+		// one can't be said to be
+		if(bParent && pReq->nDone < pReq->nBytes && pReq->nDone < diskSize - pReq->nOffset)
 		{
-			// Write bitmap first
-			if(WriteFile(m_hVhdFile, bitmapBuffer, bitmapSize, &bytesWritten, NULL) && bytesWritten == bitmapSize)
-			{
-				// Pad partial blocks to sector boundary
-				UINT32 paddedSize = (bytesRead + 511) & ~511;
-				if(paddedSize > bytesRead)
-					memset(diskBuffer + bytesRead, 0, paddedSize - bytesRead);
-				
-				// Write block data
-				if(WriteFile(m_hVhdFile, diskBuffer, paddedSize, &bytesWritten, NULL) && bytesWritten == paddedSize)
-				{
-					// Update BAT entry (ensure it fits in UINT32 for VHD format)
-					UINT64 sectorOffset = currentDataOffset / 512;
-					if(sectorOffset > 0xFFFFFFFF)
-					{
-						// VHD format limitation reached
-						delete[] diskBuffer;
-						delete[] bitmapBuffer;
-						delete[] bat;
-						SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"VHD file size limit exceeded (2TB maximum for dynamic VHDs).", 1);
-						return FALSE;
-					}
-					
-					bat[blockIndex] = _byteswap_ulong((UINT32)sectorOffset);
-					
-					// Advance data offset for next block
-					currentDataOffset += bitmapSize + paddedSize;
-				}
-			}
+			if(!bFailed)
+				pSink->Status("Failed to read the source disk.", TRUE);
+			bFailed = TRUE;
 		}
+		
+		// Track total data processed for progress reporting
+		totalDataProcessed += pReq->nDone;
+		if(--pSlot->nPending == 0)
+			pSlot->bReady = TRUE;
 	}
 	
-	SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Updating file allocation table...", 0);
+	if(!bFailed && !writer.Flush())
+	{
+		TRACE("Failed to write the VHD file with error 0x%08X\n", writer.GetLastError());
+		pSink->Status("Failed to write the VHD file.", TRUE);
+		bFailed = TRUE;
+	}
+	
+	if(bFailed)
+		goto clean;
+	
+	if(m_Options.bUnbuffered && !ReopenVhdFile(FALSE))
+		goto clean;
+	
+	pSink->Status("Updating file allocation table...");
+	
+	// A stream's BAT comes last, where the header said it would be
+	if(bStream && currentDataOffset != _byteswap_uint64(m_Dyn.tableOffset))
+	{
+		TRACE("Stream blocks end at %llu, the BAT was announced at %llu\n"
+			, (unsigned long long)currentDataOffset, (unsigned long long)_byteswap_uint64(m_Dyn.tableOffset));
+		goto clean;
+	}
 	
 	// Write updated BAT to VHD file
-	vhdPos.QuadPart = 1536; // BAT location
-	if(!SetFilePointerEx(m_hVhdFile, vhdPos, NULL, FILE_BEGIN) ||
-	   !WriteFile(m_hVhdFile, bat, totalBlocks * sizeof(UINT32), &bytesWritten, NULL) ||
+	if(!m_VhdFile.WriteAt(_byteswap_uint64(m_Dyn.tableOffset), bat, totalBlocks * sizeof(UINT32), &bytesWritten) ||
 	   bytesWritten != totalBlocks * sizeof(UINT32))
+		goto clean;
+	
+	char sectorMsg[256];
+	snprintf(sectorMsg, sizeof(sectorMsg), bParent ? "%llu changed sectors, %llu unchanged sectors left to the parent in allocated blocks"
+		: "%llu used sectors, %llu zero sectors left unmarked in allocated blocks"
+		, (unsigned long long)usedSectors, (unsigned long long)zeroSectors);
+	pSink->Status(sectorMsg);
+	
+	if(m_Options.bSkipFree)
 	{
-		delete[] diskBuffer;
-		delete[] bitmapBuffer;
-		delete[] bat;
-		return FALSE;
+		snprintf(sectorMsg, sizeof(sectorMsg), "%llu MB of free blocks not read", (unsigned long long)(skippedBytes >> 20));
+		pSink->Status(sectorMsg);
 	}
 	
-	SendMessage(hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Finalizing VHD file structure...", 0);
-	SendMessage(hDlg, MYWM_UPDATE_PROGRESSBAR, 100, 0);
+	pSink->Status("Finalizing VHD file structure...");
+	pSink->Progress(diskSize, diskSize);
 	
 	// Write final footer at end of file
-	vhdPos.QuadPart = 0;
-	SetFilePointerEx(m_hVhdFile, vhdPos, NULL, FILE_END);
-	BOOL result = WriteFooter();
+	if(bStream)
+		currentDataOffset += (totalBlocks * sizeof(UINT32) + 511) & ~511;
+	result = TrimVhdFile(currentDataOffset) && WriteFooter(currentDataOffset);
+	
+clean:
+	
+	if(pQueue)
+		delete pQueue;
+	
+	// nothing may still be written from the slots
+	writer.Close();
+	
+	if(pSlots)
+	{
+		for(UINT32 i = 0; i < nSlots; i++)
+		{
+			if(pSlots[i].pBuff)
+				FreeAligned(pSlots[i].pBuff);
+			if(pSlots[i].pParent)
+				FreeAligned(pSlots[i].pParent);
+			delete[] pSlots[i].pRuns;
+			delete[] pSlots[i].pParentReqs;
+		}
+		
+		delete[] pSlots;
+	}
 	
-	// Cleanup
-	delete[] diskBuffer;
-	delete[] bitmapBuffer;
+	delete[] ppFree;
+	delete[] ppOrder;
 	delete[] bat;
 	
 	return result;
-}
\ No newline at end of file
+}
+
+// Fixed VHD: the disk copied as is, then the footer
+BOOL CDiskToVhd::DumpDiskToFixedVhd(CProgressSink* pSink)
+{
+	const DWORD nChunk = WRITE_BEHIND_BATCH;
+	const UINT32 nChunks = WRITE_BEHIND_BATCHES + 1;
+	UINT64 diskSize = GetDiskSize();
+	UINT64 diskPos = 0;
+	UINT64 lastStatusUpdate = 0;
+	DWORD bytesRead;
+	BOOL result = FALSE;
+	BOOL bDirectIn = (m_PhysicalDrive.GetFlags() & BDEV_NO_BUFFERING) != 0;
+
+	CWriteBehind writer;
+	BYTE* pChunks[nChunks] = {0};
+	BYTE* ppFree[nChunks];
+	UINT32 nFree = 0;
+
+	for(UINT32 i = 0; i < nChunks; i++)
+	{
+		pChunks[i] = (BYTE*)AllocAligned(nChunk, CAPTURE_DIRECT_ALIGN);
+		if(!pChunks[i])
+			goto clean;
+
+		ppFree[nFree++] = pChunks[i];
+	}
+
+	if(m_Options.bUnbuffered && !ReopenVhdFile(TRUE))
+	{
+		pSink->Status("Failed to reopen the VHD file for unbuffered writes.", TRUE);
+		goto clean;
+	}
+
+	// Each chunk is written from its buffer while the next ones are read
+	if(!writer.Create(&m_VhdFile, !m_bStream, nChunks))
+		goto clean;
+
+	// The size is known: data, then the footer
+	ReserveVhdSpace(((diskSize + 511) & ~511ULL) + sizeof(VHD_FOOTER));
+
+	pSink->Status("Copying disk data...");
+
+	while(diskPos < diskSize)
+	{
+		DWORD bytesToRead = (diskSize - diskPos) < nChunk ? (DWORD)(diskSize - diskPos) : nChunk;
+		DWORD bytesAsked = bytesToRead;
+		void* pWritten;
+
+		// a buffer whose write is over, waiting for one if need be
+		while((pWritten = writer.GetReleased()) != NULL)
+			ppFree[nFree++] = (BYTE*)pWritten;
+
+		if(!nFree && writer.WaitReleased())
+			ppFree[nFree++] = (BYTE*)writer.GetReleased();
+
+		if(!nFree)
+		{
+			pSink->Status("Failed to write the VHD file.", TRUE);
+			goto clean;
+		}
+
+		BYTE* diskBuffer = ppFree[--nFree];
+
+		// Unbuffered reads of the tail are rounded up, the read comes back short
+		if(bDirectIn)
+			bytesAsked = (bytesToRead + CAPTURE_DIRECT_ALIGN - 1) & ~(CAPTURE_DIRECT_ALIGN - 1);
+
+		if(!m_PhysicalDrive.ReadAt(diskPos, diskBuffer, bytesAsked, &bytesRead) || bytesRead < bytesToRead)
+		{
+			TRACE("Failed to read %u bytes at %llu with error 0x%08X\n", bytesToRead, (unsigned long long)diskPos, m_PhysicalDrive.GetLastError());
+			pSink->Status("Failed to read the disk.", TRUE);
+			goto clean;
+		}
+
+		// Pad a partial last sector
+		bytesRead = bytesToRead;
+		DWORD paddedSize = (bytesRead + 511) & ~511;
+		if(paddedSize > bytesRead)
+			memset(diskBuffer + bytesRead, 0, paddedSize - bytesRead);
+
+		// A tail unbuffered writes can't take goes through the cache, like the footer.
+		// The reopened file may get the handle value the queue knew the old one by,
+		// so it gets a writer of its own.
+		if((m_VhdFile.GetFlags() & BDEV_NO_BUFFERING) && (paddedSize & (CAPTURE_DIRECT_ALIGN - 1)))
+		{
+			if(!writer.Flush())
+			{
+				pSink->Status("Failed to write the VHD file.", TRUE);
+				goto clean;
+			}
+
+			while((pWritten = writer.GetReleased()) != NULL)
+				ppFree[nFree++] = (BYTE*)pWritten;
+
+			writer.Close();
+
+			if(!ReopenVhdFile(FALSE) || !writer.Create(&m_VhdFile, !m_bStream, nChunks))
+			{
+				pSink->Status("Failed to write the VHD file.", TRUE);
+				goto clean;
+			}
+		}
+
+		if(!writer.Append(diskPos, diskBuffer, paddedSize, diskBuffer))
+		{
+			TRACE("Failed to write %u bytes at %llu with error 0x%08X\n", paddedSize, (unsigned long long)diskPos, writer.GetLastError());
+			pSink->Status("Failed to write the VHD file.", TRUE);
+			goto clean;
+		}
+
+		diskPos += bytesRead;
+
+		UINT64 currentTime = GetTickCountMs();
+		if(currentTime - lastStatusUpdate >= 500 || diskPos == diskSize)
+		{
+			char statusMsg[256];
+			lastStatusUpdate = currentTime;
+
+			snprintf(statusMsg, sizeof(statusMsg), "Copying disk data... %llu MB of %llu MB"
+				, (unsigned long long)(diskPos >> 20), (unsigned long long)(diskSize >> 20));
+
+			pSink->Status(statusMsg);
+			pSink->Progress(diskPos, diskSize);
+		}
+	}
+
+	pSink->Status("Finalizing VHD file structure...");
+
+	if(!writer.Flush())
+	{
+		pSink->Status("Failed to write the VHD file.", TRUE);
+		goto clean;
+	}
+
+	if(m_Options.bUnbuffered && !ReopenVhdFile(FALSE))
+		goto clean;
+
+	result = TrimVhdFile((diskSize + 511) & ~511ULL) && WriteFooter((diskSize + 511) & ~511ULL);
+
+clean:
+	// nothing may still be written from the buffers, which all come back
+	writer.Close();
+
+	for(UINT32 i = 0; i < nChunks; i++)
+		if(pChunks[i])
+			FreeAligned(pChunks[i]);
+
+	return result;
+}
+
+// VHDX: blocks holding anything but zeroes are appended in disk order, the
+// writer checkpoints the BAT as it goes. Even a failed capture leaves a
+// valid VHDX holding the blocks written so far.
+BOOL CDiskToVhd::DumpDiskToVhdx(CProgressSink* pSink)
+{
+	CVhdxWriter vhdx;
+	UINT64 diskSize = GetDiskSize();
+	UINT32 blockSize = m_Options.nBlockSize;
+	UINT32 sectorSize = m_Options.nLogicalSector;
+	UINT64 virtualSize = (diskSize + sectorSize - 1) / sectorSize * sectorSize;
+	UINT64 diskPos = 0;
+	UINT64 lastStatusUpdate = 0;
+	DWORD bytesRead;
+	BOOL result = FALSE;
+	BOOL bDirectIn = (m_PhysicalDrive.GetFlags() & BDEV_NO_BUFFERING) != 0;
+	BYTE* pBuffers[2] = {0};
+	BYTE* ppFree[2];
+	UINT32 nFree = 0;
+
+	// The VHDX itself is always written through the cache: its headers, log
+	// and BAT updates are small and flushed at every checkpoint anyway
+	if(!vhdx.Create(&m_VhdFile, virtualSize, blockSize, sectorSize, m_Options.nPhysicalSector))
+	{
+		pSink->Status("Failed to create the VHDX file structure. Check the block and sector sizes.", TRUE);
+		return FALSE;
+	}
+
+	// Blocks are written straight from their buffer, the next one is read
+	// into the other
+	for(UINT32 i = 0; i < 2; i++)
+	{
+		pBuffers[i] = (BYTE*)AllocAligned(blockSize, CAPTURE_DIRECT_ALIGN);
+		if(!pBuffers[i])
+			goto clean;
+
+		ppFree[nFree++] = pBuffers[i];
+	}
+
+	pSink->Status("Converting disk data...");
+
+	for(UINT32 blockIndex = 0; blockIndex < vhdx.GetBlockCount(); blockIndex++)
+	{
+		DWORD bytesToRead = (diskSize - diskPos) < blockSize ? (DWORD)(diskSize - diskPos) : blockSize;
+		DWORD bytesAsked = bytesToRead;
+		void* pWritten;
+
+		while((pWritten = vhdx.GetReleased()) != NULL)
+			ppFree[nFree++] = (BYTE*)pWritten;
+
+		if(!nFree && vhdx.WaitReleased())
+			ppFree[nFree++] = (BYTE*)vhdx.GetReleased();
+
+		if(!nFree)
+		{
+			pSink->Status("Failed to write the VHDX file.", TRUE);
+			goto clean;
+		}
+
+		BYTE* diskBuffer = ppFree[--nFree];
+
+		// Unbuffered reads of the tail are rounded up, the read comes back short
+		if(bDirectIn)
+			bytesAsked = (bytesToRead + CAPTURE_DIRECT_ALIGN - 1) & ~(CAPTURE_DIRECT_ALIGN - 1);
+
+		// A block of free clusters only is never read, it stays unallocated
+		if(m_FreeSpace.IsFree(diskPos, bytesToRead))
+			memset(diskBuffer, 0, bytesToRead);
+		else if(!m_PhysicalDrive.ReadAt(diskPos, diskBuffer, bytesAsked, &bytesRead) || bytesRead < bytesToRead)
+		{
+			TRACE("Failed to read %u bytes at %llu with error 0x%08X\n", bytesToRead, (unsigned long long)diskPos, m_PhysicalDrive.GetLastError());
+			pSink->Status("Failed to read the disk.", TRUE);
+			goto clean;
+		}
+		else
+			m_FreeSpace.ZeroFree(diskPos, diskBuffer, bytesToRead);
+
+		// Pad a partial last sector
+		bytesRead = bytesToRead;
+		DWORD paddedSize = (bytesRead + sectorSize - 1) / sectorSize * sectorSize;
+		if(paddedSize > bytesRead)
+			memset(diskBuffer + bytesRead, 0, paddedSize - bytesRead);
+
+		// Skip empty blocks to save space, their buffer takes the next read
+		if(IsZeroBlock(diskBuffer, paddedSize))
+			ppFree[nFree++] = diskBuffer;
+		else if(!vhdx.WriteBlock(blockIndex, diskBuffer, paddedSize, diskBuffer))
+		{
+			TRACE("Failed to write block %u with error 0x%08X\n", blockIndex, m_VhdFile.GetLastError());
+			pSink->Status("Failed to write the VHDX file.", TRUE);
+			goto clean;
+		}
+
+		diskPos += bytesRead;
+
+		UINT64 currentTime = GetTickCountMs();
+		if(currentTime - lastStatusUpdate >= 500 || diskPos == diskSize)
+		{
+			char statusMsg[256];
+			lastStatusUpdate = currentTime;
+
+			snprintf(statusMsg, sizeof(statusMsg), "Converting disk data... %llu MB of %llu MB (%llu MB stored)"
+				, (unsigned long long)(diskPos >> 20), (unsigned long long)(diskSize >> 20)
+				, (unsigned long long)(vhdx.GetFileSize() >> 20));
+
+			pSink->Status(statusMsg);
+			pSink->Progress(diskPos, diskSize);
+		}
+	}
+
+	pSink->Status("Finalizing VHDX file structure...");
+
+	result = TRUE;
+
+clean:
+
+	// nothing is written from the buffers past Close
+	if(!vhdx.Close())
+		result = FALSE;
+
+	for(UINT32 i = 0; i < 2; i++)
+		if(pBuffers[i])
+			FreeAligned(pBuffers[i]);
+
+	return result;
+}
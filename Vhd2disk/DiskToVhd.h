@@ -1,35 +1,84 @@
 #pragma once
 
 #include "VhdToDisk.h"
+#include "VhdxWriter.h"
+#include "VhdChain.h"
+#include "FreeSpace.h"
+
+#define CAPTURE_BLOCK_AUTO		0xFFFFFFFF	// nBlockSize picked from the disk size and a sample of its content
+#define CAPTURE_BLOCK_MIN		(1024 * 1024)
+#define CAPTURE_BLOCK_MAX		(256 * 1024 * 1024)
+
+// Tuning for CDiskToVhd::DumpDiskToVhd, see InitCaptureOptions for defaults
+typedef struct _CAPTURE_OPTIONS
+{
+	DWORD	dwDiskType;			// VHD_TYPE_DYNAMIC (sparse) or VHD_TYPE_FIXED (raw copy + footer)
+	UINT32	nQueueDepth;		// dynamic VHD: block reads/writes in flight at once
+	BOOL	bUnbuffered;		// bypass the OS cache on the source and the VHD (payload)
+	BOOL	bSkipFree;			// read and store only clusters the filesystems have allocated
+	BOOL	bPreallocate;		// VHD: reserve the file's space in big steps ahead of the writes
+	LPCPATH	sParentPath;		// differencing VHD of what changed since this VHD, NULL for a full capture
+
+	// Dynamic VHD and VHDX: bytes, a power of two from 1 MB to 256 MB, 0 for the
+	// format's default (2 MB VHD, 32 MB VHDX) or CAPTURE_BLOCK_AUTO
+	UINT32	nBlockSize;
+
+	// VHDX output, picked when the image name ends in .vhdx
+	UINT32	nLogicalSector;		// 512 or 4096
+	UINT32	nPhysicalSector;	// 512 or 4096
+} CAPTURE_OPTIONS;
+
+void InitCaptureOptions(CAPTURE_OPTIONS* pOptions);
 
 class CDiskToVhd
 {
 	VHD_FOOTER	m_Foot;
 	VHD_DYNAMIC m_Dyn;
 
-	HANDLE		m_hVhdFile;
-	HANDLE		m_hPhysicalDrive;
+	CAPTURE_OPTIONS	m_Options;
+
+	CBlockDevice	m_VhdFile;
+	CBlockDevice	m_PhysicalDrive;
+	LPCPATH			m_sVhdPath;		// while DumpDiskToVhd runs
+	BOOL			m_bStream;		// "-": written to stdout strictly front to back, BAT last
+	UINT64			m_nReserved;	// end of the space preallocated so far, 0 if none
+	CFreeSpaceMap	m_FreeSpace;	// empty unless bSkipFree
+	CVhdChain		m_Parent;		// open when sParentPath is set
+
+	BYTE*			m_pLocators;	// parent locator data, stored after the BAT
+	UINT32			m_nLocatorBytes;
 
 public:
 	CDiskToVhd(void);
 	~CDiskToVhd(void);
 
-	BOOL DumpDiskToVhd(const LPWSTR sDrive, const LPWSTR sVhdPath, const HWND hDlg);
+	BOOL DumpDiskToVhd(LPCPATH sDrive, LPCPATH sVhdPath, CProgressSink* pSink);
+
+	void SetOptions(const CAPTURE_OPTIONS& options) { m_Options = options; }
 
 protected:
-	BOOL OpenPhysicalDrive(LPWSTR sDrive);
+	BOOL OpenPhysicalDrive(LPCPATH sDrive);
 	BOOL ClosePhysicalDrive();
 
-	BOOL CreateVhdFile(LPWSTR sPath);
+	BOOL CreateVhdFile(LPCPATH sPath);
+	BOOL ReopenVhdFile(BOOL bUnbuffered);
 	BOOL CloseVhdFile();
 
 	BOOL InitializeVhdStructures(UINT64 diskSize);
-	BOOL WriteFooter();
+	BOOL WriteFooter(UINT64 nOffset);
 	BOOL WriteDynHeader();
 	BOOL WriteBlockAllocationTable();
+	BOOL InitializeParentLocators();
+	UINT64 GetDataStart(UINT32 totalBlocks);
+	void ReserveVhdSpace(UINT64 nEnd);
+	BOOL TrimVhdFile(UINT64 nSize);
 	
-	BOOL ReadAndWriteDiskData(HWND hDlg);
+	BOOL ReadAndWriteDiskData(CProgressSink* pSink);
 	UINT64 GetDiskSize();
+	UINT32 GetBlockHeadSize(UINT32 blockSize);
+	UINT32 SampleBlockSize(UINT64 diskSize, CProgressSink* pSink);
 	
-	BOOL DumpDiskToVhdData(HWND hDlg);
+	BOOL DumpDiskToVhdData(CProgressSink* pSink);
+	BOOL DumpDiskToFixedVhd(CProgressSink* pSink);
+	BOOL DumpDiskToVhdx(CProgressSink* pSink);
 };
\ No newline at end of file
@@ -0,0 +1,731 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "FreeSpace.h"
+
+#define FREESPACE_ALIGN		4096				// reads stay valid on an unbuffered disk
+#define FREESPACE_CHUNK		(1024 * 1024)		// bitmaps and tables are read this much at a time
+#define FREESPACE_MAX_EBR	128					// logical partitions followed, at most
+
+CFreeSpaceMap::CFreeSpaceMap(void)
+{
+	m_pDisk = NULL;
+	m_nDiskSize = 0;
+	m_pRuns = NULL;
+	m_nRuns = 0;
+	m_nAlloc = 0;
+	m_nFreeBytes = 0;
+	m_nFileSystems = 0;
+	m_nPartStart = 0;
+	m_nPartEnd = 0;
+	m_nMark = 0;
+	m_pBounce = NULL;
+	m_nBounce = 0;
+}
+
+CFreeSpaceMap::~CFreeSpaceMap(void)
+{
+	Clear();
+}
+
+void CFreeSpaceMap::Clear()
+{
+	delete[] m_pRuns;
+	m_pRuns = NULL;
+	m_nRuns = 0;
+	m_nAlloc = 0;
+	m_nFreeBytes = 0;
+	m_nFileSystems = 0;
+
+	if(m_pBounce)
+		FreeAligned(m_pBounce);
+	m_pBounce = NULL;
+	m_nBounce = 0;
+}
+
+static int CompareRuns(const void* a, const void* b)
+{
+	UINT64 x = ((const FREE_RUN*)a)->nOffset;
+	UINT64 y = ((const FREE_RUN*)b)->nOffset;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+BOOL CFreeSpaceMap::Build(CBlockDevice* pDisk, UINT64 nDiskSize)
+{
+	MBR_SECTOR mbr;
+
+	Clear();
+
+	m_pDisk = pDisk;
+	m_nDiskSize = nDiskSize;
+
+	if(!Read(0, &mbr, sizeof(mbr)))
+		return FALSE;
+
+	// A volume boot sector at sector 0 (partition image, superfloppy) has the
+	// same signature as an MBR, tell them apart by the filesystem name
+	const FAT_BOOT_SECTOR* pBoot = (const FAT_BOOT_SECTOR*)&mbr;
+	BOOL bVolume = memcmp(pBoot->oemId, "NTFS    ", 8) == 0
+		|| memcmp(pBoot->fsType16, "FAT", 3) == 0 || memcmp(pBoot->fsType32, "FAT32", 5) == 0;
+
+	if(!(bVolume && ScanPartition(0, nDiskSize)) && !ScanMbr(&mbr))
+		ScanPartition(0, nDiskSize);
+
+	// Partitions may be listed in any order
+	qsort(m_pRuns, m_nRuns, sizeof(FREE_RUN), CompareRuns);
+
+	UINT32 n = 0;
+	for(UINT32 i = 0; i < m_nRuns; i++)
+	{
+		if(n && m_pRuns[n - 1].nOffset + m_pRuns[n - 1].nBytes >= m_pRuns[i].nOffset)
+		{
+			UINT64 nEnd = m_pRuns[i].nOffset + m_pRuns[i].nBytes;
+			if(nEnd > m_pRuns[n - 1].nOffset + m_pRuns[n - 1].nBytes)
+				m_pRuns[n - 1].nBytes = nEnd - m_pRuns[n - 1].nOffset;
+			continue;
+		}
+
+		m_pRuns[n++] = m_pRuns[i];
+	}
+	m_nRuns = n;
+
+	for(UINT32 i = 0; i < m_nRuns; i++)
+		m_nFreeBytes += m_pRuns[i].nBytes;
+
+	FreeAligned(m_pBounce);
+	m_pBounce = NULL;
+	m_nBounce = 0;
+
+	TRACE("%u filesystems, %u free runs, %llu bytes free\n", m_nFileSystems, m_nRuns, (unsigned long long)m_nFreeBytes);
+
+	return TRUE;
+}
+
+BOOL CFreeSpaceMap::Read(UINT64 nOffset, void* pBuff, DWORD nBytes)
+{
+	UINT64 nStart = nOffset & ~(UINT64)(FREESPACE_ALIGN - 1);
+	UINT64 nEnd = (nOffset + nBytes + FREESPACE_ALIGN - 1) & ~(UINT64)(FREESPACE_ALIGN - 1);
+	DWORD nSpan = (DWORD)(nEnd - nStart);
+	DWORD dwRead = 0;
+
+	if(nOffset + nBytes > m_nDiskSize)
+		return FALSE;
+
+	if(nSpan > m_nBounce)
+	{
+		if(m_pBounce)
+			FreeAligned(m_pBounce);
+
+		m_pBounce = (BYTE*)AllocAligned(nSpan, FREESPACE_ALIGN);
+		m_nBounce = m_pBounce ? nSpan : 0;
+		if(!m_pBounce)
+			return FALSE;
+	}
+
+	if(!m_pDisk->ReadAt(nStart, m_pBounce, nSpan, &dwRead) || dwRead < nOffset - nStart + nBytes)
+	{
+		TRACE("Failed to read %u bytes at %llu with error 0x%08X\n", nBytes, (unsigned long long)nOffset, m_pDisk->GetLastError());
+		return FALSE;
+	}
+
+	memcpy(pBuff, m_pBounce + (nOffset - nStart), nBytes);
+
+	return TRUE;
+}
+
+void CFreeSpaceMap::AddFree(UINT64 nOffset, UINT64 nBytes)
+{
+	UINT64 nEnd = nOffset + nBytes;
+
+	if(nOffset < m_nPartStart) nOffset = m_nPartStart;
+	if(nEnd > m_nPartEnd) nEnd = m_nPartEnd;
+	if(nEnd <= nOffset)
+		return;
+
+	// Bitmaps are walked in order, most runs extend the last one
+	if(m_nRuns > m_nMark && m_pRuns[m_nRuns - 1].nOffset + m_pRuns[m_nRuns - 1].nBytes == nOffset)
+	{
+		m_pRuns[m_nRuns - 1].nBytes += nEnd - nOffset;
+		return;
+	}
+
+	if(m_nRuns == m_nAlloc)
+	{
+		UINT32 nAlloc = m_nAlloc ? m_nAlloc * 2 : 1024;
+		FREE_RUN* pRuns = new FREE_RUN[nAlloc];
+		if(!pRuns)
+			return;
+
+		if(m_nRuns)
+			memcpy(pRuns, m_pRuns, m_nRuns * sizeof(FREE_RUN));
+
+		delete[] m_pRuns;
+		m_pRuns = pRuns;
+		m_nAlloc = nAlloc;
+	}
+
+	m_pRuns[m_nRuns].nOffset = nOffset;
+	m_pRuns[m_nRuns].nBytes = nEnd - nOffset;
+	m_nRuns++;
+}
+
+// Bit n (LSB first) clear: unit n, at nBase + n * nUnit, is free
+void CFreeSpaceMap::AddFreeBits(const BYTE* pBits, UINT64 nBits, UINT64 nBase, UINT64 nUnit)
+{
+	for(UINT64 i = 0; i < nBits; )
+	{
+		BYTE b = pBits[i / 8];
+
+		if((i & 7) == 0 && i + 8 <= nBits && (b == 0x00 || b == 0xFF))
+		{
+			if(b == 0x00)
+				AddFree(nBase + i * nUnit, 8 * nUnit);
+			i += 8;
+			continue;
+		}
+
+		if(!(b & (1 << (i & 7))))
+			AddFree(nBase + i * nUnit, nUnit);
+		i++;
+	}
+}
+
+// First run ending after nOffset, m_nRuns if none
+UINT32 CFreeSpaceMap::FindRun(UINT64 nOffset) const
+{
+	UINT32 lo = 0, hi = m_nRuns;
+
+	while(lo < hi)
+	{
+		UINT32 mid = (lo + hi) / 2;
+		if(m_pRuns[mid].nOffset + m_pRuns[mid].nBytes > nOffset)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+BOOL CFreeSpaceMap::IsFree(UINT64 nOffset, UINT64 nBytes) const
+{
+	UINT32 i = FindRun(nOffset);
+
+	return i < m_nRuns && m_pRuns[i].nOffset <= nOffset && m_pRuns[i].nOffset + m_pRuns[i].nBytes >= nOffset + nBytes;
+}
+
+void CFreeSpaceMap::ZeroFree(UINT64 nOffset, BYTE* pBuff, DWORD nBytes) const
+{
+	UINT64 nEnd = nOffset + nBytes;
+
+	for(UINT32 i = FindRun(nOffset); i < m_nRuns && m_pRuns[i].nOffset < nEnd; i++)
+	{
+		UINT64 nFrom = m_pRuns[i].nOffset > nOffset ? m_pRuns[i].nOffset : nOffset;
+		UINT64 nTo = m_pRuns[i].nOffset + m_pRuns[i].nBytes < nEnd ? m_pRuns[i].nOffset + m_pRuns[i].nBytes : nEnd;
+
+		memset(pBuff + (nFrom - nOffset), 0, (size_t)(nTo - nFrom));
+	}
+}
+
+BOOL CFreeSpaceMap::ScanMbr(const MBR_SECTOR* pMbr)
+{
+	BOOL bFound = FALSE;
+
+	if(pMbr->signature != 0xAA55)
+		return FALSE;
+
+	for(UINT32 i = 0; i < 4; i++)
+	{
+		const MBR_PARTITION* p = &pMbr->partitions[i];
+
+		if((p->status & 0x7F) || (UINT64)p->lbaFirst * 512 >= m_nDiskSize)
+			return FALSE;
+	}
+
+	for(UINT32 i = 0; i < 4; i++)
+	{
+		const MBR_PARTITION* p = &pMbr->partitions[i];
+
+		if(!p->type || !p->sectors)
+			continue;
+
+		// Protective MBR of a GPT disk
+		if(p->type == 0xEE)
+			return ScanGpt();
+
+		bFound = TRUE;
+
+		if(p->type != 0x05 && p->type != 0x0F && p->type != 0x85)
+		{
+			ScanPartition((UINT64)p->lbaFirst * 512, (UINT64)p->sectors * 512);
+			continue;
+		}
+
+		// Extended partition: a chain of EBRs, each holding one logical partition
+		// (relative to the EBR) and a link to the next (relative to the extended one)
+		UINT64 nExtended = p->lbaFirst;
+		UINT64 nEbr = nExtended;
+
+		for(UINT32 n = 0; n < FREESPACE_MAX_EBR; n++)
+		{
+			MBR_SECTOR ebr;
+
+			if(!Read(nEbr * 512, &ebr, sizeof(ebr)) || ebr.signature != 0xAA55)
+				break;
+
+			const MBR_PARTITION* pLogical = &ebr.partitions[0];
+			const MBR_PARTITION* pNext = &ebr.partitions[1];
+
+			if(pLogical->type && pLogical->sectors)
+				ScanPartition((nEbr + pLogical->lbaFirst) * 512, (UINT64)pLogical->sectors * 512);
+
+			if(!pNext->type || !pNext->lbaFirst)
+				break;
+
+			nEbr = nExtended + pNext->lbaFirst;
+		}
+	}
+
+	return bFound;
+}
+
+BOOL CFreeSpaceMap::ScanGpt()
+{
+	static const BYTE zeroGuid[16] = {0};
+	GPT_HEADER header;
+	UINT32 nSectorSize = 512;
+	BYTE* pEntries = NULL;
+
+	// The header is in LBA 1, 4 KB into a 4Kn disk
+	if(!Read(512, &header, sizeof(header)) || memcmp(header.signature, "EFI PART", 8) != 0)
+	{
+		nSectorSize = 4096;
+		if(!Read(4096, &header, sizeof(header)) || memcmp(header.signature, "EFI PART", 8) != 0)
+			return FALSE;
+	}
+
+	if(!header.entryCount || header.entryCount > 1024 || header.entrySize < sizeof(GPT_ENTRY)
+		|| header.entrySize > 4096 || (header.entrySize & 7))
+		return FALSE;
+
+	DWORD nBytes = header.entryCount * header.entrySize;
+	pEntries = new BYTE[nBytes];
+	if(!pEntries || !Read(header.entriesLba * nSectorSize, pEntries, nBytes))
+	{
+		delete[] pEntries;
+		return FALSE;
+	}
+
+	for(UINT32 i = 0; i < header.entryCount; i++)
+	{
+		const GPT_ENTRY* p = (const GPT_ENTRY*)(pEntries + (size_t)i * header.entrySize);
+
+		if(memcmp(p->typeGuid, zeroGuid, 16) == 0 || p->lastLba < p->firstLba)
+			continue;
+
+		ScanPartition(p->firstLba * nSectorSize, (p->lastLba - p->firstLba + 1) * nSectorSize);
+	}
+
+	delete[] pEntries;
+
+	return TRUE;
+}
+
+BOOL CFreeSpaceMap::ScanPartition(UINT64 nOffset, UINT64 nBytes)
+{
+	if(nOffset >= m_nDiskSize)
+		return FALSE;
+
+	if(nBytes > m_nDiskSize - nOffset)
+		nBytes = m_nDiskSize - nOffset;
+
+	m_nPartStart = nOffset;
+	m_nPartEnd = nOffset + nBytes;
+	m_nMark = m_nRuns;
+
+	// Each scanner drops what it added if it gives up halfway
+	BOOL bFound = ScanNtfs(nOffset);
+	if(!bFound)
+	{
+		m_nRuns = m_nMark;
+		bFound = ScanFat(nOffset);
+	}
+	if(!bFound)
+	{
+		m_nRuns = m_nMark;
+		bFound = ScanExt(nOffset);
+	}
+	if(!bFound)
+	{
+		m_nRuns = m_nMark;
+		TRACE("No known filesystem at %llu, kept whole\n", (unsigned long long)nOffset);
+		return FALSE;
+	}
+
+	m_nFileSystems++;
+
+	return TRUE;
+}
+
+// NTFS: $Bitmap is MFT record 6, always in the first extent of $MFT; its
+// $DATA attribute holds one bit per cluster
+BOOL CFreeSpaceMap::ScanNtfs(UINT64 nOffset)
+{
+	NTFS_BOOT_SECTOR boot;
+	BOOL bReturn = FALSE;
+	BYTE* pRecord = NULL;
+	BYTE* pChunk = NULL;
+
+	if(!Read(nOffset, &boot, sizeof(boot)) || memcmp(boot.oemId, "NTFS    ", 8) != 0 || boot.signature != 0xAA55)
+		return FALSE;
+
+	UINT32 nSectorSize = boot.bytesPerSector;
+	UINT32 nSectorsPerCluster = boot.sectorsPerCluster <= 0x80 ? boot.sectorsPerCluster : 1U << (256 - boot.sectorsPerCluster);
+	if(nSectorSize < 512 || nSectorSize > 4096 || (nSectorSize & (nSectorSize - 1))
+		|| !nSectorsPerCluster || (nSectorsPerCluster & (nSectorsPerCluster - 1)))
+		return FALSE;
+
+	UINT64 nClusterSize = (UINT64)nSectorSize * nSectorsPerCluster;
+	UINT64 nClusters = boot.totalSectors / nSectorsPerCluster;
+	UINT64 nRecordSize = boot.clustersPerMftRecord > 0 ? boot.clustersPerMftRecord * nClusterSize
+		: 1ULL << (-boot.clustersPerMftRecord & 63);
+
+	if(nClusterSize > 2 * 1024 * 1024 || nRecordSize < 512 || nRecordSize > 65536 || !nClusters || boot.mftLcn >= nClusters)
+		return FALSE;
+
+	pRecord = new BYTE[(size_t)nRecordSize];
+	if(!pRecord || !Read(nOffset + boot.mftLcn * nClusterSize + 6 * nRecordSize, pRecord, (DWORD)nRecordSize)
+		|| memcmp(pRecord, "FILE", 4) != 0)
+		goto clean;
+
+	// Undo the update sequence: the last 2 bytes of every 512 byte stride
+	// were swapped for the sequence number
+	{
+		UINT16 nUsaOffset = *(UINT16*)(pRecord + 4);
+		UINT16 nUsaCount = *(UINT16*)(pRecord + 6);
+
+		if(!nUsaCount || nUsaOffset + nUsaCount * 2U > nRecordSize || (nUsaCount - 1) * 512U > nRecordSize)
+			goto clean;
+
+		UINT16* pUsa = (UINT16*)(pRecord + nUsaOffset);
+		for(UINT32 i = 1; i < nUsaCount; i++)
+		{
+			UINT16* pEnd = (UINT16*)(pRecord + i * 512 - 2);
+			if(*pEnd != pUsa[0])
+				goto clean;
+			*pEnd = pUsa[i];
+		}
+	}
+
+	{
+		UINT32 nAttr = *(UINT16*)(pRecord + 0x14);
+		UINT64 nBitmapBytes = (nClusters + 7) / 8;
+		UINT64 nBit = 0;
+
+		// Unnamed $DATA attribute (0x80)
+		for(;;)
+		{
+			if(nAttr + 16 > nRecordSize || *(UINT32*)(pRecord + nAttr) == 0xFFFFFFFF)
+				goto clean;
+
+			UINT32 nLength = *(UINT32*)(pRecord + nAttr + 4);
+			if(nLength < 16 || nAttr + nLength > nRecordSize)
+				goto clean;
+
+			if(*(UINT32*)(pRecord + nAttr) == 0x80 && pRecord[nAttr + 9] == 0)
+				break;
+
+			nAttr += nLength;
+		}
+
+		const BYTE* pAttr = pRecord + nAttr;
+		UINT32 nLength = *(UINT32*)(pAttr + 4);
+
+		if(!pAttr[8])
+		{
+			// Resident, only on tiny volumes
+			UINT32 nValue = *(UINT32*)(pAttr + 0x10);
+			UINT16 nValueOffset = *(UINT16*)(pAttr + 0x14);
+
+			if(nValueOffset + nValue > nLength || nValue < nBitmapBytes)
+				goto clean;
+
+			AddFreeBits(pAttr + nValueOffset, nClusters, nOffset, nClusterSize);
+			bReturn = TRUE;
+			goto clean;
+		}
+
+		if(nLength < 0x40 || *(UINT64*)(pAttr + 0x30) < nBitmapBytes)
+			goto clean;
+
+		pChunk = new BYTE[FREESPACE_CHUNK];
+		if(!pChunk)
+			goto clean;
+
+		// Run list: a header byte giving the size of the length and of the
+		// (signed, relative) cluster number that follow
+		const BYTE* pRun = pAttr + *(UINT16*)(pAttr + 0x20);
+		const BYTE* pEnd = pAttr + nLength;
+		INT64 nLcn = 0;
+
+		while(pRun < pEnd && *pRun && nBit < nClusters)
+		{
+			UINT32 nLenBytes = *pRun & 0x0F;
+			UINT32 nOffBytes = *pRun >> 4;
+			UINT64 nRunLength = 0;
+			UINT64 nDelta = 0;
+
+			// a sparse run (no cluster number) has no business in $Bitmap
+			if(!nLenBytes || nLenBytes > 8 || !nOffBytes || nOffBytes > 8 || pRun + 1 + nLenBytes + nOffBytes > pEnd)
+				goto clean;
+
+			for(UINT32 i = 0; i < nLenBytes; i++)
+				nRunLength |= (UINT64)pRun[1 + i] << (8 * i);
+			for(UINT32 i = 0; i < nOffBytes; i++)
+				nDelta |= (UINT64)pRun[1 + nLenBytes + i] << (8 * i);
+			if(nOffBytes < 8 && (pRun[nLenBytes + nOffBytes] & 0x80))
+				nDelta |= ~0ULL << (8 * nOffBytes);
+
+			nLcn += (INT64)nDelta;
+			pRun += 1 + nLenBytes + nOffBytes;
+
+			if(nLcn < 0 || (UINT64)nLcn + nRunLength > nClusters)
+				goto clean;
+
+			UINT64 nRunBytes = nRunLength * nClusterSize;
+			for(UINT64 nDone = 0; nDone < nRunBytes && nBit < nClusters; )
+			{
+				UINT64 nLeft = (nClusters - nBit + 7) / 8;
+				DWORD nRead = (DWORD)(nRunBytes - nDone < FREESPACE_CHUNK ? nRunBytes - nDone : FREESPACE_CHUNK);
+				if(nRead > nLeft)
+					nRead = (DWORD)((nLeft + 511) & ~511ULL);
+
+				if(!Read(nOffset + (UINT64)nLcn * nClusterSize + nDone, pChunk, nRead))
+					goto clean;
+
+				UINT64 nBits = (UINT64)nRead * 8 < nClusters - nBit ? (UINT64)nRead * 8 : nClusters - nBit;
+				AddFreeBits(pChunk, nBits, nOffset + nBit * nClusterSize, nClusterSize);
+
+				nBit += nBits;
+				nDone += nRead;
+			}
+		}
+
+		// Clusters past the end of the runs stay used
+		bReturn = TRUE;
+	}
+
+clean:
+
+	delete[] pRecord;
+	delete[] pChunk;
+
+	return bReturn;
+}
+
+// FAT12/16/32: a cluster is free when its FAT entry is 0. Everything in front
+// of the data area (boot sector, FATs, FAT12/16 root directory) stays used.
+BOOL CFreeSpaceMap::ScanFat(UINT64 nOffset)
+{
+	FAT_BOOT_SECTOR boot;
+	BOOL bReturn = FALSE;
+	BYTE* pChunk = NULL;
+
+	if(!Read(nOffset, &boot, sizeof(boot)) || boot.signature != 0xAA55
+		|| (boot.jump[0] != 0xEB && boot.jump[0] != 0xE9)
+		|| (memcmp(boot.fsType16, "FAT", 3) != 0 && memcmp(boot.fsType32, "FAT32", 5) != 0))
+		return FALSE;
+
+	UINT32 nSectorSize = boot.bytesPerSector;
+	UINT32 nSectorsPerCluster = boot.sectorsPerCluster;
+	if(nSectorSize < 512 || nSectorSize > 4096 || (nSectorSize & (nSectorSize - 1))
+		|| !nSectorsPerCluster || (nSectorsPerCluster & (nSectorsPerCluster - 1))
+		|| !boot.reservedSectors || !boot.fatCount)
+		return FALSE;
+
+	UINT64 nFatSize = boot.fatSize16 ? boot.fatSize16 : boot.fatSize32;
+	UINT64 nTotal = boot.totalSectors16 ? boot.totalSectors16 : boot.totalSectors32;
+	UINT64 nRootSectors = (boot.rootEntries * 32 + nSectorSize - 1) / nSectorSize;
+	UINT64 nMeta = boot.reservedSectors + boot.fatCount * nFatSize + nRootSectors;
+
+	if(!nFatSize || nTotal <= nMeta)
+		return FALSE;
+
+	// The type goes by the cluster count, nothing else
+	UINT64 nClusters = (nTotal - nMeta) / nSectorsPerCluster;
+	UINT32 nFatBits = nClusters < 4085 ? 12 : nClusters < 65525 ? 16 : 32;
+	UINT64 nClusterSize = (UINT64)nSectorSize * nSectorsPerCluster;
+	UINT64 nDataStart = nOffset + nMeta * nSectorSize;
+	UINT64 nFatStart = nOffset + (UINT64)boot.reservedSectors * nSectorSize;
+
+	if(nFatBits == 32 && (boot.rootEntries || boot.fatSize16))
+		return FALSE;
+
+	if((nClusters + 2) * nFatBits / 8 + 1 > nFatSize * nSectorSize)
+		return FALSE;
+
+	pChunk = new BYTE[FREESPACE_CHUNK];
+	if(!pChunk)
+		return FALSE;
+
+	if(nFatBits == 12)
+	{
+		// At most 6 KB, entries straddle bytes
+		DWORD nBytes = (DWORD)((nClusters + 2) * 3 / 2 + 1);
+
+		if(!Read(nFatStart, pChunk, nBytes))
+			goto clean;
+
+		for(UINT64 c = 2; c < nClusters + 2; c++)
+		{
+			UINT32 n = pChunk[c * 3 / 2] | (pChunk[c * 3 / 2 + 1] << 8);
+			if(((c & 1) ? n >> 4 : n & 0xFFF) == 0)
+				AddFree(nDataStart + (c - 2) * nClusterSize, nClusterSize);
+		}
+	}
+	else
+	{
+		UINT32 nEntrySize = nFatBits / 8;
+		UINT32 nPerChunk = FREESPACE_CHUNK / nEntrySize;
+
+		for(UINT64 c = 0; c < nClusters + 2; c += nPerChunk)
+		{
+			UINT64 nCount = nClusters + 2 - c < nPerChunk ? nClusters + 2 - c : nPerChunk;
+
+			if(!Read(nFatStart + c * nEntrySize, pChunk, (DWORD)(nCount * nEntrySize)))
+				goto clean;
+
+			for(UINT64 i = c < 2 ? 2 - c : 0; i < nCount; i++)
+			{
+				UINT32 n = nEntrySize == 2 ? ((UINT16*)pChunk)[i] : ((UINT32*)pChunk)[i] & 0x0FFFFFFF;
+				if(n == 0)
+					AddFree(nDataStart + (c + i - 2) * nClusterSize, nClusterSize);
+			}
+		}
+	}
+
+	bReturn = TRUE;
+
+clean:
+
+	delete[] pChunk;
+
+	return bReturn;
+}
+
+// Group g holds a superblock backup (and the group descriptors after it)
+static BOOL ExtHasSuper(const EXT_SUPERBLOCK* pSb, UINT64 g)
+{
+	if(g == 0)
+		return TRUE;
+
+	if(pSb->featureCompat & EXT_COMPAT_SPARSE_SUPER2)
+		return g == pSb->backupBgs[0] || g == pSb->backupBgs[1];
+
+	if(!(pSb->featureRoCompat & EXT_RO_COMPAT_SPARSE_SUPER) || g == 1)
+		return TRUE;
+
+	// powers of 3, 5 and 7
+	for(UINT64 nBase = 3; nBase <= 7; nBase += 2)
+	{
+		UINT64 n = nBase;
+		while(n < g)
+			n *= nBase;
+		if(n == g)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+// ext2/3/4: one block bitmap per block group. A group flagged BLOCK_UNINIT
+// has none on disk, only its own metadata is in use there.
+BOOL CFreeSpaceMap::ScanExt(UINT64 nOffset)
+{
+	EXT_SUPERBLOCK sb;
+	BOOL bReturn = FALSE;
+	BYTE* pBits = NULL;
+	BYTE* pDescs = NULL;
+
+	if(!Read(nOffset + 1024, &sb, sizeof(sb)) || sb.magic != 0xEF53 || sb.logBlockSize > 6)
+		return FALSE;
+
+	// Cluster bitmaps (bigalloc) and descriptors spread over meta groups are not handled
+	if((sb.featureRoCompat & EXT_RO_COMPAT_BIGALLOC) || (sb.featureIncompat & EXT_INCOMPAT_META_BG))
+		return FALSE;
+
+	BOOL b64 = (sb.featureIncompat & EXT_INCOMPAT_64BIT) != 0;
+	BOOL bFlags = (sb.featureRoCompat & (EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_METADATA_CSUM)) != 0;
+	UINT32 nBlockSize = 1024U << sb.logBlockSize;
+	UINT64 nBlocks = sb.blocksCountLo | (b64 ? (UINT64)sb.blocksCountHi << 32 : 0);
+	UINT32 nPerGroup = sb.blocksPerGroup;
+	UINT32 nDescSize = b64 ? sb.descSize : 32;
+
+	if(!nPerGroup || nPerGroup > nBlockSize * 8 || nBlocks <= sb.firstDataBlock
+		|| nDescSize < (b64 ? 64U : 32U) || nDescSize > nBlockSize || (nDescSize & (nDescSize - 1)))
+		return FALSE;
+
+	UINT64 nGroups = (nBlocks - sb.firstDataBlock + nPerGroup - 1) / nPerGroup;
+	UINT64 nGdtBlocks = (nGroups * nDescSize + nBlockSize - 1) / nBlockSize;
+	UINT32 nInodeSize = sb.revLevel ? sb.inodeSize : 128;
+	UINT64 nInodeTableBlocks = ((UINT64)sb.inodesPerGroup * nInodeSize + nBlockSize - 1) / nBlockSize;
+	UINT64 nGdtOffset = nOffset + ((UINT64)sb.firstDataBlock + 1) * nBlockSize;
+	UINT32 nPerChunk = FREESPACE_CHUNK / nDescSize;
+
+	pBits = new BYTE[nBlockSize];
+	pDescs = new BYTE[FREESPACE_CHUNK];
+	if(!pBits || !pDescs)
+		goto clean;
+
+	for(UINT64 g = 0; g < nGroups; g++)
+	{
+		EXT_GROUP_DESC desc;
+
+		if(g % nPerChunk == 0)
+		{
+			UINT64 nCount = nGroups - g < nPerChunk ? nGroups - g : nPerChunk;
+			if(!Read(nGdtOffset + g * nDescSize, pDescs, (DWORD)(nCount * nDescSize)))
+				goto clean;
+		}
+
+		ZeroMemory(&desc, sizeof(desc));
+		memcpy(&desc, pDescs + (g % nPerChunk) * nDescSize, nDescSize < sizeof(desc) ? nDescSize : sizeof(desc));
+
+		UINT64 nFirst = sb.firstDataBlock + g * nPerGroup;
+		UINT64 nCount = nBlocks - nFirst < nPerGroup ? nBlocks - nFirst : nPerGroup;
+		UINT64 nBitmap = desc.blockBitmapLo | (b64 ? (UINT64)desc.blockBitmapHi << 32 : 0);
+
+		if(bFlags && (desc.flags & EXT_BG_BLOCK_UNINIT))
+		{
+			// What the kernel marks used when it initializes such a group
+			UINT64 nUsed[3][2] = {
+				{ nBitmap, 1 },
+				{ desc.inodeBitmapLo | (b64 ? (UINT64)desc.inodeBitmapHi << 32 : 0), 1 },
+				{ desc.inodeTableLo | (b64 ? (UINT64)desc.inodeTableHi << 32 : 0), nInodeTableBlocks } };
+
+			ZeroMemory(pBits, nBlockSize);
+
+			if(ExtHasSuper(&sb, g))
+				for(UINT64 b = 0; b < 1 + nGdtBlocks + sb.reservedGdtBlocks && b < nCount; b++)
+					pBits[b / 8] |= 1 << (b & 7);
+
+			for(UINT32 i = 0; i < 3; i++)
+				for(UINT64 b = nUsed[i][0]; b < nUsed[i][0] + nUsed[i][1]; b++)
+					if(b >= nFirst && b < nFirst + nCount)
+						pBits[(b - nFirst) / 8] |= 1 << ((b - nFirst) & 7);
+		}
+		else if(nBitmap >= nBlocks || !Read(nOffset + nBitmap * nBlockSize, pBits, nBlockSize))
+			goto clean;
+
+		AddFreeBits(pBits, nCount, nOffset + nFirst * nBlockSize, nBlockSize);
+	}
+
+	bReturn = TRUE;
+
+clean:
+
+	delete[] pBits;
+	delete[] pDescs;
+
+	return bReturn;
+}
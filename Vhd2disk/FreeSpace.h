@@ -0,0 +1,220 @@
+#pragma once
+
+#include "BlockDevice.h"
+
+// Free space of the filesystems on a disk, read from their allocation maps
+// (NTFS $Bitmap, ext2/3/4 block group bitmaps, FAT) so a capture can skip it.
+// Partitions come from the MBR (extended partitions included) or the GPT, a
+// disk without partition table may hold one filesystem. Whatever can't be
+// parsed with certainty counts as used.
+
+#pragma pack(push, 1)
+
+typedef struct _MBR_PARTITION
+{
+	BYTE	status;
+	BYTE	chsFirst[3];
+	BYTE	type;
+	BYTE	chsLast[3];
+	UINT32	lbaFirst;
+	UINT32	sectors;
+} MBR_PARTITION;
+
+typedef struct _MBR_SECTOR
+{
+	BYTE			bootCode[446];
+	MBR_PARTITION	partitions[4];
+	UINT16			signature;		// 0xAA55
+} MBR_SECTOR;
+
+typedef struct _GPT_HEADER
+{
+	CHAR	signature[8];		// "EFI PART"
+	UINT32	revision;
+	UINT32	headerSize;
+	UINT32	headerCrc;
+	UINT32	reserved;
+	UINT64	currentLba;
+	UINT64	backupLba;
+	UINT64	firstUsableLba;
+	UINT64	lastUsableLba;
+	BYTE	diskGuid[16];
+	UINT64	entriesLba;
+	UINT32	entryCount;
+	UINT32	entrySize;
+	UINT32	entriesCrc;
+} GPT_HEADER;
+
+typedef struct _GPT_ENTRY
+{
+	BYTE	typeGuid[16];		// all zero: unused
+	BYTE	uniqueGuid[16];
+	UINT64	firstLba;
+	UINT64	lastLba;			// inclusive
+	UINT64	attributes;
+	UINT16	name[36];		// UTF-16
+} GPT_ENTRY;
+
+typedef struct _NTFS_BOOT_SECTOR
+{
+	BYTE	jump[3];
+	CHAR	oemId[8];			// "NTFS    "
+	UINT16	bytesPerSector;
+	BYTE	sectorsPerCluster;	// above 0x80: 2^(256 - n)
+	BYTE	reserved[26];
+	UINT64	totalSectors;
+	UINT64	mftLcn;
+	UINT64	mftMirrLcn;
+	signed char	clustersPerMftRecord;	// negative: 2^-n bytes
+	BYTE	reserved2[445];
+	UINT16	signature;
+} NTFS_BOOT_SECTOR;
+
+typedef struct _FAT_BOOT_SECTOR
+{
+	BYTE	jump[3];
+	CHAR	oemId[8];
+	UINT16	bytesPerSector;
+	BYTE	sectorsPerCluster;
+	UINT16	reservedSectors;
+	BYTE	fatCount;
+	UINT16	rootEntries;		// 0 on FAT32
+	UINT16	totalSectors16;
+	BYTE	media;
+	UINT16	fatSize16;			// 0 on FAT32
+	UINT16	sectorsPerTrack;
+	UINT16	heads;
+	UINT32	hiddenSectors;
+	UINT32	totalSectors32;
+	UINT32	fatSize32;
+	BYTE	reserved[14];
+	CHAR	fsType16[8];		// "FAT12   ", "FAT16   " or "FAT     "
+	BYTE	reserved2[20];
+	CHAR	fsType32[8];		// "FAT32   "
+	BYTE	reserved3[420];
+	UINT16	signature;
+} FAT_BOOT_SECTOR;
+
+typedef struct _EXT_SUPERBLOCK
+{
+	UINT32	inodesCount;
+	UINT32	blocksCountLo;
+	UINT32	reservedBlocksCountLo;
+	UINT32	freeBlocksCountLo;
+	UINT32	freeInodesCount;
+	UINT32	firstDataBlock;
+	UINT32	logBlockSize;		// block size is 1024 << n
+	UINT32	logClusterSize;
+	UINT32	blocksPerGroup;
+	UINT32	clustersPerGroup;
+	UINT32	inodesPerGroup;
+	BYTE	reserved[12];
+	UINT16	magic;				// 0xEF53
+	BYTE	reserved2[18];
+	UINT32	revLevel;
+	BYTE	reserved3[8];
+	UINT16	inodeSize;
+	UINT16	blockGroupNr;
+	UINT32	featureCompat;
+	UINT32	featureIncompat;
+	UINT32	featureRoCompat;
+	BYTE	reserved4[102];
+	UINT16	reservedGdtBlocks;
+	BYTE	reserved5[46];
+	UINT16	descSize;			// 64bit feature only
+	BYTE	reserved6[80];
+	UINT32	blocksCountHi;
+	BYTE	reserved7[248];
+	UINT32	backupBgs[2];		// sparse_super2
+	BYTE	reserved8[428];
+} EXT_SUPERBLOCK;
+
+typedef struct _EXT_GROUP_DESC
+{
+	UINT32	blockBitmapLo;
+	UINT32	inodeBitmapLo;
+	UINT32	inodeTableLo;
+	UINT16	freeBlocksCountLo;
+	UINT16	freeInodesCountLo;
+	UINT16	usedDirsCountLo;
+	UINT16	flags;				// EXT_BG_*
+	BYTE	reserved[12];
+	UINT32	blockBitmapHi;		// 64bit feature only, from here on
+	UINT32	inodeBitmapHi;
+	UINT32	inodeTableHi;
+	BYTE	reserved2[20];
+} EXT_GROUP_DESC;
+
+#pragma pack(pop)
+
+#define EXT_COMPAT_SPARSE_SUPER2	0x0200
+#define EXT_INCOMPAT_META_BG		0x0010
+#define EXT_INCOMPAT_64BIT			0x0080
+#define EXT_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT_RO_COMPAT_GDT_CSUM		0x0010
+#define EXT_RO_COMPAT_BIGALLOC		0x0200
+#define EXT_RO_COMPAT_METADATA_CSUM	0x0400
+
+#define EXT_BG_BLOCK_UNINIT			0x0002
+
+// [nOffset, nOffset + nBytes) of the disk is free
+typedef struct _FREE_RUN
+{
+	UINT64	nOffset;
+	UINT64	nBytes;
+} FREE_RUN;
+
+class CFreeSpaceMap
+{
+	CBlockDevice*	m_pDisk;
+	UINT64		m_nDiskSize;
+
+	FREE_RUN*	m_pRuns;		// sorted, merged once Build is done
+	UINT32		m_nRuns;
+	UINT32		m_nAlloc;
+	UINT64		m_nFreeBytes;
+	UINT32		m_nFileSystems;
+
+	// partition being scanned, free runs are clipped to it
+	UINT64		m_nPartStart;
+	UINT64		m_nPartEnd;
+	UINT32		m_nMark;		// its first run, dropped again if the scan fails
+
+	BYTE*		m_pBounce;		// aligned reads, the disk may be unbuffered
+	DWORD		m_nBounce;
+
+public:
+	CFreeSpaceMap(void);
+	~CFreeSpaceMap(void);
+
+	BOOL Build(CBlockDevice* pDisk, UINT64 nDiskSize);
+	void Clear();
+
+	// Whole range free
+	BOOL IsFree(UINT64 nOffset, UINT64 nBytes) const;
+
+	// Zeroes the free parts of [nOffset, nOffset + nBytes) held at pBuff
+	void ZeroFree(UINT64 nOffset, BYTE* pBuff, DWORD nBytes) const;
+
+	UINT64 GetFreeBytes() const { return m_nFreeBytes; }
+	UINT32 GetFileSystems() const { return m_nFileSystems; }
+
+protected:
+	BOOL Read(UINT64 nOffset, void* pBuff, DWORD nBytes);
+
+	void AddFree(UINT64 nOffset, UINT64 nBytes);
+	void AddFreeBits(const BYTE* pBits, UINT64 nBits, UINT64 nBase, UINT64 nUnit);
+	UINT32 FindRun(UINT64 nOffset) const;
+
+	BOOL ScanMbr(const MBR_SECTOR* pMbr);
+	BOOL ScanGpt();
+	BOOL ScanPartition(UINT64 nOffset, UINT64 nBytes);
+
+	BOOL ScanNtfs(UINT64 nOffset);
+	BOOL ScanFat(UINT64 nOffset);
+	BOOL ScanExt(UINT64 nOffset);
+
+private:
+	CFreeSpaceMap(const CFreeSpaceMap&);
+	CFreeSpaceMap& operator=(const CFreeSpaceMap&);
+};
@@ -0,0 +1,942 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "IoQueue.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#if defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_SINGLE_MMAP)
+#define IOQ_HAVE_URING
+#endif
+#ifndef IORING_FEAT_NODROP
+#define IORING_FEAT_NODROP	(1U << 1)
+#endif
+#endif
+
+static DWORD g_dwIoBackend = IOQ_BACKEND_AUTO;
+
+// Runs pReq to completion on the calling thread
+static void RunRequest(IO_REQUEST* pReq)
+{
+	CBlockDevice* pDevice = pReq->pDevice;
+
+	pReq->nDone = 0;
+
+	switch(pReq->dwOp)
+	{
+	case IOQ_READ:
+		if(pReq->nSegments)
+			pReq->bSuccess = pDevice->ReadV(pReq->nOffset, pReq->pSegments, pReq->nSegments, &pReq->nDone);
+		else
+			pReq->bSuccess = pDevice->ReadAt(pReq->nOffset, pReq->pBuff, pReq->nBytes, &pReq->nDone);
+		break;
+
+	case IOQ_WRITE:
+		if(pReq->nSegments)
+			pReq->bSuccess = pDevice->WriteV(pReq->nOffset, pReq->pSegments, pReq->nSegments, &pReq->nDone);
+		else
+			pReq->bSuccess = pDevice->WriteAt(pReq->nOffset, pReq->pBuff, pReq->nBytes, &pReq->nDone);
+		break;
+
+	case IOQ_FLUSH:
+		pReq->bSuccess = pDevice->Flush();
+		break;
+
+	case IOQ_DISCARD:
+		pReq->bSuccess = pDevice->Discard(pReq->nOffset, pReq->nBytes);
+		if(pReq->bSuccess) pReq->nDone = pReq->nBytes;
+		break;
+
+	default:
+		pReq->bSuccess = FALSE;
+		break;
+	}
+
+	pReq->dwError = pReq->bSuccess ? 0 : pDevice->GetLastError();
+}
+
+// Every request done inside Submit, handed back in order
+class CSyncIoQueue : public CIoQueue
+{
+	IO_REQUEST*		m_pDoneHead;
+	IO_REQUEST*		m_pDoneTail;
+	UINT32			m_nInFlight;
+
+public:
+	CSyncIoQueue()
+	{
+		m_pDoneHead = m_pDoneTail = NULL;
+		m_nInFlight = 0;
+	}
+
+	BOOL Submit(IO_REQUEST* pReq)
+	{
+		RunRequest(pReq);
+
+		pReq->pNext = NULL;
+		if(m_pDoneTail)
+			m_pDoneTail->pNext = pReq;
+		else
+			m_pDoneHead = pReq;
+		m_pDoneTail = pReq;
+		m_nInFlight++;
+
+		return TRUE;
+	}
+
+	IO_REQUEST* WaitCompletion()
+	{
+		IO_REQUEST* pReq = m_pDoneHead;
+
+		if(pReq)
+		{
+			m_pDoneHead = pReq->pNext;
+			if(!m_pDoneHead) m_pDoneTail = NULL;
+			m_nInFlight--;
+		}
+
+		return pReq;
+	}
+
+	UINT32 GetInFlight() const
+	{
+		return m_nInFlight;
+	}
+};
+
+#ifdef _WIN32
+
+typedef struct _IO_PART
+{
+	OVERLAPPED		ov;
+	IO_REQUEST*		pReq;
+	DWORD			dwError;	// synchronous failure
+} IO_PART;
+
+// Overlapped I/O reaped from a completion port. Device handles are associated
+// with the port on their first request.
+class COverlappedIoQueue : public CIoQueue
+{
+	HANDLE		m_hPort;
+	HANDLE		m_hAssociated[32];	// target plus a whole differencing chain
+	UINT32		m_nAssociated;
+	UINT32		m_nInFlight;
+
+public:
+	COverlappedIoQueue()
+	{
+		m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		m_nAssociated = 0;
+		m_nInFlight = 0;
+	}
+
+	~COverlappedIoQueue()
+	{
+		while(m_nInFlight)
+			WaitCompletion();
+
+		if(m_hPort)
+			CloseHandle(m_hPort);
+	}
+
+	BOOL IsValid() const { return m_hPort != NULL; }
+
+	BOOL Submit(IO_REQUEST* pReq)
+	{
+		HANDLE hFile = pReq->pDevice->GetHandle();
+		UINT32 nParts = pReq->nSegments ? pReq->nSegments : 1;
+		IO_PART* pParts;
+		UINT64 nOffset = pReq->nOffset;
+
+		if(!Associate(hFile))
+			return FALSE;
+
+		pReq->bSuccess = FALSE;
+		pReq->nDone = 0;
+		pReq->dwError = 0;
+
+		pParts = new IO_PART[nParts];
+		ZeroMemory(pParts, nParts * sizeof(IO_PART));
+		pReq->pParts = pParts;
+		pReq->nPartsPending = nParts;
+
+		if(pReq->dwOp != IOQ_READ && pReq->dwOp != IOQ_WRITE)
+		{
+			// no overlapped form: run it here, complete it through the port
+			RunRequest(pReq);
+
+			DWORD dwDone = pReq->nDone;
+			pParts[0].pReq = pReq;
+			pParts[0].dwError = pReq->bSuccess ? 0 : (pReq->dwError ? pReq->dwError : ERROR_GEN_FAILURE);
+			pReq->nDone = 0;
+			pReq->dwError = 0;
+
+			PostQueuedCompletionStatus(m_hPort, dwDone, 0, &pParts[0].ov);
+			m_nInFlight++;
+
+			return TRUE;
+		}
+
+		for(UINT32 i = 0; i < nParts; i++)
+		{
+			void* pBuff = pReq->nSegments ? pReq->pSegments[i].pBuff : pReq->pBuff;
+			DWORD nBytes = pReq->nSegments ? pReq->pSegments[i].nBytes : pReq->nBytes;
+			BOOL bIssued;
+
+			pParts[i].pReq = pReq;
+			pParts[i].ov.Offset = (DWORD)nOffset;
+			pParts[i].ov.OffsetHigh = (DWORD)(nOffset >> 32);
+			nOffset += nBytes;
+
+			if(pReq->dwOp == IOQ_READ)
+				bIssued = ReadFile(hFile, pBuff, nBytes, NULL, &pParts[i].ov);
+			else
+				bIssued = WriteFile(hFile, pBuff, nBytes, NULL, &pParts[i].ov);
+
+			if(!bIssued && GetLastError() != ERROR_IO_PENDING)
+			{
+				// failed synchronously, no completion packet will be queued
+				pParts[i].dwError = GetLastError();
+				PostQueuedCompletionStatus(m_hPort, 0, 0, &pParts[i].ov);
+			}
+		}
+
+		m_nInFlight++;
+
+		return TRUE;
+	}
+
+	IO_REQUEST* WaitCompletion()
+	{
+		if(!m_nInFlight)
+			return NULL;
+
+		// a request completes with the last of its parts
+		for(;;)
+		{
+			DWORD dwBytes = 0;
+			ULONG_PTR key = 0;
+			LPOVERLAPPED pOv = NULL;
+
+			BOOL bOk = GetQueuedCompletionStatus(m_hPort, &dwBytes, &key, &pOv, INFINITE);
+			if(!pOv)
+				return NULL;
+
+			IO_PART* pPart = CONTAINING_RECORD(pOv, IO_PART, ov);
+			IO_REQUEST* pReq = pPart->pReq;
+			DWORD dwError = pPart->dwError;
+
+			if(!bOk && !dwError)
+				dwError = GetLastError();
+			if(dwError == ERROR_HANDLE_EOF)
+				dwError = 0;
+
+			// past EOF the trailing parts read nothing, so the sum is the valid prefix
+			pReq->nDone += dwBytes;
+			if(dwError && !pReq->dwError)
+				pReq->dwError = dwError;
+
+			if(--pReq->nPartsPending)
+				continue;
+
+			delete[] (IO_PART*)pReq->pParts;
+			pReq->pParts = NULL;
+
+			m_nInFlight--;
+			pReq->bSuccess = (pReq->dwError == 0);
+
+			return pReq;
+		}
+	}
+
+	UINT32 GetInFlight() const
+	{
+		return m_nInFlight;
+	}
+
+private:
+	BOOL Associate(HANDLE hFile)
+	{
+		for(UINT32 i = 0; i < m_nAssociated; i++)
+			if(m_hAssociated[i] == hFile) return TRUE;
+
+		// Submit fails then: a request on a handle the port doesn't know
+		// would never complete
+		if(m_nAssociated == sizeof(m_hAssociated) / sizeof(m_hAssociated[0]))
+		{
+			TRACE("Too many files on one completion port (%u)\n", m_nAssociated);
+			return FALSE;
+		}
+
+		if(!CreateIoCompletionPort(hFile, m_hPort, 0, 0))
+		{
+			TRACE("CreateIoCompletionPort failed with error 0x%08X\n", GetLastError());
+			return FALSE;
+		}
+
+		m_hAssociated[m_nAssociated++] = hFile;
+
+		return TRUE;
+	}
+};
+
+static CIoQueue* CreateQueue(DWORD dwBackend, UINT32 nDepth)
+{
+	if(dwBackend == IOQ_BACKEND_SYNC)
+		return new CSyncIoQueue();
+
+	if(dwBackend != IOQ_BACKEND_AUTO && dwBackend != IOQ_BACKEND_OVERLAPPED)
+		return NULL;
+
+	COverlappedIoQueue* pQueue = new COverlappedIoQueue();
+
+	if(!pQueue->IsValid())
+	{
+		delete pQueue;
+		return NULL;
+	}
+
+	return pQueue;
+}
+
+#else // !_WIN32
+
+// nDepth worker threads each running one blocking pread/preadv/pwrite at a time
+class CThreadPoolIoQueue : public CIoQueue
+{
+	pthread_mutex_t	m_lock;
+	pthread_cond_t	m_cvPending;
+	pthread_cond_t	m_cvDone;
+
+	IO_REQUEST*		m_pPendingHead;
+	IO_REQUEST*		m_pPendingTail;
+	IO_REQUEST*		m_pDoneHead;
+	IO_REQUEST*		m_pDoneTail;
+
+	pthread_t*		m_pThreads;
+	UINT32			m_nThreads;
+	UINT32			m_nInFlight;
+	BOOL			m_bStop;
+
+public:
+	CThreadPoolIoQueue()
+	{
+		pthread_mutex_init(&m_lock, NULL);
+		pthread_cond_init(&m_cvPending, NULL);
+		pthread_cond_init(&m_cvDone, NULL);
+
+		m_pPendingHead = m_pPendingTail = NULL;
+		m_pDoneHead = m_pDoneTail = NULL;
+		m_pThreads = NULL;
+		m_nThreads = 0;
+		m_nInFlight = 0;
+		m_bStop = FALSE;
+	}
+
+	~CThreadPoolIoQueue()
+	{
+		while(GetInFlight())
+			WaitCompletion();
+
+		pthread_mutex_lock(&m_lock);
+		m_bStop = TRUE;
+		pthread_cond_broadcast(&m_cvPending);
+		pthread_mutex_unlock(&m_lock);
+
+		for(UINT32 i = 0; i < m_nThreads; i++)
+			pthread_join(m_pThreads[i], NULL);
+
+		delete[] m_pThreads;
+
+		pthread_cond_destroy(&m_cvDone);
+		pthread_cond_destroy(&m_cvPending);
+		pthread_mutex_destroy(&m_lock);
+	}
+
+	BOOL Start(UINT32 nThreads)
+	{
+		m_pThreads = new pthread_t[nThreads];
+
+		for(; m_nThreads < nThreads; m_nThreads++)
+		{
+			if(pthread_create(&m_pThreads[m_nThreads], NULL, WorkerProc, this) != 0)
+				break;
+		}
+
+		return m_nThreads > 0;
+	}
+
+	BOOL Submit(IO_REQUEST* pReq)
+	{
+		pReq->bSuccess = FALSE;
+		pReq->nDone = 0;
+		pReq->dwError = 0;
+		pReq->pNext = NULL;
+
+		pthread_mutex_lock(&m_lock);
+
+		if(m_pPendingTail)
+			m_pPendingTail->pNext = pReq;
+		else
+			m_pPendingHead = pReq;
+		m_pPendingTail = pReq;
+		m_nInFlight++;
+
+		pthread_cond_signal(&m_cvPending);
+		pthread_mutex_unlock(&m_lock);
+
+		return TRUE;
+	}
+
+	IO_REQUEST* WaitCompletion()
+	{
+		IO_REQUEST* pReq = NULL;
+
+		pthread_mutex_lock(&m_lock);
+
+		while(m_nInFlight && !m_pDoneHead)
+			pthread_cond_wait(&m_cvDone, &m_lock);
+
+		if(m_pDoneHead)
+		{
+			pReq = m_pDoneHead;
+			m_pDoneHead = pReq->pNext;
+			if(!m_pDoneHead) m_pDoneTail = NULL;
+			m_nInFlight--;
+		}
+
+		pthread_mutex_unlock(&m_lock);
+
+		return pReq;
+	}
+
+	UINT32 GetInFlight() const
+	{
+		pthread_mutex_lock(const_cast<pthread_mutex_t*>(&m_lock));
+		UINT32 n = m_nInFlight;
+		pthread_mutex_unlock(const_cast<pthread_mutex_t*>(&m_lock));
+		return n;
+	}
+
+private:
+	static void* WorkerProc(void* pParam)
+	{
+		((CThreadPoolIoQueue*)pParam)->Worker();
+		return NULL;
+	}
+
+	void Worker()
+	{
+		for(;;)
+		{
+			pthread_mutex_lock(&m_lock);
+
+			while(!m_bStop && !m_pPendingHead)
+				pthread_cond_wait(&m_cvPending, &m_lock);
+
+			if(!m_pPendingHead)
+			{
+				pthread_mutex_unlock(&m_lock);
+				return;
+			}
+
+			IO_REQUEST* pReq = m_pPendingHead;
+			m_pPendingHead = pReq->pNext;
+			if(!m_pPendingHead) m_pPendingTail = NULL;
+
+			pthread_mutex_unlock(&m_lock);
+
+			RunRequest(pReq);
+
+			pReq->pNext = NULL;
+
+			pthread_mutex_lock(&m_lock);
+
+			if(m_pDoneTail)
+				m_pDoneTail->pNext = pReq;
+			else
+				m_pDoneHead = pReq;
+			m_pDoneTail = pReq;
+
+			pthread_cond_signal(&m_cvDone);
+			pthread_mutex_unlock(&m_lock);
+		}
+	}
+};
+
+#ifdef IOQ_HAVE_URING
+
+static int UringSetup(UINT32 nEntries, struct io_uring_params* pParams)
+{
+	return (int)syscall(__NR_io_uring_setup, nEntries, pParams);
+}
+
+static int UringEnter(int fd, UINT32 nSubmit, UINT32 nWait, UINT32 nFlags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, nSubmit, nWait, nFlags, NULL, 0);
+}
+
+static int UringRegister(int fd, UINT32 nOpcode, const void* pArg, UINT32 nArgs)
+{
+	return (int)syscall(__NR_io_uring_register, fd, nOpcode, pArg, nArgs);
+}
+
+// io_uring driven from the thread that owns the queue, one io_uring_enter per
+// submission. Short transfers are resubmitted for the rest, as pread/pwrite
+// loops do. Files are not registered: devices get reopened under a live
+// queue (capture switching to buffered I/O for an unaligned tail), and a
+// registered slot would keep using the old descriptor.
+class CUringIoQueue : public CIoQueue
+{
+	int				m_fd;
+	BYTE*			m_pSqRing;
+	size_t			m_nSqRingBytes;
+	BYTE*			m_pCqRing;		// m_pSqRing with IORING_FEAT_SINGLE_MMAP
+	size_t			m_nCqRingBytes;
+	struct io_uring_sqe* m_pSqes;
+	size_t			m_nSqeBytes;
+
+	unsigned*		m_pSqTail;
+	unsigned		m_nSqMask;
+	unsigned*		m_pSqArray;
+	unsigned*		m_pCqHead;
+	unsigned*		m_pCqTail;
+	unsigned		m_nCqMask;
+	struct io_uring_cqe* m_pCqes;
+
+	IO_SEGMENT*		m_pFixed;		// registered buffers, by index
+	UINT32			m_nFixed;
+
+	IO_REQUEST*		m_pReadyHead;	// run inline, not seen by the kernel
+	IO_REQUEST*		m_pReadyTail;
+	UINT32			m_nInFlight;
+	BOOL			m_bDropping;	// the kernel may drop completions, Init refused the ring
+
+public:
+	CUringIoQueue()
+	{
+		m_fd = -1;
+		m_bDropping = FALSE;
+		m_pSqRing = m_pCqRing = NULL;
+		m_nSqRingBytes = m_nCqRingBytes = 0;
+		m_pSqes = NULL;
+		m_nSqeBytes = 0;
+		m_pFixed = NULL;
+		m_nFixed = 0;
+		m_pReadyHead = m_pReadyTail = NULL;
+		m_nInFlight = 0;
+	}
+
+	~CUringIoQueue()
+	{
+		while(m_nInFlight && WaitCompletion())
+			;
+
+		if(m_pSqes)
+			munmap(m_pSqes, m_nSqeBytes);
+		if(m_pCqRing && m_pCqRing != m_pSqRing)
+			munmap(m_pCqRing, m_nCqRingBytes);
+		if(m_pSqRing)
+			munmap(m_pSqRing, m_nSqRingBytes);
+		if(m_fd >= 0)
+			close(m_fd);
+
+		delete[] m_pFixed;
+	}
+
+	BOOL IsDropping() const { return m_bDropping; }
+
+	BOOL Init(UINT32 nDepth)
+	{
+		struct io_uring_params params;
+		UINT32 nEntries = 64;
+
+		// requests in flight can outnumber nDepth (a read and its writes)
+		while(nEntries < nDepth * 4 && nEntries < 4096)
+			nEntries *= 2;
+
+		ZeroMemory(&params, sizeof(params));
+		m_fd = UringSetup(nEntries, &params);
+		if(m_fd < 0)
+		{
+			TRACE("io_uring_setup failed with error %d\n", errno);
+			return FALSE;
+		}
+
+		// before NODROP (5.5) a full completion ring loses completions, and a
+		// request whose completion is lost is waited for forever
+		if(!(params.features & IORING_FEAT_NODROP))
+		{
+			TRACE("io_uring may drop completions here\n");
+			m_bDropping = TRUE;
+			return FALSE;
+		}
+
+		m_nSqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		m_nCqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+		if(params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			if(m_nCqRingBytes > m_nSqRingBytes)
+				m_nSqRingBytes = m_nCqRingBytes;
+			m_nCqRingBytes = m_nSqRingBytes;
+		}
+
+		m_pSqRing = (BYTE*)mmap(NULL, m_nSqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		if(m_pSqRing == MAP_FAILED)
+		{
+			m_pSqRing = NULL;
+			return FALSE;
+		}
+
+		if(params.features & IORING_FEAT_SINGLE_MMAP)
+			m_pCqRing = m_pSqRing;
+		else
+		{
+			m_pCqRing = (BYTE*)mmap(NULL, m_nCqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+			if(m_pCqRing == MAP_FAILED)
+			{
+				m_pCqRing = NULL;
+				return FALSE;
+			}
+		}
+
+		m_nSqeBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+		m_pSqes = (struct io_uring_sqe*)mmap(NULL, m_nSqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+		if(m_pSqes == MAP_FAILED)
+		{
+			m_pSqes = NULL;
+			return FALSE;
+		}
+
+		m_pSqTail = (unsigned*)(m_pSqRing + params.sq_off.tail);
+		m_nSqMask = *(unsigned*)(m_pSqRing + params.sq_off.ring_mask);
+		m_pSqArray = (unsigned*)(m_pSqRing + params.sq_off.array);
+		m_pCqHead = (unsigned*)(m_pCqRing + params.cq_off.head);
+		m_pCqTail = (unsigned*)(m_pCqRing + params.cq_off.tail);
+		m_nCqMask = *(unsigned*)(m_pCqRing + params.cq_off.ring_mask);
+		m_pCqes = (struct io_uring_cqe*)(m_pCqRing + params.cq_off.cqes);
+
+		return TRUE;
+	}
+
+	BOOL RegisterBuffers(const IO_SEGMENT* pBuffers, UINT32 nBuffers)
+	{
+		struct iovec* pIov = new struct iovec[nBuffers];
+
+		for(UINT32 i = 0; i < nBuffers; i++)
+		{
+			pIov[i].iov_base = pBuffers[i].pBuff;
+			pIov[i].iov_len = pBuffers[i].nBytes;
+		}
+
+		// one set per ring; pinning can fail on a low RLIMIT_MEMLOCK
+		BOOL bReturn = !m_pFixed && UringRegister(m_fd, IORING_REGISTER_BUFFERS, pIov, nBuffers) == 0;
+		delete[] pIov;
+
+		if(!bReturn)
+			return FALSE;
+
+		m_pFixed = new IO_SEGMENT[nBuffers];
+		memcpy(m_pFixed, pBuffers, nBuffers * sizeof(IO_SEGMENT));
+		m_nFixed = nBuffers;
+
+		return TRUE;
+	}
+
+	BOOL Submit(IO_REQUEST* pReq)
+	{
+		pReq->bSuccess = FALSE;
+		pReq->nDone = 0;
+		pReq->dwError = 0;
+		pReq->pParts = NULL;
+
+		if(pReq->dwOp == IOQ_DISCARD || (pReq->pDevice->GetFlags() & BDEV_STREAM))
+		{
+			// no ring opcode for a block device discard, streams keep their own position
+			RunRequest(pReq);
+
+			pReq->pNext = NULL;
+			if(m_pReadyTail)
+				m_pReadyTail->pNext = pReq;
+			else
+				m_pReadyHead = pReq;
+			m_pReadyTail = pReq;
+			m_nInFlight++;
+
+			return TRUE;
+		}
+
+		if(pReq->dwOp != IOQ_FLUSH)
+			pReq->pParts = new struct iovec[pReq->nSegments ? pReq->nSegments : 1];
+
+		if(!Queue(pReq))
+		{
+			delete[] (struct iovec*)pReq->pParts;
+			pReq->pParts = NULL;
+			return FALSE;
+		}
+
+		m_nInFlight++;
+
+		return TRUE;
+	}
+
+	IO_REQUEST* WaitCompletion()
+	{
+		while(m_nInFlight)
+		{
+			IO_REQUEST* pReq = m_pReadyHead;
+
+			if(pReq)
+			{
+				m_pReadyHead = pReq->pNext;
+				if(!m_pReadyHead) m_pReadyTail = NULL;
+				m_nInFlight--;
+				return pReq;
+			}
+
+			unsigned nHead = *m_pCqHead;
+
+			if(nHead == __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE))
+			{
+				if(UringEnter(m_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				{
+					TRACE("io_uring_enter failed with error %d\n", errno);
+					return NULL;
+				}
+				continue;
+			}
+
+			struct io_uring_cqe* pCqe = &m_pCqes[nHead & m_nCqMask];
+			int nResult = pCqe->res;
+
+			pReq = (IO_REQUEST*)(uintptr_t)pCqe->user_data;
+			__atomic_store_n(m_pCqHead, nHead + 1, __ATOMIC_RELEASE);
+
+			if(nResult == -EINTR || nResult == -EAGAIN)
+				nResult = 0;
+			else if(nResult < 0)
+				pReq->dwError = (DWORD)-nResult;
+			else if(nResult == 0 && pReq->dwOp == IOQ_WRITE)
+				pReq->dwError = ENOSPC;
+			else if(nResult == 0 && pReq->dwOp == IOQ_READ)
+				nResult = -1;	// end of file, the valid prefix is nDone
+
+			if(nResult >= 0 && pReq->dwOp != IOQ_FLUSH && !pReq->dwError)
+			{
+				pReq->nDone += (DWORD)nResult;
+
+				// short transfer: go on with the rest
+				if(pReq->nDone < pReq->nBytes)
+				{
+					if(Queue(pReq))
+						continue;
+
+					pReq->dwError = EIO;
+				}
+			}
+
+			delete[] (struct iovec*)pReq->pParts;
+			pReq->pParts = NULL;
+
+			pReq->bSuccess = (pReq->dwError == 0);
+			m_nInFlight--;
+
+			return pReq;
+		}
+
+		return NULL;
+	}
+
+	UINT32 GetInFlight() const
+	{
+		return m_nInFlight;
+	}
+
+private:
+	// Fixed buffer index holding nBytes at pBuff, -1 if none
+	int FindFixed(const void* pBuff, DWORD nBytes) const
+	{
+		for(UINT32 i = 0; i < m_nFixed; i++)
+		{
+			const BYTE* pStart = (const BYTE*)m_pFixed[i].pBuff;
+
+			if((const BYTE*)pBuff >= pStart && (const BYTE*)pBuff + nBytes <= pStart + m_pFixed[i].nBytes)
+				return (int)i;
+		}
+
+		return -1;
+	}
+
+	// Puts what is left of pReq (past nDone) on the ring and submits it
+	BOOL Queue(IO_REQUEST* pReq)
+	{
+		unsigned nTail = *m_pSqTail;
+		unsigned nIndex = nTail & m_nSqMask;
+		struct io_uring_sqe* pSqe = &m_pSqes[nIndex];
+
+		ZeroMemory(pSqe, sizeof(*pSqe));
+		pSqe->fd = pReq->pDevice->GetFd();
+		pSqe->off = pReq->nOffset + pReq->nDone;
+		pSqe->user_data = (UINT64)(uintptr_t)pReq;
+
+		if(pReq->dwOp == IOQ_FLUSH)
+			pSqe->opcode = IORING_OP_FSYNC;
+		else if(pReq->nSegments)
+		{
+			// the segments still to fill, the first one possibly started
+			struct iovec* pIov = (struct iovec*)pReq->pParts;
+			DWORD nSkip = pReq->nDone;
+			UINT32 nIov = 0;
+
+			for(UINT32 i = 0; i < pReq->nSegments; i++)
+			{
+				if(nSkip >= pReq->pSegments[i].nBytes)
+				{
+					nSkip -= pReq->pSegments[i].nBytes;
+					continue;
+				}
+
+				pIov[nIov].iov_base = (BYTE*)pReq->pSegments[i].pBuff + nSkip;
+				pIov[nIov].iov_len = pReq->pSegments[i].nBytes - nSkip;
+				nIov++;
+				nSkip = 0;
+			}
+
+			pSqe->opcode = pReq->dwOp == IOQ_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+			pSqe->addr = (UINT64)(uintptr_t)pIov;
+			pSqe->len = nIov;
+		}
+		else
+		{
+			BYTE* pBuff = (BYTE*)pReq->pBuff + pReq->nDone;
+			DWORD nBytes = pReq->nBytes - pReq->nDone;
+			int nFixed = FindFixed(pBuff, nBytes);
+
+			if(nFixed >= 0)
+			{
+				pSqe->opcode = pReq->dwOp == IOQ_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+				pSqe->addr = (UINT64)(uintptr_t)pBuff;
+				pSqe->len = nBytes;
+				pSqe->buf_index = (UINT16)nFixed;
+			}
+			else
+			{
+				struct iovec* pIov = (struct iovec*)pReq->pParts;
+
+				pIov->iov_base = pBuff;
+				pIov->iov_len = nBytes;
+
+				pSqe->opcode = pReq->dwOp == IOQ_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+				pSqe->addr = (UINT64)(uintptr_t)pIov;
+				pSqe->len = 1;
+			}
+		}
+
+		m_pSqArray[nIndex] = nIndex;
+		__atomic_store_n(m_pSqTail, nTail + 1, __ATOMIC_RELEASE);
+
+		for(;;)
+		{
+			int nSubmitted = UringEnter(m_fd, 1, 0, 0);
+
+			if(nSubmitted == 1)
+				return TRUE;
+			if(nSubmitted < 0 && errno == EINTR)
+				continue;
+
+			TRACE("io_uring_enter failed with error %d\n", nSubmitted < 0 ? errno : 0);
+			break;
+		}
+
+		// not consumed, take it back
+		__atomic_store_n(m_pSqTail, nTail, __ATOMIC_RELEASE);
+
+		return FALSE;
+	}
+};
+
+#endif // IOQ_HAVE_URING
+
+static CIoQueue* CreateQueue(DWORD dwBackend, UINT32 nDepth)
+{
+	if(dwBackend == IOQ_BACKEND_SYNC)
+		return new CSyncIoQueue();
+
+#ifdef IOQ_HAVE_URING
+	if(dwBackend == IOQ_BACKEND_URING)
+	{
+		CUringIoQueue* pRing = new CUringIoQueue();
+
+		if(pRing->Init(nDepth))
+			return pRing;
+
+		BOOL bDropping = pRing->IsDropping();
+		delete pRing;
+
+		if(!bDropping)
+			return NULL;
+
+		// a ring that loses completions is no use, the thread pool does the same job
+		TRACE("Falling back to the thread pool\n");
+		dwBackend = IOQ_BACKEND_THREADS;
+	}
+#endif
+
+	if(dwBackend != IOQ_BACKEND_AUTO && dwBackend != IOQ_BACKEND_THREADS)
+		return NULL;
+
+	CThreadPoolIoQueue* pQueue = new CThreadPoolIoQueue();
+
+	if(!pQueue->Start(nDepth ? nDepth : 1))
+	{
+		delete pQueue;
+		return NULL;
+	}
+
+	return pQueue;
+}
+
+#endif // _WIN32
+
+CIoQueue* CIoQueue::Create(UINT32 nDepth)
+{
+	return CreateQueue(g_dwIoBackend, nDepth);
+}
+
+DWORD GetIoBackend()
+{
+	return g_dwIoBackend;
+}
+
+BOOL SetIoBackend(DWORD dwBackend)
+{
+	if(dwBackend >= IOQ_BACKENDS)
+		return FALSE;
+
+	// try it once rather than fail the first transfer
+	CIoQueue* pQueue = CreateQueue(dwBackend, 1);
+	if(!pQueue)
+		return FALSE;
+
+	delete pQueue;
+	g_dwIoBackend = dwBackend;
+
+	return TRUE;
+}
+
+const char* GetIoBackendName(DWORD dwBackend)
+{
+	static const char* s_pNames[IOQ_BACKENDS] = { "auto", "sync", "threads", "uring", "overlapped" };
+
+	return dwBackend < IOQ_BACKENDS ? s_pNames[dwBackend] : "?";
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "BlockDevice.h"
+
+// Asynchronous block I/O: requests are submitted without waiting and reaped
+// one at a time in completion order, so several reads and writes can be kept
+// in flight against the source and the target at once.
+//
+// Backends, picked at runtime with SetIoBackend:
+// Win32: overlapped ReadFile/WriteFile completed through an I/O completion port,
+//        devices must be opened with BDEV_OVERLAPPED, a scattered read (or
+//        gathered write) is issued as one overlapped transfer per segment
+// POSIX: pool of worker threads issuing pread/preadv/pwrite/pwritev
+// Linux: io_uring, scattered reads and gathered writes as one readv/writev,
+//        writes from buffers passed to RegisterBuffers as fixed-buffer writes
+//        (the thread pool instead on kernels that may drop completions)
+// All:   synchronous, each request run inside Submit (a baseline to compare with)
+//
+// Flushes, discards and anything on a BDEV_STREAM device run inline where the
+// backend has no asynchronous form of them.
+
+#define IOQ_READ		1
+#define IOQ_WRITE		2
+#define IOQ_FLUSH		3	// nOffset, pBuff and nBytes unused
+#define IOQ_DISCARD		4	// nBytes at nOffset, pBuff unused
+
+#define IOQ_BACKEND_AUTO		0	// overlapped on Win32, threads elsewhere
+#define IOQ_BACKEND_SYNC		1
+#define IOQ_BACKEND_THREADS		2	// POSIX only
+#define IOQ_BACKEND_URING		3	// Linux only, when the kernel allows it
+#define IOQ_BACKEND_OVERLAPPED	4	// Win32 only
+#define IOQ_BACKENDS			5
+
+typedef struct _IO_REQUEST
+{
+	DWORD			dwOp;		// IOQ_*
+	CBlockDevice*	pDevice;
+	UINT64			nOffset;
+	void*			pBuff;
+	DWORD			nBytes;		// total, also when scattered
+
+	// IOQ_READ/IOQ_WRITE: scatter the range into (or gather it from) these
+	// buffers instead of pBuff
+	IO_SEGMENT*		pSegments;
+	UINT32			nSegments;
+
+	// filled on completion
+	BOOL			bSuccess;
+	DWORD			nDone;
+	DWORD			dwError;
+
+	void*			pContext;	// owner cookie, untouched by the queue
+
+	// backend private
+	struct _IO_REQUEST* pNext;
+	void*			pParts;		// one OVERLAPPED (Win32) or iovec (io_uring) per segment
+#ifdef _WIN32
+	UINT32			nPartsPending;
+#endif
+} IO_REQUEST;
+
+class CIoQueue
+{
+public:
+	virtual ~CIoQueue() {}
+
+	// Queue pReq, which must stay valid until WaitCompletion hands it back
+	virtual BOOL Submit(IO_REQUEST* pReq) = 0;
+
+	// Block until a request completes, NULL when nothing is in flight
+	virtual IO_REQUEST* WaitCompletion() = 0;
+
+	virtual UINT32 GetInFlight() const = 0;
+
+	// Hint that requests will mostly use these buffers, which the backend may
+	// pin once instead of per request. FALSE if it didn't, which is harmless.
+	virtual BOOL RegisterBuffers(const IO_SEGMENT* pBuffers, UINT32 nBuffers) { return FALSE; }
+
+	// Queue of the backend set with SetIoBackend, nDepth requests in flight
+	static CIoQueue* Create(UINT32 nDepth);
+};
+
+// Backend in use, IOQ_BACKEND_AUTO unless set
+DWORD GetIoBackend();
+
+// FALSE if the backend isn't available here (platform, kernel, sandbox)
+BOOL SetIoBackend(DWORD dwBackend);
+const char* GetIoBackendName(DWORD dwBackend);
@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "MappedFile.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+CMappedFile::CMappedFile(void)
+{
+	m_pView = NULL;
+	m_nSize = 0;
+#ifdef _WIN32
+	m_hMapping = NULL;
+#endif
+}
+
+CMappedFile::~CMappedFile(void)
+{
+	Close();
+}
+
+const BYTE* CMappedFile::GetView(UINT64 nOffset, UINT64 nBytes) const
+{
+	if(!m_pView || nOffset > m_nSize || nBytes > m_nSize - nOffset)
+		return NULL;
+
+	return m_pView + nOffset;
+}
+
+#ifdef _WIN32
+
+BOOL CMappedFile::Open(CBlockDevice* pFile, BOOL bSequential)
+{
+	LARGE_INTEGER size;
+
+	Close();
+
+	if((pFile->GetFlags() & BDEV_STREAM) || GetFileType(pFile->GetHandle()) != FILE_TYPE_DISK)
+		return FALSE;
+
+	if(!GetFileSizeEx(pFile->GetHandle(), &size) || size.QuadPart <= 0
+		|| (UINT64)size.QuadPart > (UINT64)((size_t)-1 >> 1))
+		return FALSE;
+
+	// volumes and physical drives can't be mapped, this fails for them
+	m_hMapping = CreateFileMapping(pFile->GetHandle(), NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!m_hMapping)
+	{
+		TRACE("CreateFileMapping failed with error 0x%08X\n", GetLastError());
+		return FALSE;
+	}
+
+	m_pView = (const BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+	if(!m_pView)
+	{
+		TRACE("MapViewOfFile failed with error 0x%08X\n", GetLastError());
+		Close();
+		return FALSE;
+	}
+
+	m_nSize = size.QuadPart;
+
+	return TRUE;
+}
+
+void CMappedFile::Close()
+{
+	if(m_pView)
+		UnmapViewOfFile(m_pView);
+
+	if(m_hMapping)
+		CloseHandle(m_hMapping);
+
+	m_pView = NULL;
+	m_hMapping = NULL;
+	m_nSize = 0;
+}
+
+#else // !_WIN32
+
+BOOL CMappedFile::Open(CBlockDevice* pFile, BOOL bSequential)
+{
+	struct stat st;
+
+	Close();
+
+	if((pFile->GetFlags() & BDEV_STREAM) || fstat(pFile->GetFd(), &st) != 0 || !S_ISREG(st.st_mode))
+		return FALSE;
+
+	if(st.st_size <= 0 || (UINT64)st.st_size > (UINT64)((size_t)-1 >> 1))
+		return FALSE;
+
+	void* pView = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, pFile->GetFd(), 0);
+	if(pView == MAP_FAILED)
+	{
+		TRACE("mmap failed with error %d\n", errno);
+		return FALSE;
+	}
+
+	// read ahead harder and drop pages behind the reader
+	if(bSequential)
+		madvise(pView, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	m_pView = (const BYTE*)pView;
+	m_nSize = st.st_size;
+
+	return TRUE;
+}
+
+void CMappedFile::Close()
+{
+	if(m_pView)
+		munmap((void*)m_pView, (size_t)m_nSize);
+
+	m_pView = NULL;
+	m_nSize = 0;
+}
+
+#endif // _WIN32
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "BlockDevice.h"
+
+// Read-only view of a whole image file, so a restore can hand pages of the
+// file cache straight to the target writes instead of copying them into
+// buffers of its own first.
+// Win32: CreateFileMapping/MapViewOfFile, no access pattern hint
+// POSIX: mmap, madvise(MADV_SEQUENTIAL) for front to back readers
+//
+// Only regular files that fit the address space are mapped. The file must
+// not shrink while mapped: touching a page past its new end faults.
+
+class CMappedFile
+{
+	const BYTE*	m_pView;
+	UINT64		m_nSize;
+#ifdef _WIN32
+	HANDLE		m_hMapping;
+#endif
+
+public:
+	CMappedFile(void);
+	~CMappedFile(void);
+
+	// Maps what pFile has open, which must stay open while the view is used.
+	// FALSE for streams, devices and empty or oversized files.
+	BOOL Open(CBlockDevice* pFile, BOOL bSequential);
+	void Close();
+	BOOL IsOpen() const { return m_pView != NULL; }
+
+	UINT64 GetSize() const { return m_nSize; }
+
+	// nBytes of the file at nOffset, NULL unless all of them lie within it
+	const BYTE* GetView(UINT64 nOffset, UINT64 nBytes) const;
+
+private:
+	CMappedFile(const CMappedFile&);
+	CMappedFile& operator=(const CMappedFile&);
+};
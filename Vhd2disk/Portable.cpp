@@ -0,0 +1,37 @@
+#include "stdafx.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+UINT64 GetTickCountMs()
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+void* AllocAligned(size_t nSize, size_t nAlignment)
+{
+#ifdef _WIN32
+	return _aligned_malloc(nSize, nAlignment);
+#else
+	void* p = NULL;
+	if(posix_memalign(&p, nAlignment, nSize) != 0)
+		return NULL;
+	return p;
+#endif
+}
+
+void FreeAligned(void* p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
@@ -0,0 +1,65 @@
+// Portable.h : types and helpers shared by the conversion core on every platform.
+//
+// On Windows everything comes from <windows.h> (pulled in by stdafx.h); elsewhere
+// the handful of Win32 types and MSVC intrinsics used by the core are mapped onto
+// their POSIX/GCC equivalents so VhdToDisk.cpp and DiskToVhd.cpp compile unchanged.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#endif
+
+// Paths are UTF-16 on Windows
+typedef WCHAR PATHCHAR;
+typedef LPCWSTR LPCPATH;
+
+#else // !_WIN32
+
+#include <stdint.h>
+#include <wchar.h>
+
+typedef int BOOL;
+typedef char CHAR;
+typedef unsigned char UCHAR;
+typedef unsigned char BYTE;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int64_t INT64;
+typedef uint32_t DWORD;
+typedef wchar_t WCHAR;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define ZeroMemory(p, n) memset((p), 0, (n))
+
+inline UINT16 _byteswap_ushort(UINT16 v) { return __builtin_bswap16(v); }
+inline UINT32 _byteswap_ulong(UINT32 v) { return __builtin_bswap32(v); }
+inline UINT64 _byteswap_uint64(UINT64 v) { return __builtin_bswap64(v); }
+
+// Paths are plain bytes on POSIX
+typedef char PATHCHAR;
+typedef const char* LPCPATH;
+
+#endif // _WIN32
+
+// Monotonic millisecond counter used for progress throttling and ETA
+UINT64 GetTickCountMs();
+
+// Sector aligned allocations, required for unbuffered device I/O
+void* AllocAligned(size_t nSize, size_t nAlignment = 4096);
+void FreeAligned(void* p);
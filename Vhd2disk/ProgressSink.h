@@ -0,0 +1,17 @@
+#pragma once
+
+// Receives status and progress from the conversion engines.
+// The dialog forwards them to MainDlgProc, the CLI prints them on stderr.
+class CProgressSink
+{
+public:
+	virtual ~CProgressSink() {}
+
+	// bDone is TRUE on the last message of a failed run (re-enables the UI)
+	virtual void Status(const char* sText, BOOL bDone = FALSE) {}
+
+	virtual void Progress(UINT64 nDone, UINT64 nTotal) {}
+
+	// Errors the user must acknowledge
+	virtual void Error(const char* sText) { Status(sText, TRUE); }
+};
@@ -2,6 +2,8 @@
 #ifndef __TRACE_H__850CE873
 #define __TRACE_H__850CE873
 
+#ifdef _WIN32
+
 #include <crtdbg.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -34,4 +36,17 @@ inline void TRACE(const char* format,...)
 #define TRACEF ((void)0)
 #endif
 
+#else // !_WIN32
+
+#include <stdio.h>
+
+#ifdef _DEBUG
+#define TRACE(...)  fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE(...)  ((void)0)
+#endif
+#define TRACEF TRACE
+
+#endif // _WIN32
+
 #endif // __TRACE_H__850CE873
@@ -29,6 +29,38 @@ DUMPTHRDSTRUCT dmpstruct;
 static WCHAR g_lastStatusText[512] = {0}; // Buffer to prevent redundant status updates
 
 
+// Forwards engine status/progress to the dialog
+class CDialogProgressSink : public CProgressSink
+{
+	HWND m_hDlg;
+
+public:
+	CDialogProgressSink(HWND hDlg) : m_hDlg(hDlg) {}
+
+	void Status(const char* sText, BOOL bDone = FALSE)
+	{
+		WCHAR sWide[512] = {0};
+		MultiByteToWideChar(CP_ACP, 0, sText, -1, sWide, 512);
+		sWide[511] = 0;
+		SendMessage(m_hDlg, MYWM_UPDATE_STATUS, (WPARAM)sWide, bDone ? 1 : 0);
+	}
+
+	void Progress(UINT64 nDone, UINT64 nTotal)
+	{
+		int nPercent = nTotal ? (int)((nDone * 100) / nTotal) : 0;
+		SendMessage(m_hDlg, MYWM_UPDATE_PROGRESSBAR, nPercent, 0);
+	}
+
+	void Error(const char* sText)
+	{
+		WCHAR sWide[512] = {0};
+		MultiByteToWideChar(CP_ACP, 0, sText, -1, sWide, 512);
+		sWide[511] = 0;
+		MessageBox(NULL, sWide, L"error", 0);
+	}
+};
+
+
 UINT APIENTRY OFNHookProc(HWND hdlg, UINT uiMsg, WPARAM wParam, LPARAM lParam) 
 { 
 	if (WM_INITDIALOG==uiMsg) 
@@ -167,6 +199,94 @@ void AddListHeader(HWND hDlg)
 	ListView_InsertColumn(hListCtrl, 4, &col);
 }
 
+void FillPartitionList(HWND hDlg, const BYTE* pBuff)
+{
+	DWORD dwBootSector = 0x00000000;
+	WCHAR sTemp[64] = {0};
+	int nItem = 0;
+
+	dwBootSector = ((DWORD)pBuff[510]) << 8;
+	dwBootSector += ((BYTE)pBuff[511]);
+
+	ListView_DeleteAllItems(GetDlgItem(hDlg, IDC_LIST_VOLUME));
+
+	if(dwBootSector != 0x000055AA)
+		return;
+
+	DWORD dwOffset = 0x1be;
+	HWND hwdListCtrl = GetDlgItem(hDlg, IDC_LIST_VOLUME);
+	if(!hwdListCtrl) return;
+	while(dwOffset < 0x1fe)
+	{
+		if(pBuff[dwOffset + 4] != 0x00)
+		{
+			LVITEM item;
+			item.mask = LVIF_TEXT;
+			item.iItem = nItem;
+			item.iSubItem = 0;
+			if(pBuff[dwOffset] == 0x80 )
+				item.pszText =  L"Y";
+			else 
+				item.pszText =  L"N";
+
+			ListView_InsertItem(hwdListCtrl, &item);
+
+			// TYPE (FS)
+			if(pBuff[dwOffset + 4] == 0x07)
+				wsprintf(sTemp, L"NTFS");
+			else
+				wsprintf(sTemp, L"0x%02X", pBuff[dwOffset + 4]);
+			
+			item.iSubItem = 1;
+			item.pszText =  sTemp;
+			item.cchTextMax = wcslen(sTemp) + 1;
+			ListView_SetItem(hwdListCtrl, &item);
+
+			wsprintf(sTemp, L"0x%02X%02X%02X%02X"
+				, pBuff[dwOffset + 15]
+			, pBuff[dwOffset + 14]
+			, pBuff[dwOffset + 13]
+			, pBuff[dwOffset + 12]);
+
+			item.iSubItem = 2;
+			item.pszText =  sTemp;
+			item.cchTextMax = wcslen(sTemp) + 1;
+
+			ListView_SetItem(hwdListCtrl, &item);
+
+			// Cylinder-head-sector address of the first sector in the partition
+			wsprintf(sTemp, L"0x%02X 0x%02X 0x%02X"
+							, pBuff[dwOffset + 1]
+							, pBuff[dwOffset + 2]
+							, pBuff[dwOffset + 3]);
+
+			item.mask = LVIF_TEXT;
+			item.iItem = nItem;
+			item.iSubItem = 3;
+			item.pszText =  sTemp;
+			item.cchTextMax = wcslen(sTemp) + 1;
+
+			ListView_SetItem(hwdListCtrl, &item);
+
+
+			wsprintf(sTemp, L"0x%02X 0x%02X 0x%02X"
+							, pBuff[dwOffset + 5]
+							, pBuff[dwOffset + 6]
+							, pBuff[dwOffset + 7]);
+
+			item.mask = LVIF_TEXT;
+			item.iItem = nItem;
+			item.iSubItem = 4;
+			item.pszText =  sTemp;
+			item.cchTextMax = wcslen(sTemp) + 1;
+			ListView_SetItem(hwdListCtrl, &item);
+
+			nItem++;
+		}
+		dwOffset+= 0x10;
+	}
+}
+
 int WINAPI WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd )
 {
 	hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_ICON_V2D));
@@ -177,11 +297,12 @@ int WINAPI WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLin
 DWORD WINAPI DumpThread(LPVOID lpVoid)
 {
 	DUMPTHRDSTRUCT* pDumpStruct = (DUMPTHRDSTRUCT*)lpVoid;
+	CDialogProgressSink sink(pDumpStruct->hDlg);
 	
 	if(pDumpStruct->bVhdToDisk)
 	{
 		// VHD to Disk conversion
-		if(pVhd2disk->DumpVhdToDisk(pDumpStruct->sVhdPath, pDumpStruct->sDrive, pDumpStruct->hDlg))
+		if(pVhd2disk->DumpVhdToDisk(pDumpStruct->sVhdPath, pDumpStruct->sDrive, &sink))
 			SendMessage(pDumpStruct->hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"VHD dumped to drive successfully!", 1);
 		else
 			SendMessage(pDumpStruct->hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to dump the VHD to drive!", 1);
@@ -192,7 +313,7 @@ DWORD WINAPI DumpThread(LPVOID lpVoid)
 		if(!pDisk2vhd)
 			pDisk2vhd = new CDiskToVhd();
 			
-		if(pDisk2vhd && pDisk2vhd->DumpDiskToVhd(pDumpStruct->sDrive, pDumpStruct->sVhdPath, pDumpStruct->hDlg))
+		if(pDisk2vhd && pDisk2vhd->DumpDiskToVhd(pDumpStruct->sDrive, pDumpStruct->sVhdPath, &sink))
 			SendMessage(pDumpStruct->hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Disk converted to VHD successfully!", 1);
 		else
 			SendMessage(pDumpStruct->hDlg, MYWM_UPDATE_STATUS, (WPARAM)L"Failed to convert disk to VHD!", 1);
@@ -256,7 +377,7 @@ LRESULT CALLBACK MainDlgProc( HWND hDlg, UINT Msg, WPARAM wParam, LPARAM lParam
 
 		case IDC_BUTTON_BROWSE_VHD_SAVE:
 			sVhdPath[0] = L'\0';
-			if (DoSaveFileDialog(sVhdPath, L"VHD Files (*.vhd)\0*.vhd\0All Files (*.*)\0*.*\0", L"vhd") == IDOK)
+			if (DoSaveFileDialog(sVhdPath, L"VHD Files (*.vhd;*.vhdx)\0*.vhd;*.vhdx\0All Files (*.*)\0*.*\0", L"vhd") == IDOK)
 			{
 				SetDlgItemText(hDlg, IDC_EDIT_VHD_SAVE_FILE, sVhdPath);
 			}
@@ -290,7 +411,7 @@ LRESULT CALLBACK MainDlgProc( HWND hDlg, UINT Msg, WPARAM wParam, LPARAM lParam
 			return TRUE;
 
 		case IDC_BUTTON_BROWSE_VHD:
-			if (DoFileDialog(sVhdPath, L"VHD Files (*.vhd)\0*.vhd\0All Files (*.*)\0*.*\0", L"vhd") == IDOK)
+			if (DoFileDialog(sVhdPath, L"VHD Files (*.vhd;*.vhdx)\0*.vhd;*.vhdx\0All Files (*.*)\0*.*\0", L"vhd") == IDOK)
 			{
 				SetDlgItemText(hDlg, IDC_EDIT_VHD_FILE, sVhdPath);
 
@@ -301,7 +422,11 @@ LRESULT CALLBACK MainDlgProc( HWND hDlg, UINT Msg, WPARAM wParam, LPARAM lParam
 
 				pVhd2disk = new CVhdToDisk(sVhdPath);
 				if(pVhd2disk)
-					pVhd2disk->ParseFirstSector(hDlg);
+				{
+					BYTE firstSector[512];
+					if(pVhd2disk->ReadFirstSector(firstSector))
+						FillPartitionList(hDlg, firstSector);
+				}
 			}
 			return TRUE;
 
@@ -0,0 +1,413 @@
+// Vhd2diskCli.cpp : headless front end to the conversion engines.
+//
+//   vhd2disk restore <image.vhd> <target>    VHD or VHDX -> disk (raw image file or block
+//                                            device), "-" reads a dynamic VHD from stdin
+//   vhd2disk capture <source> <image.vhd>    disk -> dynamic (or fixed) VHD, or VHDX when
+//                                            the image name ends in .vhdx, "-" writes a
+//                                            VHD to stdout
+//   vhd2disk info <image.vhd>                print the VHD headers and partition table
+//   vhd2disk bench                           zero detection throughput per CPU variant
+//
+
+#include "stdafx.h"
+#include "VhdToDisk.h"
+#include "DiskToVhd.h"
+#include "ZeroScan.h"
+#include "IoQueue.h"
+
+#ifdef _WIN32
+#define CLI_MAIN	wmain
+#define CLI_STR(s)	L##s
+#define CLI_CMP		wcscmp
+#define CLI_NCMP	wcsncmp
+#define CLI_TOUL	wcstoul
+#define CLI_FMT		"%S"
+#else
+#define CLI_MAIN	main
+#define CLI_STR(s)	s
+#define CLI_CMP		strcmp
+#define CLI_NCMP	strncmp
+#define CLI_TOUL	strtoul
+#define CLI_FMT		"%s"
+#endif
+
+// deepest --queue-depth: each level holds an extent or a block in memory
+#define CLI_MAX_QUEUE_DEPTH	1024
+
+// Prints status on stderr, overwriting the line while a run is in progress
+class CConsoleProgressSink : public CProgressSink
+{
+	BOOL m_bQuiet;
+	BOOL m_bPending;
+	int m_nPercent;
+
+public:
+	CConsoleProgressSink(BOOL bQuiet) : m_bQuiet(bQuiet), m_bPending(FALSE), m_nPercent(0) {}
+
+	~CConsoleProgressSink()
+	{
+		if(m_bPending)
+			fputc('\n', stderr);
+	}
+
+	void Status(const char* sText, BOOL bDone = FALSE)
+	{
+		if(bDone)
+		{
+			Error(sText);
+			return;
+		}
+
+		if(m_bQuiet)
+			return;
+
+		fprintf(stderr, "\r[%3d%%] %-100.100s", m_nPercent, sText);
+		fflush(stderr);
+		m_bPending = TRUE;
+	}
+
+	void Progress(UINT64 nDone, UINT64 nTotal)
+	{
+		if(nTotal)
+			m_nPercent = (int)((nDone * 100) / nTotal);
+	}
+
+	void Error(const char* sText)
+	{
+		if(m_bPending)
+			fputc('\n', stderr);
+		m_bPending = FALSE;
+
+		fprintf(stderr, "vhd2disk: %s\n", sText);
+	}
+
+	// Final message of a successful run
+	void Done(const char* sText)
+	{
+		if(m_bPending)
+			fputc('\n', stderr);
+		m_bPending = FALSE;
+
+		if(!m_bQuiet)
+			fprintf(stderr, "%s\n", sText);
+	}
+};
+
+static void Usage()
+{
+	fprintf(stderr,
+		"usage: vhd2disk [options] restore <image.vhd> <target>\n"
+		"       vhd2disk [options] capture <source> <image.vhd>\n"
+		"       vhd2disk info <image.vhd>\n"
+		"       vhd2disk bench\n"
+		"\n"
+		"  restore  write a dynamic, differencing or fixed VHD, or a VHDX, onto a block\n"
+		"           device or raw image file, <image.vhd> may be - to read a dynamic VHD\n"
+		"           from a pipe\n"
+		"  capture  create a dynamic (or --fixed) VHD from a block device or raw image file,\n"
+		"           or a dynamic VHDX when <image.vhd> ends in .vhdx, <image.vhd> may be -\n"
+		"           to write a VHD to a pipe in one pass (BAT after the data)\n"
+		"  info     print the VHD (or VHDX) headers and partition table\n"
+		"  bench    measure zero detection speed of each supported CPU variant\n"
+		"\n"
+		"  -q                 no progress output\n"
+		"  --io=BACKEND       how transfers are queued: auto, sync, threads (POSIX), uring\n"
+		"                     (Linux io_uring) or overlapped (Windows), default auto\n"
+		"  --queue-depth=N    extents (restore) or blocks (capture) read/written concurrently\n"
+		"                     (default 4, at most 1024)\n"
+		"  --bat-order        restore: read blocks in BAT order rather than file order\n"
+		"  --max-extent=MB    restore: largest read of adjacent blocks (default 32)\n"
+		"  --bitmap           restore: skip sectors the block bitmaps mark unused\n"
+		"  --zero-empty       restore: zero the target under unallocated blocks\n"
+		"  --discard-empty    restore: discard (TRIM) the target under unallocated blocks\n"
+		"  --delta            restore: compare with the target, write only blocks that differ\n"
+		"  --mmap             restore: map the image file and write aligned blocks straight out\n"
+		"                     of the page cache instead of reading them into buffers\n"
+		"  --flush=WHEN       restore: each (write-through, default), end (one cache flush\n"
+		"                     that must succeed) or a number of GB between flushes\n"
+		"  --fixed            capture: write a fixed VHD (raw copy plus footer)\n"
+		"  --block-size=MB    capture: block size, a power of two from 1 to 256 (default 2 for a\n"
+		"                     VHD, 32 for a VHDX), or auto to pick it from a sample of the disk\n"
+		"  --logical-sector=N capture: VHDX logical sector size, 512 or 4096 (default 512)\n"
+		"  --physical-sector=N capture: VHDX physical sector size, 512 or 4096 (default 4096)\n"
+		"  --unbuffered       capture: bypass the OS cache on the source and the VHD payload\n"
+		"  --skip-free        capture: read and store only clusters the NTFS, ext2/3/4 or FAT\n"
+		"                     filesystems use, free space reads back as zeroes\n"
+		"  --preallocate      capture: allocate the VHD file in big steps ahead of the writes\n"
+		"                     so it ends up in few extents, trimmed before the footer\n"
+		"  --parent=VHD       capture: write a differencing VHD holding only what changed since\n"
+		"                     VHD (itself possibly differencing)\n");
+}
+
+static int Info(LPCPATH sPath)
+{
+	CVhdToDisk vhd(sPath);
+	BYTE sector[512];
+
+	const VHD_FOOTER& foot = vhd.GetFooter();
+	const VHD_DYNAMIC& dyn = vhd.GetDynHeader();
+	const CVhdxFile& vhdx = vhd.GetVhdx();
+
+	if(vhdx.IsOpen())
+	{
+		printf("format:           VHDX%s\n", vhdx.HasParent() ? " (differencing)" : "");
+		printf("virtual size:     %llu bytes\n", (unsigned long long)vhdx.GetVirtualSize());
+		printf("block size:       %u bytes\n", vhdx.GetBlockSize());
+		printf("sector size:      %u logical, %u physical\n", vhdx.GetLogicalSectorSize(), vhdx.GetPhysicalSectorSize());
+		printf("blocks:           %u\n", vhdx.GetBlockCount());
+		printf("log entries:      %u replayed\n", vhdx.GetLogEntries());
+	}
+	else
+	{
+		if(memcmp(foot.cookie, "conectix", 8) != 0)
+		{
+			fprintf(stderr, "vhd2disk: " CLI_FMT ": not a VHD file\n", sPath);
+			return 1;
+		}
+
+		printf("disk type:        %u\n", _byteswap_ulong(foot.diskType));
+		printf("virtual size:     %llu bytes\n", (unsigned long long)_byteswap_uint64(foot.currentSize));
+		printf("geometry (CHS):   %u/%u/%u\n", _byteswap_ushort(foot.diskGeometry.cylinders)
+			, foot.diskGeometry.heads, foot.diskGeometry.sectors);
+
+		if(memcmp(dyn.cookie, "cxsparse", 8) == 0)
+		{
+			printf("block size:       %u bytes\n", _byteswap_ulong(dyn.blockSize));
+			printf("BAT entries:      %u\n", _byteswap_ulong(dyn.maxTableEntries));
+			printf("BAT offset:       %llu\n", (unsigned long long)_byteswap_uint64(dyn.tableOffset));
+		}
+
+		if(_byteswap_ulong(foot.diskType) == VHD_TYPE_DIFFERENCING)
+		{
+			// UTF-16 big endian, printed as far as it is plain ASCII
+			printf("parent:           ");
+			for(UINT32 n = 0; n + 1 < sizeof(dyn.parentUnicodeName) && dyn.parentUnicodeName[n + 1]; n += 2)
+				putchar(dyn.parentUnicodeName[n] ? '?' : dyn.parentUnicodeName[n + 1]);
+			putchar('\n');
+		}
+	}
+
+	if(!vhd.ReadFirstSector(sector) || sector[510] != 0x55 || sector[511] != 0xAA)
+		return 0;
+
+	printf("\nboot  type  start sector  size (sectors)\n");
+	for(DWORD dwOffset = 0x1be; dwOffset < 0x1fe; dwOffset += 0x10)
+	{
+		const BYTE* p = sector + dwOffset;
+		if(p[4] == 0x00)
+			continue;
+
+		UINT32 nStart = p[8] | (p[9] << 8) | (p[10] << 16) | ((UINT32)p[11] << 24);
+		UINT32 nSize = p[12] | (p[13] << 8) | (p[14] << 16) | ((UINT32)p[15] << 24);
+
+		printf("%-4s  0x%02X  %12u  %14u\n", p[0] == 0x80 ? "Y" : "N", p[4], nStart, nSize);
+	}
+
+	return 0;
+}
+
+// Zero detection over an empty 64 MB buffer, the worst case: every byte is
+// read. Whole block answer, then the per-sector mask used for bitmaps.
+static int Bench()
+{
+	const UINT32 nBytes = 64 * 1024 * 1024;
+	const UINT32 nPasses = 16;
+	BYTE* pBuff = (BYTE*)AllocAligned(nBytes);
+	BYTE* pMask = (BYTE*)malloc(nBytes / 512 / 8);
+	DWORD dwBest = GetZeroScanSupport();
+
+	if(!pBuff || !pMask)
+	{
+		FreeAligned(pBuff);
+		free(pMask);
+		return 1;
+	}
+
+	memset(pBuff, 0, nBytes);
+
+	printf("variant   block GB/s  sector mask GB/s\n");
+	for(DWORD dwLevel = ZEROSCAN_SCALAR; dwLevel <= dwBest; dwLevel++)
+	{
+		UINT64 nStart, nBlockMs, nMaskMs;
+		UINT32 nZero = 0;
+
+		SetZeroScanLevel(dwLevel);
+
+		nStart = GetTickCountMs();
+		for(UINT32 n = 0; n < nPasses; n++)
+			nZero += IsZeroBlock(pBuff, nBytes);
+		nBlockMs = GetTickCountMs() - nStart;
+
+		nStart = GetTickCountMs();
+		for(UINT32 n = 0; n < nPasses; n++)
+			nZero += GetDataSectorMask(pBuff, nBytes / 512, pMask) == 0;
+		nMaskMs = GetTickCountMs() - nStart;
+
+		if(nZero != 2 * nPasses)
+			fprintf(stderr, "vhd2disk: %s variant got a wrong answer\n", GetZeroScanName(dwLevel));
+
+		printf("%-8s  %10.2f  %16.2f\n", GetZeroScanName(dwLevel)
+			, (double)nBytes * nPasses / 1e6 / (nBlockMs ? nBlockMs : 1)
+			, (double)nBytes * nPasses / 1e6 / (nMaskMs ? nMaskMs : 1));
+	}
+
+	SetZeroScanLevel(dwBest);
+	FreeAligned(pBuff);
+	free(pMask);
+
+	return 0;
+}
+
+int CLI_MAIN(int argc, PATHCHAR** argv)
+{
+	BOOL bQuiet = FALSE;
+	RESTORE_OPTIONS restore;
+	CAPTURE_OPTIONS capture;
+	int i = 1;
+
+	InitRestoreOptions(&restore);
+	InitCaptureOptions(&capture);
+
+	for(; i < argc && argv[i][0] == '-'; i++)
+	{
+		if(CLI_CMP(argv[i], CLI_STR("-q")) == 0)
+			bQuiet = TRUE;
+		else if(CLI_NCMP(argv[i], CLI_STR("--queue-depth="), 14) == 0)
+		{
+			PATHCHAR* pEnd = NULL;
+			unsigned long nDepth = CLI_TOUL(argv[i] + 14, &pEnd, 10);
+
+			if(!nDepth || nDepth > CLI_MAX_QUEUE_DEPTH || *pEnd || argv[i][14] < '0' || argv[i][14] > '9')
+			{
+				Usage();
+				return 2;
+			}
+
+			restore.nQueueDepth = capture.nQueueDepth = (UINT32)nDepth;
+		}
+		else if(CLI_CMP(argv[i], CLI_STR("--bat-order")) == 0)
+			restore.bOffsetOrder = FALSE;
+		else if(CLI_CMP(argv[i], CLI_STR("--zero-empty")) == 0)
+			restore.dwEmptyBlocks = RESTORE_EMPTY_ZERO;
+		else if(CLI_CMP(argv[i], CLI_STR("--discard-empty")) == 0)
+			restore.dwEmptyBlocks = RESTORE_EMPTY_DISCARD;
+		else if(CLI_CMP(argv[i], CLI_STR("--fixed")) == 0)
+			capture.dwDiskType = VHD_TYPE_FIXED;
+		else if(CLI_CMP(argv[i], CLI_STR("--unbuffered")) == 0)
+			capture.bUnbuffered = TRUE;
+		else if(CLI_CMP(argv[i], CLI_STR("--skip-free")) == 0)
+			capture.bSkipFree = TRUE;
+		else if(CLI_CMP(argv[i], CLI_STR("--preallocate")) == 0)
+			capture.bPreallocate = TRUE;
+		else if(CLI_CMP(argv[i], CLI_STR("--delta")) == 0)
+			restore.bDelta = TRUE;
+		else if(CLI_CMP(argv[i], CLI_STR("--mmap")) == 0)
+			restore.bMapImage = TRUE;
+		else if(CLI_CMP(argv[i], CLI_STR("--flush=each")) == 0)
+			restore.dwDurability = RESTORE_DURABLE_EACH;
+		else if(CLI_CMP(argv[i], CLI_STR("--flush=end")) == 0)
+			restore.dwDurability = RESTORE_DURABLE_END;
+		else if(CLI_NCMP(argv[i], CLI_STR("--flush="), 8) == 0)
+		{
+			// a whole number of GB: 0, or anything that isn't a number, is a mistake
+			PATHCHAR* pEnd = NULL;
+			UINT32 nGB = (UINT32)CLI_TOUL(argv[i] + 8, &pEnd, 10);
+
+			if(!nGB || *pEnd || argv[i][8] < '0' || argv[i][8] > '9')
+			{
+				Usage();
+				return 2;
+			}
+
+			restore.dwDurability = RESTORE_DURABLE_BARRIER;
+			restore.nBarrierBytes = (UINT64)nGB * 1024 * 1024 * 1024;
+		}
+		else if(CLI_CMP(argv[i], CLI_STR("--bitmap")) == 0)
+			restore.bUseBitmap = TRUE;
+		else if(CLI_NCMP(argv[i], CLI_STR("--max-extent="), 13) == 0)
+			restore.nMaxExtent = (UINT32)CLI_TOUL(argv[i] + 13, NULL, 10) * 1024 * 1024;
+		else if(CLI_CMP(argv[i], CLI_STR("--block-size=auto")) == 0)
+			capture.nBlockSize = CAPTURE_BLOCK_AUTO;
+		else if(CLI_NCMP(argv[i], CLI_STR("--block-size="), 13) == 0)
+		{
+			// anything over 4 GB would wrap around, keep it out of range instead
+			UINT32 nMB = (UINT32)CLI_TOUL(argv[i] + 13, NULL, 10);
+			capture.nBlockSize = nMB < 4096 ? nMB * 1024 * 1024 : 1;
+		}
+		else if(CLI_NCMP(argv[i], CLI_STR("--parent="), 9) == 0)
+			capture.sParentPath = argv[i] + 9;
+		else if(CLI_NCMP(argv[i], CLI_STR("--io="), 5) == 0)
+		{
+			DWORD dwBackend = IOQ_BACKENDS;
+
+			if(CLI_CMP(argv[i] + 5, CLI_STR("auto")) == 0)
+				dwBackend = IOQ_BACKEND_AUTO;
+			else if(CLI_CMP(argv[i] + 5, CLI_STR("sync")) == 0)
+				dwBackend = IOQ_BACKEND_SYNC;
+			else if(CLI_CMP(argv[i] + 5, CLI_STR("threads")) == 0)
+				dwBackend = IOQ_BACKEND_THREADS;
+			else if(CLI_CMP(argv[i] + 5, CLI_STR("uring")) == 0)
+				dwBackend = IOQ_BACKEND_URING;
+			else if(CLI_CMP(argv[i] + 5, CLI_STR("overlapped")) == 0)
+				dwBackend = IOQ_BACKEND_OVERLAPPED;
+
+			if(!SetIoBackend(dwBackend))
+			{
+				fprintf(stderr, "vhd2disk: I/O backend " CLI_FMT " is not available here\n", argv[i] + 5);
+				return 2;
+			}
+		}
+		else if(CLI_NCMP(argv[i], CLI_STR("--logical-sector="), 17) == 0)
+			capture.nLogicalSector = (UINT32)CLI_TOUL(argv[i] + 17, NULL, 10);
+		else if(CLI_NCMP(argv[i], CLI_STR("--physical-sector="), 18) == 0)
+			capture.nPhysicalSector = (UINT32)CLI_TOUL(argv[i] + 18, NULL, 10);
+		else
+		{
+			Usage();
+			return 2;
+		}
+	}
+
+	if(argc - i == 2 && CLI_CMP(argv[i], CLI_STR("info")) == 0)
+		return Info(argv[i + 1]);
+
+	if(argc - i == 1 && CLI_CMP(argv[i], CLI_STR("bench")) == 0)
+		return Bench();
+
+	if(argc - i != 3)
+	{
+		Usage();
+		return 2;
+	}
+
+	CConsoleProgressSink sink(bQuiet);
+
+	if(CLI_CMP(argv[i], CLI_STR("restore")) == 0)
+	{
+		CVhdToDisk vhd2disk;
+		vhd2disk.SetOptions(restore);
+		if(!vhd2disk.DumpVhdToDisk(argv[i + 1], argv[i + 2], &sink))
+		{
+			sink.Error("Failed to dump the VHD to drive!");
+			return 1;
+		}
+		sink.Done("VHD dumped to drive successfully!");
+		return 0;
+	}
+
+	if(CLI_CMP(argv[i], CLI_STR("capture")) == 0)
+	{
+		CDiskToVhd disk2vhd;
+		disk2vhd.SetOptions(capture);
+		if(!disk2vhd.DumpDiskToVhd(argv[i + 1], argv[i + 2], &sink))
+		{
+			sink.Error("Failed to convert disk to VHD!");
+			return 1;
+		}
+		sink.Done("Disk converted to VHD successfully!");
+		return 0;
+	}
+
+	Usage();
+	return 2;
+}
@@ -0,0 +1,393 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "VhdChain.h"
+
+#define VHD_PATH_MAX	1024
+
+// Length of the directory part of sPath, separator included
+static size_t DirLength(LPCPATH sPath)
+{
+	size_t nDir = 0;
+
+	for(size_t i = 0; sPath[i]; i++)
+	{
+#ifdef _WIN32
+		if(sPath[i] == '\\' || sPath[i] == '/' || sPath[i] == ':')
+#else
+		if(sPath[i] == '/')
+#endif
+			nDir = i + 1;
+	}
+
+	return nDir;
+}
+
+static void AppendPath(PATHCHAR* sOut, size_t nMax, LPCPATH sIn, size_t nIn)
+{
+	size_t nLen = 0;
+
+	while(sOut[nLen]) nLen++;
+
+	for(size_t i = 0; i < nIn && sIn[i] && nLen + 1 < nMax; i++)
+		sOut[nLen++] = sIn[i];
+
+	sOut[nLen] = 0;
+}
+
+// Parent names are stored as UTF-16 (big endian in the header, little endian
+// in the Windows locators). POSIX paths get UTF-8 and forward slashes.
+static void DecodeUtf16(PATHCHAR* sOut, size_t nMax, const BYTE* p, UINT32 nBytes, BOOL bBigEndian)
+{
+	size_t nLen = 0;
+
+	for(UINT32 i = 0; i + 1 < nBytes; i += 2)
+	{
+		UINT32 c = bBigEndian ? (p[i] << 8) | p[i + 1] : p[i] | (p[i + 1] << 8);
+		if(c == 0) break;
+
+#ifdef _WIN32
+		if(nLen + 1 >= nMax) break;
+		sOut[nLen++] = (WCHAR)c;
+#else
+		// surrogate pair
+		if(c >= 0xD800 && c < 0xDC00 && i + 3 < nBytes)
+		{
+			UINT32 c2 = bBigEndian ? (p[i + 2] << 8) | p[i + 3] : p[i + 2] | (p[i + 3] << 8);
+			c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+			i += 2;
+		}
+
+		if(nLen + 5 >= nMax) break;
+
+		if(c == '\\')
+			sOut[nLen++] = '/';
+		else if(c < 0x80)
+			sOut[nLen++] = (char)c;
+		else if(c < 0x800)
+		{
+			sOut[nLen++] = (char)(0xC0 | (c >> 6));
+			sOut[nLen++] = (char)(0x80 | (c & 0x3F));
+		}
+		else if(c < 0x10000)
+		{
+			sOut[nLen++] = (char)(0xE0 | (c >> 12));
+			sOut[nLen++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			sOut[nLen++] = (char)(0x80 | (c & 0x3F));
+		}
+		else
+		{
+			sOut[nLen++] = (char)(0xF0 | (c >> 18));
+			sOut[nLen++] = (char)(0x80 | ((c >> 12) & 0x3F));
+			sOut[nLen++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			sOut[nLen++] = (char)(0x80 | (c & 0x3F));
+		}
+#endif
+	}
+
+	sOut[nLen] = 0;
+}
+
+CVhdChain::CVhdChain(void)
+{
+	m_nLayers = 0;
+	m_bUseBitmaps = FALSE;
+}
+
+CVhdChain::~CVhdChain(void)
+{
+	Close();
+}
+
+void CVhdChain::Close()
+{
+	for(UINT32 i = 0; i < m_nLayers; i++)
+		CloseLayer(m_pLayers[i]);
+
+	m_nLayers = 0;
+}
+
+void CVhdChain::CloseLayer(VHD_LAYER* pLayer)
+{
+	if(pLayer->pBat) delete[] pLayer->pBat;
+	if(pLayer->pBitmap) delete[] pLayer->pBitmap;
+
+	delete pLayer;
+}
+
+VHD_LAYER* CVhdChain::OpenLayer(LPCPATH sPath)
+{
+	DWORD dwByteRead = 0;
+	VHD_LAYER* pLayer = new VHD_LAYER;
+
+	ZeroMemory(&pLayer->foot, sizeof(VHD_FOOTER));
+	ZeroMemory(&pLayer->dyn, sizeof(VHD_DYNAMIC));
+	pLayer->pBat = NULL;
+	pLayer->nBats = 0;
+	pLayer->pBitmap = NULL;
+	pLayer->nBitmapBlock = 0xFFFFFFFF;
+	pLayer->nLastBlock = ~0ULL;
+
+	if(!pLayer->file.Open(sPath, BDEV_READ | BDEV_OVERLAPPED))
+		goto fail;
+
+	// footer copy in front for dynamic disks, only at the end for fixed ones
+	if(!pLayer->file.ReadAt(0, &pLayer->foot, sizeof(VHD_FOOTER), &dwByteRead) || dwByteRead != sizeof(VHD_FOOTER))
+		goto fail;
+
+	if(memcmp(pLayer->foot.cookie, "conectix", 8) != 0)
+	{
+		UINT64 nSize = pLayer->file.GetSize();
+
+		if(nSize < sizeof(VHD_FOOTER)
+			|| !pLayer->file.ReadAt(nSize - sizeof(VHD_FOOTER), &pLayer->foot, sizeof(VHD_FOOTER), &dwByteRead)
+			|| memcmp(pLayer->foot.cookie, "conectix", 8) != 0)
+			goto fail;
+	}
+
+	pLayer->dwType = _byteswap_ulong(pLayer->foot.diskType);
+	pLayer->nSectors = _byteswap_uint64(pLayer->foot.currentSize) / 512;
+
+	if(pLayer->dwType == VHD_TYPE_FIXED)
+		return pLayer;
+
+	if(!pLayer->file.ReadAt(_byteswap_uint64(pLayer->foot.dataOffset), &pLayer->dyn, sizeof(VHD_DYNAMIC), &dwByteRead)
+		|| dwByteRead != sizeof(VHD_DYNAMIC)
+		|| memcmp(pLayer->dyn.cookie, "cxsparse", 8) != 0)
+		goto fail;
+
+	pLayer->nBats = _byteswap_ulong(pLayer->dyn.maxTableEntries);
+	pLayer->nSectorsPerBlock = _byteswap_ulong(pLayer->dyn.blockSize) / 512;
+	pLayer->nBitmapBytes = (pLayer->nSectorsPerBlock / 8 + 511) & ~511U;
+
+	if(!pLayer->nSectorsPerBlock)
+		goto fail;
+
+	pLayer->pBat = new UINT32[pLayer->nBats];
+	pLayer->pBitmap = new BYTE[pLayer->nBitmapBytes];
+
+	if(!pLayer->file.ReadAt(_byteswap_uint64(pLayer->dyn.tableOffset), pLayer->pBat, pLayer->nBats * sizeof(UINT32), &dwByteRead)
+		|| dwByteRead != pLayer->nBats * sizeof(UINT32))
+		goto fail;
+
+	for(UINT32 b = 0; b < pLayer->nBats; b++)
+	{
+		pLayer->pBat[b] = _byteswap_ulong(pLayer->pBat[b]);
+
+		if(pLayer->pBat[b] != 0xFFFFFFFF && (pLayer->nLastBlock == ~0ULL || pLayer->pBat[b] * 512ULL > pLayer->nLastBlock))
+			pLayer->nLastBlock = pLayer->pBat[b] * 512ULL;
+	}
+
+	return pLayer;
+
+fail:
+	TRACE("Failed to open VHD layer with error 0x%08X\n", pLayer->file.GetLastError());
+	CloseLayer(pLayer);
+	return NULL;
+}
+
+// Tries the relative and absolute Windows locators, then the parent file
+// name, each next to the child too. The parent must carry the unique id the
+// child recorded.
+VHD_LAYER* CVhdChain::OpenParent(VHD_LAYER* pChild, LPCPATH sChildPath, PATHCHAR* sParentPath, size_t nMax)
+{
+	PATHCHAR sName[VHD_PATH_MAX];
+	BYTE data[VHD_PATH_MAX * 2];
+	size_t nDir = DirLength(sChildPath);
+
+	// one pass per locator, the last one for parentUnicodeName
+	for(UINT32 l = 0; l <= 8; l++)
+	{
+		BOOL bRelative = FALSE;
+
+		if(l < 8)
+		{
+			const UCHAR* pCode = pChild->dyn.partentLocator[l].platformCode;
+			UINT32 nLength = _byteswap_ulong(pChild->dyn.partentLocator[l].platformDataLength);
+			UINT64 nOffset = _byteswap_uint64(pChild->dyn.partentLocator[l].platformDataOffset);
+			DWORD dwByteRead = 0;
+
+			if(memcmp(pCode, "W2ru", 4) == 0)
+				bRelative = TRUE;
+			else if(memcmp(pCode, "W2ku", 4) != 0)
+				continue;
+
+			if(nLength > sizeof(data)) nLength = sizeof(data);
+
+			if(!pChild->file.ReadAt(nOffset, data, nLength, &dwByteRead))
+				continue;
+
+			DecodeUtf16(sName, VHD_PATH_MAX, data, dwByteRead, FALSE);
+		}
+		else
+			DecodeUtf16(sName, VHD_PATH_MAX, pChild->dyn.parentUnicodeName, sizeof(pChild->dyn.parentUnicodeName), TRUE);
+
+		if(!sName[0])
+			continue;
+
+		// as recorded (relative ones against the child's directory), then by name next to the child
+		for(UINT32 nTry = 0; nTry < 2; nTry++)
+		{
+			sParentPath[0] = 0;
+
+			if(nTry == 0 && bRelative)
+				AppendPath(sParentPath, nMax, sChildPath, nDir);
+
+			if(nTry == 0)
+				AppendPath(sParentPath, nMax, sName, VHD_PATH_MAX);
+			else
+			{
+				AppendPath(sParentPath, nMax, sChildPath, nDir);
+				AppendPath(sParentPath, nMax, sName + DirLength(sName), VHD_PATH_MAX);
+			}
+
+			VHD_LAYER* pParent = OpenLayer(sParentPath);
+			if(!pParent)
+				continue;
+
+			if(memcmp(pParent->foot.uniqueId, pChild->dyn.parentUniqueId, 16) == 0)
+				return pParent;
+
+			TRACE("Parent candidate has a different unique id\n");
+			CloseLayer(pParent);
+		}
+	}
+
+	return NULL;
+}
+
+BOOL CVhdChain::Open(LPCPATH sPath)
+{
+	PATHCHAR sPaths[2][VHD_PATH_MAX];
+	UINT32 nCurrent = 0;
+
+	Close();
+
+	sPaths[0][0] = 0;
+	AppendPath(sPaths[0], VHD_PATH_MAX, sPath, VHD_PATH_MAX);
+
+	m_pLayers[0] = OpenLayer(sPath);
+	if(!m_pLayers[0])
+		return FALSE;
+	m_nLayers = 1;
+
+	while(m_pLayers[m_nLayers - 1]->dwType == VHD_TYPE_DIFFERENCING)
+	{
+		if(m_nLayers == VHD_MAX_CHAIN)
+		{
+			TRACE("Differencing chain deeper than %u\n", VHD_MAX_CHAIN);
+			Close();
+			return FALSE;
+		}
+
+		VHD_LAYER* pParent = OpenParent(m_pLayers[m_nLayers - 1], sPaths[nCurrent], sPaths[1 - nCurrent], VHD_PATH_MAX);
+		if(!pParent)
+		{
+			TRACE("Can't find the parent of layer %u\n", m_nLayers - 1);
+			Close();
+			return FALSE;
+		}
+
+		m_pLayers[m_nLayers++] = pParent;
+		nCurrent = 1 - nCurrent;
+	}
+
+	return TRUE;
+}
+
+BOOL CVhdChain::ReadBitmap(VHD_LAYER* pLayer, UINT32 nBlock)
+{
+	DWORD dwByteRead = 0;
+
+	if(pLayer->nBitmapBlock == nBlock)
+		return TRUE;
+
+	if(!pLayer->file.ReadAt(pLayer->pBat[nBlock] * 512ULL, pLayer->pBitmap, pLayer->nBitmapBytes, &dwByteRead)
+		|| dwByteRead != pLayer->nBitmapBytes)
+	{
+		pLayer->nBitmapBlock = 0xFFFFFFFF;
+		return FALSE;
+	}
+
+	pLayer->nBitmapBlock = nBlock;
+
+	return TRUE;
+}
+
+BOOL CVhdChain::MayReadShort(const CBlockDevice* pFile, UINT64 nOffset) const
+{
+	for(UINT32 l = 0; l < m_nLayers; l++)
+	{
+		if(&m_pLayers[l]->file == pFile)
+			return nOffset >= m_pLayers[l]->nLastBlock;
+	}
+
+	return FALSE;
+}
+
+BOOL CVhdChain::MapSectors(UINT64 nSector, UINT32 nCount, VHD_RUN* pRuns, UINT32* pnRuns)
+{
+	UINT32 nRuns = 0;
+
+	for(UINT32 i = 0; i < nCount; i++)
+	{
+		UINT64 v = nSector + i;
+		CBlockDevice* pFile = NULL;
+		UINT64 nOffset = 0;
+
+		// topmost layer holding v
+		for(UINT32 l = 0; l < m_nLayers && !pFile; l++)
+		{
+			VHD_LAYER* pLayer = m_pLayers[l];
+
+			if(v >= pLayer->nSectors)
+				continue;
+
+			if(pLayer->dwType == VHD_TYPE_FIXED)
+			{
+				pFile = &pLayer->file;
+				nOffset = v * 512;
+				continue;
+			}
+
+			UINT32 nBlock = (UINT32)(v / pLayer->nSectorsPerBlock);
+			UINT32 s = (UINT32)(v % pLayer->nSectorsPerBlock);
+
+			if(nBlock >= pLayer->nBats || pLayer->pBat[nBlock] == 0xFFFFFFFF)
+				continue;
+
+			if(pLayer->dwType == VHD_TYPE_DIFFERENCING || m_bUseBitmaps)
+			{
+				if(!ReadBitmap(pLayer, nBlock))
+					return FALSE;
+
+				if((pLayer->pBitmap[s / 8] & (1 << (7 - s % 8))) == 0)
+					continue;
+			}
+
+			pFile = &pLayer->file;
+			nOffset = pLayer->pBat[nBlock] * 512ULL + pLayer->nBitmapBytes + s * 512ULL;
+		}
+
+		// extend the previous run when this sector follows it in the same file
+		if(nRuns)
+		{
+			VHD_RUN* pLast = &pRuns[nRuns - 1];
+
+			if(pLast->pFile == pFile && (!pFile || pLast->nOffset + pLast->nCount * 512ULL == nOffset))
+			{
+				pLast->nCount++;
+				continue;
+			}
+		}
+
+		pRuns[nRuns].nSector = v;
+		pRuns[nRuns].nCount = 1;
+		pRuns[nRuns].pFile = pFile;
+		pRuns[nRuns].nOffset = nOffset;
+		nRuns++;
+	}
+
+	*pnRuns = nRuns;
+
+	return TRUE;
+}
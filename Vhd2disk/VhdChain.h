@@ -0,0 +1,70 @@
+#pragma once
+
+#include "VhdToDisk.h"
+
+// Resolution of a differencing VHD and its parents into one merged disk.
+// Every sector belongs to the topmost layer that holds it: a differencing
+// layer holds the sectors set in the bitmap of its allocated blocks, a
+// dynamic base its allocated blocks (or only their set sectors, with
+// SetUseBitmaps), a fixed base everything.
+
+#define VHD_MAX_CHAIN	16
+
+// Sectors [nSector, nSector + nCount) of the merged disk, stored back to back
+typedef struct _VHD_RUN
+{
+	UINT64			nSector;
+	UINT32			nCount;
+	CBlockDevice*	pFile;		// NULL: no layer holds them
+	UINT64			nOffset;	// byte offset in pFile
+} VHD_RUN;
+
+typedef struct _VHD_LAYER
+{
+	CBlockDevice	file;
+	VHD_FOOTER		foot;
+	VHD_DYNAMIC		dyn;
+	UINT32			dwType;		// VHD_TYPE_*
+	UINT64			nSectors;	// virtual size
+	UINT32*			pBat;		// host byte order, NULL for a fixed disk
+	UINT32			nBats;
+	UINT32			nSectorsPerBlock;
+	UINT32			nBitmapBytes;
+	BYTE*			pBitmap;	// bitmap of block nBitmapBlock
+	UINT32			nBitmapBlock;
+	UINT64			nLastBlock;	// file offset of the block stored last, only it may be short
+} VHD_LAYER;
+
+class CVhdChain
+{
+	VHD_LAYER*	m_pLayers[VHD_MAX_CHAIN];	// [0] is the disk being restored
+	UINT32		m_nLayers;
+	BOOL		m_bUseBitmaps;	// a dynamic base holds only the sectors set in its bitmaps
+
+public:
+	CVhdChain(void);
+	~CVhdChain(void);
+
+	// Opens sPath and follows the parent locators down to a non-differencing disk
+	BOOL Open(LPCPATH sPath);
+	void Close();
+
+	UINT32 GetLayerCount() const { return m_nLayers; }
+	const VHD_LAYER* GetLayer(UINT32 n) const { return m_pLayers[n]; }
+
+	void SetUseBitmaps(BOOL bUse) { m_bUseBitmaps = bUse; }
+
+	// TRUE when a read at nOffset of pFile lies in the block its layer stores
+	// last, the only one a VHD may end short of
+	BOOL MayReadShort(const CBlockDevice* pFile, UINT64 nOffset) const;
+
+	// Splits nCount sectors starting at nSector into runs by owning layer.
+	// pRuns must have room for nCount entries; *pnRuns receives the count.
+	BOOL MapSectors(UINT64 nSector, UINT32 nCount, VHD_RUN* pRuns, UINT32* pnRuns);
+
+protected:
+	VHD_LAYER* OpenLayer(LPCPATH sPath);
+	void CloseLayer(VHD_LAYER* pLayer);
+	VHD_LAYER* OpenParent(VHD_LAYER* pChild, LPCPATH sChildPath, PATHCHAR* sParentPath, size_t nMax);
+	BOOL ReadBitmap(VHD_LAYER* pLayer, UINT32 nBlock);
+};
@@ -1,31 +1,139 @@
-#include "StdAfx.h"
+#include "stdafx.h"
 #include "Trace.h"
 #include "VhdToDisk.h"
-#include "resource.h"
+#include "IoQueue.h"
+#include "VhdChain.h"
+#include "ZeroScan.h"
 
-CVhdToDisk::CVhdToDisk(void)
+// Mapped image data is only written to the unbuffered target from a page
+// aligned address, which suits any sector size
+#define RESTORE_MAP_ALIGN	4096
+
+// Block data at this file offset can be written straight out of a mapping
+static BOOL IsMapAligned(UINT64 nSector, UINT32 nBitmapBytes)
+{
+	return (nSector * 512 + nBitmapBytes) % RESTORE_MAP_ALIGN == 0;
+}
+
+// One extent travelling through the restore queue: blocks stored back to back in
+// the VHD are read at once, then written as one request per run of consecutive
+// virtual sectors
+typedef struct _RESTORE_SLOT
+{
+	IO_REQUEST	read;
+	IO_SEGMENT*	pSegments;	// bitmap, data, bitmap, data...
+	IO_REQUEST*	pWrites;
+	UINT32		nWrites;
+	UINT32		nPending;	// writes not completed yet
+	BYTE*		pBitmaps;
+	BYTE*		pData;		// 4K aligned for the unbuffered target, blocks back to back
+	BYTE*		pCompare;	// delta restore: target contents, laid out like pData
+	const BYTE*	pView;		// mapped extent, bitmap, data, bitmap, data... as in the file; NULL: read into pData
+	UINT32		nFirst;		// first schedule entry of the extent
+	UINT32		nBlocks;
+} RESTORE_SLOT;
+
+void InitRestoreOptions(RESTORE_OPTIONS* pOptions)
+{
+	ZeroMemory(pOptions, sizeof(RESTORE_OPTIONS));
+	pOptions->nQueueDepth = 4;
+	pOptions->bOffsetOrder = TRUE;
+	pOptions->nMaxExtent = 32 * 1024 * 1024;
+	pOptions->bUseBitmap = FALSE;
+	pOptions->dwEmptyBlocks = RESTORE_EMPTY_KEEP;
+	pOptions->bDelta = FALSE;
+	pOptions->dwDurability = RESTORE_DURABLE_EACH;
+	pOptions->nBarrierBytes = 4ULL * 1024 * 1024 * 1024;
+	pOptions->bMapImage = FALSE;
+}
+
+// Queue a write of nCount sectors held at pBuff, merged into the previous one
+// when both the disk range and the buffer carry on from it
+static void AddWriteRun(RESTORE_SLOT* pSlot, CBlockDevice* pDevice, UINT64 nSector, UINT32 nCount, BYTE* pBuff, BOOL bMerge)
+{
+	if(pSlot->nWrites && bMerge)
+	{
+		IO_REQUEST* pLast = &pSlot->pWrites[pSlot->nWrites - 1];
+
+		if(pLast->nOffset + pLast->nBytes == nSector * 512
+			&& (BYTE*)pLast->pBuff + pLast->nBytes == pBuff)
+		{
+			pLast->nBytes += nCount * 512;
+			return;
+		}
+	}
+
+	IO_REQUEST* pWrite = &pSlot->pWrites[pSlot->nWrites++];
+	pWrite->dwOp = IOQ_WRITE;
+	pWrite->pDevice = pDevice;
+	pWrite->nOffset = nSector * 512;
+	pWrite->pBuff = pBuff;
+	pWrite->nBytes = nCount * 512;
+}
+
+// A short read past the end of the VHD reads the missing bytes as zeroes
+static void ZeroFillShortRead(IO_REQUEST* pReq)
+{
+	DWORD nSkip = pReq->nDone;
+
+	for(UINT32 i = 0; i < pReq->nSegments; i++)
+	{
+		IO_SEGMENT* pSeg = &pReq->pSegments[i];
+
+		if(nSkip >= pSeg->nBytes)
+		{
+			nSkip -= pSeg->nBytes;
+			continue;
+		}
+
+		memset((BYTE*)pSeg->pBuff + nSkip, 0, pSeg->nBytes - nSkip);
+		nSkip = 0;
+	}
+
+	pReq->nDone = pReq->nBytes;
+}
+
+static int CompareFileOffset(const void* p1, const void* p2)
 {
-	m_hVhdFile = NULL;
-	m_hPhysicalDrive = NULL;
+	const BLOCK_ENTRY* e1 = (const BLOCK_ENTRY*)p1;
+	const BLOCK_ENTRY* e2 = (const BLOCK_ENTRY*)p2;
+
+	if(e1->nSector != e2->nSector)
+		return e1->nSector < e2->nSector ? -1 : 1;
+
+	return e1->nBlock < e2->nBlock ? -1 : (e1->nBlock > e2->nBlock);
+}
 
+CVhdToDisk::CVhdToDisk(void)
+{
 	ZeroMemory(&m_Foot, sizeof(VHD_FOOTER));
 	ZeroMemory(&m_Dyn, sizeof(VHD_DYNAMIC));
+	InitRestoreOptions(&m_Options);
+	m_nUnflushed = 0;
 }
 
-CVhdToDisk::CVhdToDisk(LPWSTR sPath)
+CVhdToDisk::CVhdToDisk(LPCPATH sPath)
 {
-	m_hVhdFile = NULL;
-	m_hPhysicalDrive = NULL;
-
 	ZeroMemory(&m_Foot, sizeof(VHD_FOOTER));
 	ZeroMemory(&m_Dyn, sizeof(VHD_DYNAMIC));
+	InitRestoreOptions(&m_Options);
+	m_nUnflushed = 0;
 
 	if(!OpenVhdFile(sPath))
 		return;
 
+	if(!(m_VhdFile.GetFlags() & BDEV_STREAM) && CVhdxFile::Probe(&m_VhdFile))
+	{
+		m_Vhdx.Open(&m_VhdFile);
+		return;
+	}
+
 	if(!ReadFooter())
 		return;
 
+	if(_byteswap_ulong(m_Foot.diskType) == VHD_TYPE_FIXED)
+		return;
+
 	if(!ReadDynHeader())
 		return;
 }
@@ -33,66 +141,63 @@ CVhdToDisk::CVhdToDisk(LPWSTR sPath)
 
 CVhdToDisk::~CVhdToDisk(void)
 {
-	if(m_hVhdFile)
+	if(m_VhdFile.IsOpen())
 		CloseVhdFile();
 
-	if(m_hPhysicalDrive)
+	if(m_PhysicalDrive.IsOpen())
 		ClosePhysicalDrive();
 }
 
-BOOL CVhdToDisk::OpenVhdFile(LPWSTR sPath)
+BOOL CVhdToDisk::OpenVhdFile(LPCPATH sPath)
 {
-	m_hVhdFile = CreateFile(sPath
-		, GENERIC_READ
-		, FILE_SHARE_READ
-		, NULL
-		, OPEN_EXISTING
-		, FILE_ATTRIBUTE_NORMAL
-		, NULL);
+	// "-" restores from standard input, read strictly front to back
+	if(sPath[0] == '-' && sPath[1] == 0)
+		return m_VhdFile.OpenStdin();
+
+	if(!m_VhdFile.Open(sPath, BDEV_READ | BDEV_OVERLAPPED))
+		return FALSE;
 
-	if(m_hVhdFile == INVALID_HANDLE_VALUE) return FALSE;
+	// anything that can't be mapped is simply read
+	if(m_Options.bMapImage)
+		m_Map.Open(&m_VhdFile, m_Options.bOffsetOrder);
 
 	return TRUE;
 }
 
 BOOL CVhdToDisk::CloseVhdFile()
 {
-	BOOL bReturn = TRUE;
-
-	if(m_hVhdFile != INVALID_HANDLE_VALUE)
-		bReturn = CloseHandle(m_hVhdFile);
-
-	m_hVhdFile = NULL;
-
-	return bReturn;
+	m_Map.Close();
+	return m_VhdFile.Close();
 }
 
-BOOL CVhdToDisk::OpenPhysicalDrive(LPWSTR sDrive)
+// Served from the mapping when the image is mapped and holds the whole range
+BOOL CVhdToDisk::ReadVhdAt(UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pRead)
 {
-	m_hPhysicalDrive = CreateFile(sDrive
-		, GENERIC_WRITE
-		, 0
-		, NULL
-		, OPEN_EXISTING
-		, FILE_FLAG_WRITE_THROUGH | FILE_FLAG_NO_BUFFERING
-		, NULL);
+	const BYTE* pView = m_Map.GetView(nOffset, nBytes);
 
-	if(m_hPhysicalDrive == INVALID_HANDLE_VALUE) return FALSE;
+	if(!pView)
+		return m_VhdFile.ReadAt(nOffset, pBuff, nBytes, pRead);
 
-	return TRUE;
+	memcpy(pBuff, pView, nBytes);
+	*pRead = nBytes;
 
+	return TRUE;
 }
 
-BOOL CVhdToDisk::ClosePhysicalDrive()
+BOOL CVhdToDisk::OpenPhysicalDrive(LPCPATH sDrive)
 {
-	BOOL bReturn = TRUE;
-
-	if(m_hPhysicalDrive != INVALID_HANDLE_VALUE)
-		bReturn = CloseHandle(m_hPhysicalDrive);
+	m_nUnflushed = 0;
 
-	m_hPhysicalDrive = NULL;
+	// delta restore reads the target back before writing
+	return m_PhysicalDrive.Open(sDrive
+		, BDEV_WRITE | BDEV_EXCLUSIVE | BDEV_NO_BUFFERING | BDEV_OVERLAPPED
+		| (m_Options.dwDurability == RESTORE_DURABLE_EACH ? BDEV_WRITE_THROUGH : 0)
+		| (m_Options.bDelta ? BDEV_READ : 0));
+}
 
-	return bReturn;
+BOOL CVhdToDisk::ClosePhysicalDrive()
+{
+	return m_PhysicalDrive.Close();
 }
 
 BOOL CVhdToDisk::ReadFooter()
@@ -100,13 +205,29 @@ BOOL CVhdToDisk::ReadFooter()
 	BOOL bReturn = FALSE;
 	DWORD dwByteRead = 0;
 
-	if(m_hVhdFile == INVALID_HANDLE_VALUE) return FALSE;
+	if(!m_VhdFile.IsOpen()) return FALSE;
 
-	bReturn = ReadFile(m_hVhdFile, &m_Foot, sizeof(VHD_FOOTER), &dwByteRead, 0);
+	// Dynamic disks carry a copy of the footer in front of the header, so
+	// a stream never has to look at its end
+	bReturn = ReadVhdAt(0, &m_Foot, sizeof(VHD_FOOTER), &dwByteRead);
 
 	if(bReturn)
 		bReturn = (sizeof(VHD_FOOTER) == dwByteRead);
 
+	// a fixed disk only has its footer at the end, after the raw data
+	if(bReturn && memcmp(m_Foot.cookie, "conectix", 8) != 0 && !(m_VhdFile.GetFlags() & BDEV_STREAM))
+	{
+		UINT64 nSize = m_VhdFile.GetSize();
+
+		bReturn = nSize >= sizeof(VHD_FOOTER)
+			&& ReadVhdAt(nSize - sizeof(VHD_FOOTER), &m_Foot, sizeof(VHD_FOOTER), &dwByteRead)
+			&& sizeof(VHD_FOOTER) == dwByteRead;
+	}
+
+	// a stream can't be rewound to try again, reject garbage right away
+	if(bReturn && (m_VhdFile.GetFlags() & BDEV_STREAM))
+		bReturn = (memcmp(m_Foot.cookie, "conectix", 8) == 0);
+
 	return bReturn;
 }
 
@@ -114,330 +235,1277 @@ BOOL CVhdToDisk::ReadDynHeader()
 {
 	BOOL bReturn = FALSE;
 	DWORD dwByteRead = 0;
-	LARGE_INTEGER filepointer;
-	filepointer.QuadPart = 512;
 
-	if(m_hVhdFile == INVALID_HANDLE_VALUE) return FALSE;
+	if(!m_VhdFile.IsOpen()) return FALSE;
 
-	SetFilePointerEx(m_hVhdFile, filepointer, NULL, FILE_BEGIN);
-
-	bReturn = ReadFile(m_hVhdFile, &m_Dyn, sizeof(VHD_DYNAMIC), &dwByteRead, 0);
+	bReturn = ReadVhdAt(512, &m_Dyn, sizeof(VHD_DYNAMIC), &dwByteRead);
 
 	if(bReturn)
 		bReturn = (sizeof(VHD_DYNAMIC) == dwByteRead);
 
+	if(bReturn && (m_VhdFile.GetFlags() & BDEV_STREAM))
+		bReturn = (memcmp(m_Dyn.cookie, "cxsparse", 8) == 0);
+
 	return bReturn;
 }
 
-BOOL CVhdToDisk::ParseFirstSector(HWND hDlg)
+BOOL CVhdToDisk::ReadFirstSector(BYTE* pSector)
 {
-	BOOL bReturn = FALSE;
-	DWORD dwBootSector = 0x00000000;
 	DWORD dwByteRead = 0;
-	WCHAR sTemp[64] = {0};
+	UINT32 bat0 = 0xFFFFFFFF;
+	UINT32 blockBitmapSectorCount = (_byteswap_ulong(m_Dyn.blockSize) / 512 / 8 + 511) / 512;
+
+	if(!m_VhdFile.IsOpen()) return FALSE;
+
+	if(m_Vhdx.IsOpen())
+		return m_Vhdx.ReadVirtual(0, pSector, 512);
+
+	if(_byteswap_ulong(m_Foot.diskType) == VHD_TYPE_FIXED)
+		return m_VhdFile.ReadAt(0, pSector, 512, &dwByteRead) && dwByteRead == 512;
+
+	if(!m_VhdFile.ReadAt(_byteswap_uint64(m_Dyn.tableOffset), &bat0, sizeof(bat0), &dwByteRead)
+		|| dwByteRead != sizeof(bat0))
+	{
+		TRACE("Failed to read the first BAT entry with error 0x%08X\n", m_VhdFile.GetLastError());
+		return FALSE;
+	}
+
+	// Unallocated first block reads back as zeroes
+	if(_byteswap_ulong(bat0) == 0xFFFFFFFF)
+	{
+		ZeroMemory(pSector, 512);
+		return TRUE;
+	}
+
+	UINT64 bo = _byteswap_ulong(bat0) * 512LL;
+
+	if(!m_VhdFile.ReadAt(bo + 512 * blockBitmapSectorCount, pSector, 512, &dwByteRead))
+		return FALSE;
+
+	return dwByteRead == 512;
+}
+
+// Counts a completed write to the target; with barriers on, flushes its cache
+// once enough has piled up. Writes still in flight go with the next barrier.
+BOOL CVhdToDisk::AddWritten(UINT64 nBytes)
+{
+	if(m_Options.dwDurability != RESTORE_DURABLE_BARRIER)
+		return TRUE;
+
+	m_nUnflushed += nBytes;
+	if(m_nUnflushed < m_Options.nBarrierBytes)
+		return TRUE;
+
+	m_nUnflushed = 0;
+
+	if(m_PhysicalDrive.Flush())
+		return TRUE;
+
+	TRACE("Failed to flush the target with error 0x%08X\n", m_PhysicalDrive.GetLastError());
+	return FALSE;
+}
+
+// Without write-through nothing is known to be on the medium until the
+// target's cache has been flushed: the restore only succeeds if that works.
+BOOL CVhdToDisk::FlushTarget(CProgressSink* pSink)
+{
+	if(m_Options.dwDurability == RESTORE_DURABLE_EACH)
+		return TRUE;
+
+	if(m_PhysicalDrive.Flush())
+		return TRUE;
+
+	TRACE("Failed to flush the target with error 0x%08X\n", m_PhysicalDrive.GetLastError());
+	pSink->Error("Can't flush the physical drive: the restored data may not all be on it.");
+	return FALSE;
+}
+
+// Discard or zero a range of the target, as dwEmptyBlocks asks
+BOOL CVhdToDisk::ClearRange(UINT64 nOffset, UINT64 nBytes)
+{
+	BOOL bDone = FALSE;
+
+	if(m_Options.dwEmptyBlocks == RESTORE_EMPTY_DISCARD)
+		bDone = m_PhysicalDrive.Discard(nOffset, nBytes);
+
+	if(!bDone)
+		bDone = m_PhysicalDrive.ZeroRange(nOffset, nBytes);
+
+	if(!bDone)
+		TRACE("Failed to clear %llu bytes at %llu with error 0x%08X\n", (unsigned long long)nBytes, (unsigned long long)nOffset, m_PhysicalDrive.GetLastError());
+
+	return bDone;
+}
+
+// Zero or discard the target under unallocated blocks, adjacent ones merged
+// into a single range. Done before any data is written so growing a target
+// file can't race with the queued writes.
+BOOL CVhdToDisk::ClearUnallocated(const BYTE* pAllocated, UINT32 nBlocks, UINT32 nBlockBytes, UINT64 nDiskBytes, CProgressSink* pSink)
+{
+	UINT64 diskSize = (nDiskBytes + 511) & ~511ULL;
+	UINT32 nRanges = 0;
+
+	pSink->Status("Clearing unallocated blocks...");
+
+	for(UINT32 b = 0; b < nBlocks; )
+	{
+		if(pAllocated[b])
+		{
+			b++;
+			continue;
+		}
+
+		UINT32 nRun = 1;
+		while(b + nRun < nBlocks && !pAllocated[b + nRun])
+			nRun++;
+
+		UINT64 nOffset = (UINT64)b * nBlockBytes;
+		UINT64 nBytes = (UINT64)nRun * nBlockBytes;
+		b += nRun;
+
+		if(nOffset >= diskSize)
+			break;
+		if(nOffset + nBytes > diskSize)
+			nBytes = diskSize - nOffset;
+
+		if(!ClearRange(nOffset, nBytes))
+		{
+			pSink->Error("Can't clear the unallocated blocks on the target drive.");
+			return FALSE;
+		}
+
+		nRanges++;
+	}
+
+	TRACE("%u unallocated ranges cleared\n", nRanges);
+
+	return TRUE;
+}
 
-	LARGE_INTEGER filepointer;
+BOOL CVhdToDisk::Dump(CProgressSink* pSink)
+{
+	BOOL bReturn = FALSE;
+	DWORD dwByteRead = 0;
+	UINT64 emptySectors = 0;
+	
+	UINT64 filepointer;
 	UINT32 blockBitmapSectorCount = (_byteswap_ulong(m_Dyn.blockSize) / 512 / 8 + 511) / 512;
 	UINT32 sectorsPerBlock = _byteswap_ulong(m_Dyn.blockSize) / 512;
 	UINT32 bats = _byteswap_ulong(m_Dyn.maxTableEntries);
+	UINT64 diskSectors = (_byteswap_uint64(m_Foot.currentSize) + 511) / 512;
 
-	filepointer.QuadPart = _byteswap_uint64(m_Dyn.tableOffset);
+	UINT32 b = 0;
+	UINT32 nAllocated = 0;
 
-	UINT8* bitmap = new UINT8[blockBitmapSectorCount * 512];
-	if(!bitmap) goto clean;
+	BLOCK_ENTRY* pSchedule = NULL;
+	BYTE* pAllocated = NULL;
+	UINT32* pBatCopy = NULL;
+	UINT64 nBatAfter = 0;
+	
+	filepointer = _byteswap_uint64(m_Dyn.tableOffset);
 
-	UINT32* bat = new UINT32[bats * 4];
-	if(!bat) goto clean;
+	// A VHD captured to a pipe has its BAT after the data, and in front, where
+	// the BAT usually is, the place each block may take in the stream
+	if((m_VhdFile.GetFlags() & BDEV_STREAM) && filepointer > 1536)
+	{
+		nBatAfter = filepointer;
+		filepointer = 1536;
+	}
 
-	BYTE* pBuff = new BYTE[512 * sectorsPerBlock];
-	if(!pBuff) goto clean;
+	// a mapped BAT is used in place
+	const UINT32* bat = (const UINT32*)m_Map.GetView(filepointer, bats * sizeof(UINT32));
 
+	if(!bat)
+	{
+		pBatCopy = new UINT32[bats];
+		bat = pBatCopy;
 
-	if(!SetFilePointerEx(m_hVhdFile, filepointer, NULL, FILE_BEGIN))
+		if(!m_VhdFile.ReadAt(filepointer, pBatCopy, bats * sizeof(*bat), &dwByteRead) || dwByteRead != bats * sizeof(*bat))
+		{
+			TRACE("Failed to ReadFile(%p, %p, %d,...) with error 0x%08X\n", &m_VhdFile, pBatCopy, bats * 4, m_VhdFile.GetLastError());
+			
+			goto clean;
+		}
+	}
+
+	pSchedule = new BLOCK_ENTRY[bats];
+	pAllocated = new BYTE[bats];
+
+	for(b = 0; b < bats; b++)
 	{
-		TRACE("Failed to SetFilePointer(0x%08X, %lld, 0, FILE_BEGIN)\n", m_hVhdFile, filepointer.QuadPart);
+		pAllocated[b] = (_byteswap_ulong(bat[b]) != 0xFFFFFFFF);
+
+		if(!pAllocated[b])
+		{
+			emptySectors += sectorsPerBlock;
+			continue;
+		}
+
+		// anything else up front can't be followed without going back
+		if(nBatAfter && (_byteswap_ulong(bat[b]) * 512ULL < 1536 + (UINT64)bats * 4
+			|| _byteswap_ulong(bat[b]) * 512ULL + (blockBitmapSectorCount + sectorsPerBlock) * 512ULL > nBatAfter))
+		{
+			pSink->Error("The BAT of this VHD comes after its data and can't be read from a stream.\n"
+							"Save it to a file first.");
+			goto clean;
+		}
+
+		pSchedule[nAllocated].nSector = _byteswap_ulong(bat[b]);
+		pSchedule[nAllocated].nBlock = b;
+		nAllocated++;
+	}
+
+	if(m_Options.dwEmptyBlocks != RESTORE_EMPTY_KEEP
+		&& !ClearUnallocated(pAllocated, bats, sectorsPerBlock * 512, _byteswap_uint64(m_Foot.currentSize), pSink))
 		goto clean;
+
+	bReturn = DumpBlocks(pSchedule, nAllocated, blockBitmapSectorCount, sectorsPerBlock, diskSectors, emptySectors, pSink);
+
+clean:
+
+	if(pSchedule) delete[] pSchedule;
+	if(pAllocated) delete[] pAllocated;
+	if(pBatCopy) delete[] pBatCopy;
+
+	return bReturn;
+}
+
+// Streams the scheduled blocks onto the target: blocks stored back to back are
+// read as one extent, bitmaps (if any) put aside, then written as one request
+// per run of consecutive virtual sectors
+BOOL CVhdToDisk::DumpBlocks(BLOCK_ENTRY* pSchedule, UINT32 nAllocated, UINT32 nBitmapSectors, UINT32 nSectorsPerBlock
+	, UINT64 nDiskSectors, UINT64 nEmptySectors, CProgressSink* pSink)
+{
+	BOOL bReturn = FALSE;
+	UINT64 emptySectors = nEmptySectors;
+	UINT64 usedSectors = 0;
+	UINT64 usedZeroes = 0;
+	UINT64 nUnchanged = 0;
+	UINT64 nBytesWritten = 0;
+
+	UINT32 nDepth = m_Options.nQueueDepth ? m_Options.nQueueDepth : 1;
+	// a VHDX keeps no per-block bitmap outside differencing disks
+	BOOL bUseBitmap = m_Options.bUseBitmap && nBitmapSectors;
+
+	UINT32 bitmapBytes = 512 * nBitmapSectors;
+	UINT32 blockBytes = 512 * nSectorsPerBlock;
+	UINT32 nSegments = bitmapBytes ? 2 : 1;
+	// file distance between two blocks stored back to back
+	UINT32 nStride = nBitmapSectors + nSectorsPerBlock;
+	UINT32 nMaxBlocks = m_Options.nMaxExtent / blockBytes;
+	UINT32 nMaxWrites;
+
+	UINT64 nLastSector = 0;
+	UINT32 nNext = 0;
+	UINT32 nWritten = 0;
+	UINT32 nReads = 0;
+	UINT32 nFree = 0;
+	BOOL bFailed = FALSE;
+	BOOL bStream = (m_VhdFile.GetFlags() & BDEV_STREAM) != 0;
+	IO_REQUEST* pReady = NULL;
+
+	// Extents can be written straight out of a mapped image as long as nothing
+	// has to be changed or compared in place, and every block's data lands on
+	// an aligned address; the others are copied out of it
+	BOOL bMapped = m_Map.IsOpen() && !m_Options.bDelta
+		&& !(m_Vhdx.IsOpen() && m_Vhdx.GetLogEntries());
+
+	CIoQueue* pQueue = NULL;
+	RESTORE_SLOT** ppFree = NULL;
+	RESTORE_SLOT* pSlots = NULL;
+
+	if(nMaxBlocks < 1) nMaxBlocks = 1;
+	// keep a whole extent read within a DWORD
+	if(nMaxBlocks > 0x40000000 / (bitmapBytes + blockBytes))
+		nMaxBlocks = 0x40000000 / (bitmapBytes + blockBytes);
+
+	for(UINT32 i = 0; i < nAllocated; i++)
+		if(pSchedule[i].nSector > nLastSector)
+			nLastSector = pSchedule[i].nSector;
+
+	// Blocks sit in the file in allocation order, not in BAT order. Reading them by
+	// file offset turns the VHD side into one forward sweep; the writes scatter instead.
+	// A stream can only be read that way.
+	if(m_Options.bOffsetOrder || bStream)
+		qsort(pSchedule, nAllocated, sizeof(BLOCK_ENTRY), CompareFileOffset);
+
+	// no point in buffers bigger than the whole image
+	if(nMaxBlocks > nAllocated) nMaxBlocks = nAllocated ? nAllocated : 1;
+
+	// worst case with a bitmap: every other sector used
+	nMaxWrites = bUseBitmap ? nMaxBlocks * (nSectorsPerBlock / 2 + 1) : nMaxBlocks;
+
+	pQueue = CIoQueue::Create(nDepth);
+	if(!pQueue) goto clean;
+
+	pSlots = new RESTORE_SLOT[nDepth];
+	ppFree = new RESTORE_SLOT*[nDepth];
+	ZeroMemory(pSlots, nDepth * sizeof(RESTORE_SLOT));
+
+	for(UINT32 i = 0; i < nDepth; i++)
+	{
+		pSlots[i].pData = (BYTE*)AllocAligned((size_t)nMaxBlocks * blockBytes);
+		if(!pSlots[i].pData) goto clean;
+
+		if(m_Options.bDelta)
+		{
+			pSlots[i].pCompare = (BYTE*)AllocAligned((size_t)nMaxBlocks * blockBytes);
+			if(!pSlots[i].pCompare) goto clean;
+		}
+
+		pSlots[i].pBitmaps = new BYTE[nMaxBlocks * bitmapBytes];
+		pSlots[i].pSegments = new IO_SEGMENT[nSegments * nMaxBlocks];
+		pSlots[i].pWrites = new IO_REQUEST[nMaxWrites];
+		ZeroMemory(pSlots[i].pWrites, nMaxWrites * sizeof(IO_REQUEST));
+
+		pSlots[i].read.pContext = &pSlots[i];
+		for(UINT32 j = 0; j < nMaxWrites; j++)
+			pSlots[i].pWrites[j].pContext = &pSlots[i];
+
+		ppFree[nFree++] = &pSlots[i];
 	}
 
-	if(!ReadFile(m_hVhdFile, bat, bats * sizeof(*bat), &dwByteRead, 0))
 	{
-		TRACE("Failed to ReadFile(0x%08X, 0x%08X, %d,...) with error 0x%08X\n", m_hVhdFile, bat, bats * 4, GetLastError());
+		// writes go out of pData, pinned once where the backend can
+		IO_SEGMENT* pFixed = new IO_SEGMENT[nDepth];
 
-		goto clean;
+		for(UINT32 i = 0; i < nDepth; i++)
+		{
+			pFixed[i].pBuff = pSlots[i].pData;
+			pFixed[i].nBytes = (DWORD)((size_t)nMaxBlocks * blockBytes);
+		}
+
+		pQueue->RegisterBuffers(pFixed, nDepth);
+		delete[] pFixed;
 	}
 
-	UINT32 b = 0;
-	UINT64 bo = _byteswap_ulong(bat[b]) * 512LL;
+	pSink->Status("Start dumping...");
+	pSink->Progress(0, nAllocated);
 
-	filepointer.QuadPart = bo;
+	for(;;)
+	{
+		// keep up to nDepth extents in flight
+		while(!bFailed && nFree && nNext < nAllocated)
+		{
+			RESTORE_SLOT* pSlot = ppFree[--nFree];
+			UINT32 n = 1;
+			BOOL bAligned = IsMapAligned(pSchedule[nNext].nSector, bitmapBytes);
+
+			// grow the extent while the next block follows in the file; mapped,
+			// it also ends where block data goes from page aligned to not or
+			// back, so aligned runs are written out of the mapping
+			while(n < nMaxBlocks && nNext + n < nAllocated
+				&& pSchedule[nNext + n].nSector == pSchedule[nNext + n - 1].nSector + nStride
+				&& (!m_Map.IsOpen() || IsMapAligned(pSchedule[nNext + n].nSector, bitmapBytes) == bAligned))
+				n++;
+
+			pSlot->nFirst = nNext;
+			pSlot->nBlocks = n;
+
+			// bitmaps go aside, block data is gathered back to back
+			for(UINT32 i = 0; i < n; i++)
+			{
+				IO_SEGMENT* pSeg = &pSlot->pSegments[nSegments * i];
 
-	bReturn = SetFilePointerEx(m_hVhdFile, filepointer, NULL, FILE_BEGIN);
-	if(!bReturn) goto clean;
+				if(bitmapBytes)
+				{
+					pSeg->pBuff = pSlot->pBitmaps + i * bitmapBytes;
+					pSeg->nBytes = bitmapBytes;
+					pSeg++;
+				}
 
-	bReturn = ReadFile(m_hVhdFile, bitmap, 512 * blockBitmapSectorCount, &dwByteRead, 0);
-		if(!bReturn) goto clean;
+				pSeg->pBuff = pSlot->pData + (size_t)i * blockBytes;
+				pSeg->nBytes = blockBytes;
+			}
 
-	filepointer.QuadPart = bo + 512 * blockBitmapSectorCount;
+			pSlot->read.dwOp = IOQ_READ;
+			pSlot->read.pDevice = &m_VhdFile;
+			pSlot->read.nOffset = pSchedule[nNext].nSector * 512LL;
+			pSlot->read.pBuff = NULL;
+			pSlot->read.nBytes = n * (bitmapBytes + blockBytes);
+			pSlot->read.pSegments = pSlot->pSegments;
+			pSlot->read.nSegments = nSegments * n;
 
-	bReturn = SetFilePointerEx(m_hVhdFile, filepointer, NULL, FILE_BEGIN);
-	if(!bReturn) goto clean;
+			nNext += n;
 
-	bReturn = ReadFile(m_hVhdFile, pBuff, 512 * sectorsPerBlock, &dwByteRead, 0);
-	if(!bReturn) goto clean;
+			pSlot->pView = NULL;
+			if(bMapped && bAligned)
+				pSlot->pView = m_Map.GetView(pSlot->read.nOffset, pSlot->read.nBytes);
 
-	dwBootSector = ((DWORD)pBuff[510]) << 8;
-	dwBootSector += ((BYTE)pBuff[511]);
+			if(pSlot->pView)
+			{
+				// nothing to read, the writes go out of the mapping
+				pSlot->read.bSuccess = TRUE;
+				pSlot->read.nDone = pSlot->read.nBytes;
+				pSlot->read.dwError = 0;
+				pReady = &pSlot->read;
+				break;
+			}
+
+			const BYTE* pMapped = m_Map.GetView(pSlot->read.nOffset, pSlot->read.nBytes);
+
+			if(pMapped)
+			{
+				// unaligned data is copied out of the mapping, no read either
+				for(UINT32 i = 0; i < pSlot->read.nSegments; i++)
+				{
+					memcpy(pSlot->read.pSegments[i].pBuff, pMapped, pSlot->read.pSegments[i].nBytes);
+					pMapped += pSlot->read.pSegments[i].nBytes;
+				}
 
-	int nItem = 0;
+				pSlot->read.bSuccess = TRUE;
+				pSlot->read.nDone = pSlot->read.nBytes;
+				pSlot->read.dwError = 0;
+				pReady = &pSlot->read;
+				break;
+			}
 
-	ListView_DeleteAllItems(GetDlgItem(hDlg, IDC_LIST_VOLUME));
+			nReads++;
 
-	if(dwBootSector == 0x000055AA)
-	{
-		int nPartitions = 1;
-		DWORD dwOffset = 0x1be;
-		HWND hwdListCtrl = GetDlgItem(hDlg, IDC_LIST_VOLUME);
-		if(!hwdListCtrl) goto clean;
-		while(dwOffset < 0x1fe)
+			if(bStream)
+			{
+				// forward-only source: read inline, the writes still run behind it
+				pSlot->read.bSuccess = m_VhdFile.ReadV(pSlot->read.nOffset, pSlot->read.pSegments
+					, pSlot->read.nSegments, &pSlot->read.nDone);
+				pSlot->read.dwError = pSlot->read.bSuccess ? 0 : m_VhdFile.GetLastError();
+				pReady = &pSlot->read;
+				break;
+			}
+
+			if(!pQueue->Submit(&pSlot->read))
+			{
+				ppFree[nFree++] = pSlot;
+				bFailed = TRUE;
+				break;
+			}
+		}
+
+		IO_REQUEST* pReq = pReady ? pReady : pQueue->WaitCompletion();
+		if(!pReq) break;
+
+		if(pReq->dwOp == IOQ_WRITE && pReq->bSuccess && !bFailed && !AddWritten(pReq->nDone))
 		{
-			if(pBuff[dwOffset + 4] != 0x00)
+			pSink->Error("Can't flush the physical drive.");
+			bFailed = TRUE;
+		}
+
+		pReady = NULL;
+
+		RESTORE_SLOT* pSlot = (RESTORE_SLOT*)pReq->pContext;
+
+		if(pReq->dwOp == IOQ_READ && pReq != &pSlot->read)
+		{
+			// delta: the target range is in, write it only if it differs
+			BYTE* pData = pSlot->pData + ((BYTE*)pReq->pBuff - pSlot->pCompare);
+
+			if(!bFailed && pReq->bSuccess && pReq->nDone == pReq->nBytes
+				&& memcmp(pReq->pBuff, pData, pReq->nBytes) == 0)
+			{
+				nUnchanged += pReq->nBytes;
+			}
+			else if(!bFailed)
+			{
+				// unreadable or short target ranges are simply rewritten
+				pReq->dwOp = IOQ_WRITE;
+				pReq->pBuff = pData;
+
+				if(pQueue->Submit(pReq))
+					continue;
+
+				bFailed = TRUE;
+			}
+
+			if(--pSlot->nPending)
+				continue;
+		}
+		else
+		{
+			if(pReq->bSuccess && pReq == &pSlot->read && pReq->nDone < pReq->nBytes
+				&& pSchedule[pSlot->nFirst + pSlot->nBlocks - 1].nSector == nLastSector)
+			{
+				// the last block of a VHD may be stored short, anything else is truncation
+				ZeroFillShortRead(pReq);
+			}
+
+			if(!pReq->bSuccess || pReq->nDone != pReq->nBytes)
+			{
+				if(pReq->dwOp == IOQ_WRITE && !bFailed)
+				{
+					pSink->Error("Can't write on physical drive. It's probably mounted.\n"
+									"You need to put it off line before to be able to write on it.\n"
+									"Microsoft choose this way for security reason...\n"
+									"It's nice for us and avoid to overwrite a non wanted drive.");
+				}
+
+				TRACE("I/O failed at %llu with error 0x%08X\n", (unsigned long long)pReq->nOffset, pReq->dwError);
+
+				bFailed = TRUE;
+				if(pReq == &pSlot->read || --pSlot->nPending == 0)
+					ppFree[nFree++] = pSlot;
+				continue;
+			}
+
+			if(pReq == &pSlot->read)
+			{
+				if(bFailed)
+				{
+					ppFree[nFree++] = pSlot;
+					continue;
+				}
+
+				const BLOCK_ENTRY* pEntry = pSchedule + pSlot->nFirst;
+
+				// VHDX: no bitmaps, the extent is all in pData
+				if(m_Vhdx.IsOpen() && !pSlot->pView)
+					m_Vhdx.ApplyLog(pReq->nOffset, pSlot->pData, pReq->nBytes);
+
+				pSlot->nWrites = 0;
+				pSlot->nPending = 0;
+
+				// one write per run of consecutive virtual sectors, across blocks
+				// unless each block is compared on its own
+				for(UINT32 i = 0; i < pSlot->nBlocks; i++)
+				{
+					UINT64 nFirst = (UINT64)pEntry[i].nBlock * nSectorsPerBlock;
+					BYTE* pBlock = pSlot->pData + (size_t)i * blockBytes;
+					const BYTE* pBitmap = pSlot->pBitmaps + i * bitmapBytes;
+
+					if(pSlot->pView)
+					{
+						// only ever written from, never into
+						pBitmap = pSlot->pView + (size_t)i * nStride * 512;
+						pBlock = (BYTE*)pBitmap + bitmapBytes;
+					}
+
+					// the last block may run past the end of the virtual disk
+					UINT32 nSectors = nSectorsPerBlock;
+					if(nFirst >= nDiskSectors)
+						continue;
+					if(nFirst + nSectors > nDiskSectors)
+						nSectors = (UINT32)(nDiskSectors - nFirst);
+
+					if(!bUseBitmap)
+					{
+						AddWriteRun(pSlot, &m_PhysicalDrive, nFirst, nSectors, pBlock, !m_Options.bDelta);
+						continue;
+					}
+
+					for(UINT32 s = 0; s < nSectors; )
+					{
+						if((pBitmap[s / 8] & (1 << (7 - s % 8))) == 0)
+						{
+							UINT32 nClear = 1;
+							while(s + nClear < nSectors && (pBitmap[(s + nClear) / 8] & (1 << (7 - (s + nClear) % 8))) == 0)
+								nClear++;
+
+							emptySectors += nClear;
+
+							// unused sectors are cleared like unallocated blocks
+							if(m_Options.dwEmptyBlocks != RESTORE_EMPTY_KEEP
+								&& !ClearRange((nFirst + s) * 512, (UINT64)nClear * 512))
+							{
+								pSink->Error("Can't clear the unused sectors on the target drive.");
+								bFailed = TRUE;
+								break;
+							}
+
+							s += nClear;
+							continue;
+						}
+
+						UINT32 nRun = 0;
+						for(; s + nRun < nSectors; nRun++)
+						{
+							UINT32 k = s + nRun;
+							if((pBitmap[k / 8] & (1 << (7 - k % 8))) == 0)
+								break;
+
+							usedSectors++;
+							if(IsZeroBlock(pBlock + k * 512, 512))
+								usedZeroes++;
+						}
+
+						AddWriteRun(pSlot, &m_PhysicalDrive, nFirst + s, nRun, pBlock + s * 512, !m_Options.bDelta);
+						s += nRun;
+					}
+				}
+
+				for(UINT32 i = 0; i < pSlot->nWrites && !bFailed; i++)
+				{
+					IO_REQUEST* pWrite = &pSlot->pWrites[i];
+
+					// delta: read the target range back first
+					if(m_Options.bDelta)
+					{
+						pWrite->dwOp = IOQ_READ;
+						pWrite->pBuff = pSlot->pCompare + ((BYTE*)pWrite->pBuff - pSlot->pData);
+					}
+
+					if(!pQueue->Submit(pWrite))
+					{
+						bFailed = TRUE;
+						break;
+					}
+					pSlot->nPending++;
+				}
+
+				if(pSlot->nPending)
+					continue;
+
+				if(bFailed)
+				{
+					ppFree[nFree++] = pSlot;
+					continue;
+				}
+
+				// nothing inside the virtual disk, fall through as written
+			}
+			else
 			{
-				LVITEM item;
-				item.mask = LVIF_TEXT;
-				item.iItem = nItem;
-				item.iSubItem = 0;
-				if(pBuff[dwOffset] == 0x80 )
-					item.pszText =  L"Y";
-				else 
-					item.pszText =  L"N";
-
-				ListView_InsertItem(hwdListCtrl, &item);
-
-				// TYPE (FS)
-				if(pBuff[dwOffset + 4] == 0x07)
-					wsprintf(sTemp, L"NTFS");
-				else
-					wsprintf(sTemp, L"0x%02X", pBuff[dwOffset + 4]);
-				
-				item.iSubItem = 1;
-				item.pszText =  sTemp;
-				item.cchTextMax = wcslen(sTemp) + 1;
-				ListView_SetItem(hwdListCtrl, &item);
-
-				wsprintf(sTemp, L"0x%02X%02X%02X%02X"
-					, pBuff[dwOffset + 15]
-				, pBuff[dwOffset + 14]
-				, pBuff[dwOffset + 13]
-				, pBuff[dwOffset + 12]);
-
-				item.iSubItem = 2;
-				item.pszText =  sTemp;
-				item.cchTextMax = wcslen(sTemp) + 1;
-
-				ListView_SetItem(hwdListCtrl, &item);
-
-				// Cylinder-head-sector address of the first sector in the partition
-				wsprintf(sTemp, L"0x%02X 0x%02X 0x%02X"
-								, pBuff[dwOffset + 1]
-								, pBuff[dwOffset + 2]
-								, pBuff[dwOffset + 3]);
-
-				item.mask = LVIF_TEXT;
-				item.iItem = nItem;
-				item.iSubItem = 3;
-				item.pszText =  sTemp;
-				item.cchTextMax = wcslen(sTemp) + 1;
-
-				ListView_SetItem(hwdListCtrl, &item);
-
-
-				wsprintf(sTemp, L"0x%02X 0x%02X 0x%02X"
-								, pBuff[dwOffset + 5]
-								, pBuff[dwOffset + 6]
-								, pBuff[dwOffset + 7]);
-
-				item.mask = LVIF_TEXT;
-				item.iItem = nItem;
-				item.iSubItem = 4;
-				item.pszText =  sTemp;
-				item.cchTextMax = wcslen(sTemp) + 1;
-				ListView_SetItem(hwdListCtrl, &item);
-
-				nItem++;
+				nBytesWritten += pReq->nBytes;
+
+				if(--pSlot->nPending)
+					continue;
 			}
-			dwOffset+= 0x10;
+		}
+
+		ppFree[nFree++] = pSlot;
+
+		if(bFailed)
+			continue;
+
+		nWritten += pSlot->nBlocks;
+
+		if(nWritten / 100 != (nWritten - pSlot->nBlocks) / 100)
+		{
+			char sText[256] = {0};
+			snprintf(sText, sizeof(sText), "dumping blocks... %u/%u", nWritten, nAllocated);
+
+			pSink->Status(sText);
+			pSink->Progress(nWritten, nAllocated);
 		}
 	}
 
+	bReturn = !bFailed;
+
+	if(bReturn)
+		pSink->Progress(nAllocated, nAllocated);
+
+	TRACE("%u blocks in %u reads\n", nAllocated, nReads);
+
+	if(bReturn && bUseBitmap)
+	{
+		char sText[256] = {0};
+		snprintf(sText, sizeof(sText), "%llu used sectors (%llu zero-filled), %llu empty sectors skipped"
+			, (unsigned long long)usedSectors, (unsigned long long)usedZeroes, (unsigned long long)emptySectors);
+
+		pSink->Status(sText);
+	}
+
+	if(bReturn && m_Options.bDelta)
+	{
+		char sText[256] = {0};
+		snprintf(sText, sizeof(sText), "%llu MB already up to date, %llu MB written"
+			, (unsigned long long)(nUnchanged >> 20), (unsigned long long)(nBytesWritten >> 20));
+
+		pSink->Status(sText);
+	}
+
 clean:
 
-	if(bitmap) delete[] bitmap;
-	if(bat) delete[] bat;
-	if(pBuff) delete[] pBuff;
+	if(pQueue) delete pQueue;
+
+	if(pSlots)
+	{
+		for(UINT32 i = 0; i < nDepth; i++)
+		{
+			if(pSlots[i].pData) FreeAligned(pSlots[i].pData);
+			if(pSlots[i].pCompare) FreeAligned(pSlots[i].pCompare);
+			if(pSlots[i].pBitmaps) delete[] pSlots[i].pBitmaps;
+			if(pSlots[i].pSegments) delete[] pSlots[i].pSegments;
+			if(pSlots[i].pWrites) delete[] pSlots[i].pWrites;
+		}
+		delete[] pSlots;
+	}
+
+	if(ppFree) delete[] ppFree;
 
 	return bReturn;
 }
 
-BOOL CVhdToDisk::Dump(HWND phWnd)
+// VHDX: fully present payload blocks go through the same extent pipeline as
+// a dynamic VHD, without bitmaps; every other block state reads as zeroes
+BOOL CVhdToDisk::DumpVhdx(CProgressSink* pSink)
 {
 	BOOL bReturn = FALSE;
-	DWORD dwByteRead = 0;
-	UINT32 emptySectors = 0;
-	UINT32 usedSectors = 0;
-	UINT32 usedZeroes = 0;
-	
-	LARGE_INTEGER filepointer;
-	UINT32 blockBitmapSectorCount = (_byteswap_ulong(m_Dyn.blockSize) / 512 / 8 + 511) / 512;
-	UINT32 sectorsPerBlock = _byteswap_ulong(m_Dyn.blockSize) / 512;
-	UINT32 bats = _byteswap_ulong(m_Dyn.maxTableEntries);
-	
-	filepointer.QuadPart = _byteswap_uint64(m_Dyn.tableOffset);
+	UINT32 nBlocks = m_Vhdx.GetBlockCount();
+	UINT32 sectorsPerBlock = m_Vhdx.GetBlockSize() / 512;
+	UINT64 diskSectors = m_Vhdx.GetVirtualSize() / 512;
+	UINT64 emptySectors = 0;
+	UINT32 nAllocated = 0;
 
-	UINT8* bitmap = new UINT8[blockBitmapSectorCount * 512];
-	if(!bitmap) goto clean;
+	BLOCK_ENTRY* pSchedule = new BLOCK_ENTRY[nBlocks];
+	BYTE* pAllocated = new BYTE[nBlocks];
 
-	UINT32* bat = new UINT32[bats * 4];
-	if(!bat) goto clean;
-	
-	char* pBuff = new char[512 * sectorsPerBlock];
-	if(!pBuff) goto clean;
+	TRACE("VHDX: %u blocks of %u bytes, %u byte sectors, %u log entries replayed\n"
+		, nBlocks, m_Vhdx.GetBlockSize(), m_Vhdx.GetLogicalSectorSize(), m_Vhdx.GetLogEntries());
 
-	
-	if(!SetFilePointerEx(m_hVhdFile, filepointer, NULL, FILE_BEGIN))
+	for(UINT32 b = 0; b < nBlocks; b++)
 	{
-		TRACE("Failed to SetFilePointer(0x%08X, %lld, 0, FILE_BEGIN)\n", m_hVhdFile, filepointer.QuadPart);
+		pAllocated[b] = (m_Vhdx.GetBlockState(b) == VHDX_BLOCK_FULLY_PRESENT);
+
+		if(!pAllocated[b])
+		{
+			emptySectors += sectorsPerBlock;
+			continue;
+		}
+
+		pSchedule[nAllocated].nSector = m_Vhdx.GetBlockOffset(b) / 512;
+		pSchedule[nAllocated].nBlock = b;
+		nAllocated++;
+	}
+
+	if(m_Options.dwEmptyBlocks != RESTORE_EMPTY_KEEP
+		&& !ClearUnallocated(pAllocated, nBlocks, m_Vhdx.GetBlockSize(), m_Vhdx.GetVirtualSize(), pSink))
 		goto clean;
+
+	bReturn = DumpBlocks(pSchedule, nAllocated, 0, sectorsPerBlock, diskSectors, emptySectors, pSink);
+
+clean:
+
+	delete[] pSchedule;
+	delete[] pAllocated;
+
+	return bReturn;
+}
+
+// One chunk of a fixed VHD on its way to the target
+typedef struct _FIXED_SLOT
+{
+	IO_REQUEST	req;
+	BYTE*		pBuff;		// 4K aligned for the unbuffered target
+	BYTE*		pCompare;	// delta restore: target contents
+	const BYTE*	pData;		// chunk to write, pBuff or a mapped view
+	DWORD		nBytes;		// chunk size rounded up to a whole sector
+} FIXED_SLOT;
+
+// A fixed VHD is the raw disk followed by its footer: one sequential copy
+// through the queue in nMaxExtent chunks, reads running ahead of the writes.
+// A delta restore reads each chunk back from the target and writes it only
+// if it differs.
+BOOL CVhdToDisk::DumpFixed(CProgressSink* pSink)
+{
+	BOOL bReturn = FALSE;
+	BOOL bFailed = FALSE;
+	UINT64 diskSize = _byteswap_uint64(m_Foot.currentSize);
+	UINT32 nDepth = m_Options.nQueueDepth ? m_Options.nQueueDepth : 1;
+	UINT32 nChunk = m_Options.nMaxExtent & ~4095U;
+	UINT64 nNext = 0;
+	UINT64 nDone = 0;
+	UINT64 nUnchanged = 0;
+	UINT64 nBytesWritten = 0;
+	UINT32 nFree = 0;
+
+	CIoQueue* pQueue = NULL;
+	FIXED_SLOT* pSlots = NULL;
+	FIXED_SLOT** ppFree = NULL;
+
+	if(nChunk < 1024 * 1024) nChunk = 1024 * 1024;
+	if(diskSize < (UINT64)nChunk * nDepth)
+	{
+		// small disk: don't allocate more than it takes
+		nChunk = (UINT32)(((diskSize + nDepth - 1) / nDepth + 4095) & ~4095ULL);
+		if(!nChunk) nChunk = 4096;
 	}
-	
-	if(!ReadFile(m_hVhdFile, bat, bats * sizeof(*bat), &dwByteRead, 0))
+
+	pQueue = CIoQueue::Create(nDepth);
+	if(!pQueue) goto clean;
+
+	pSlots = new FIXED_SLOT[nDepth];
+	ppFree = new FIXED_SLOT*[nDepth];
+	ZeroMemory(pSlots, nDepth * sizeof(FIXED_SLOT));
+
+	for(UINT32 i = 0; i < nDepth; i++)
 	{
-		TRACE("Failed to ReadFile(0x%08X, 0x%08X, %d,...) with error 0x%08X\n", m_hVhdFile, bat, bats * 4, GetLastError());
-		
-		goto clean;
+		pSlots[i].pBuff = (BYTE*)AllocAligned(nChunk);
+		if(!pSlots[i].pBuff) goto clean;
+
+		if(m_Options.bDelta)
+		{
+			pSlots[i].pCompare = (BYTE*)AllocAligned(nChunk);
+			if(!pSlots[i].pCompare) goto clean;
+		}
+
+		pSlots[i].req.pContext = &pSlots[i];
+		ppFree[nFree++] = &pSlots[i];
 	}
 
-	SendMessage(phWnd, MYWM_UPDATE_STATUS, (WPARAM)L"Start dumping...", 0);
-	SendMessage(GetDlgItem(phWnd, IDC_PROGRESS_DUMP), PBM_SETRANGE32, 0, (LPARAM)bats / 100);
-		
-	for(UINT32 b = 0; b < bats; b++)
+	pSink->Status("Start dumping...");
+	pSink->Progress(0, diskSize);
+
+	for(;;)
 	{
-		if((b + 1) % 100 == 0)
+		while(!bFailed && nFree && nNext < diskSize)
 		{
-			WCHAR sText[256] = {0};
-			wsprintf(sText, L"dumping blocks... %d/%d", b + 1, bats);
+			FIXED_SLOT* pSlot = ppFree[--nFree];
+			IO_REQUEST* pReq = &pSlot->req;
+			DWORD nBytes = (diskSize - nNext) < nChunk ? (DWORD)(diskSize - nNext) : nChunk;
+
+			pReq->dwOp = IOQ_READ;
+			pReq->pDevice = &m_VhdFile;
+			pReq->nOffset = nNext;
+			pReq->pBuff = pSlot->pBuff;
+			pReq->nBytes = nBytes;
+
+			// raw data at its disk offset: a mapped chunk needs no reading, but
+			// not a tail that would need padding (the footer follows it)
+			pSlot->pData = (nBytes % 512) ? NULL : m_Map.GetView(nNext, nBytes);
+			pSlot->nBytes = nBytes;
+
+			if(pSlot->pData)
+			{
+				pReq->dwOp = m_Options.bDelta ? IOQ_READ : IOQ_WRITE;
+				pReq->pDevice = &m_PhysicalDrive;
+				pReq->pBuff = m_Options.bDelta ? pSlot->pCompare : (void*)pSlot->pData;
+			}
 
-			SendMessage(phWnd, MYWM_UPDATE_STATUS, (WPARAM)sText, 0);
-			SendMessage(GetDlgItem(phWnd, IDC_PROGRESS_DUMP), PBM_SETPOS, (LPARAM)(b + 1) / 100, 0);
+			if(!pQueue->Submit(pReq))
+			{
+				ppFree[nFree++] = pSlot;
+				bFailed = TRUE;
+				break;
+			}
 
+			nNext += nBytes;
 		}
 
-		
-		if(_byteswap_ulong(bat[b]) == 0xFFFFFFFF)
+		IO_REQUEST* pReq = pQueue->WaitCompletion();
+		if(!pReq) break;
+
+		FIXED_SLOT* pSlot = (FIXED_SLOT*)pReq->pContext;
+
+		if(pReq->dwOp == IOQ_WRITE && pReq->bSuccess && !bFailed && !AddWritten(pReq->nDone))
 		{
-			emptySectors += sectorsPerBlock;
+			pSink->Error("Can't flush the physical drive.");
+			bFailed = TRUE;
+		}
+
+		if(pReq->dwOp == IOQ_READ && pReq->pDevice == &m_PhysicalDrive)
+		{
+			// delta: the target chunk is in, write it only if it differs
+			if(!bFailed && pReq->bSuccess && pReq->nDone == pReq->nBytes
+				&& memcmp(pSlot->pCompare, pSlot->pData, pSlot->nBytes) == 0)
+			{
+				nUnchanged += pSlot->nBytes;
+			}
+			else if(!bFailed)
+			{
+				// unreadable or short target ranges are simply rewritten
+				pReq->dwOp = IOQ_WRITE;
+				pReq->pBuff = (void*)pSlot->pData;
+
+				if(pQueue->Submit(pReq))
+					continue;
+
+				bFailed = TRUE;
+			}
+		}
+		else if(!pReq->bSuccess || pReq->nDone != pReq->nBytes)
+		{
+			if(pReq->dwOp == IOQ_WRITE && !bFailed)
+			{
+				pSink->Error("Can't write on physical drive. It's probably mounted.\n"
+								"You need to put it off line before to be able to write on it.\n"
+								"Microsoft choose this way for security reason...\n"
+								"It's nice for us and avoid to overwrite a non wanted drive.");
+			}
+
+			TRACE("I/O failed at %llu with error 0x%08X\n", (unsigned long long)pReq->nOffset, pReq->dwError);
+
+			bFailed = TRUE;
+			ppFree[nFree++] = pSlot;
 			continue;
 		}
+		else if(pReq->dwOp == IOQ_READ && !bFailed)
+		{
+			// same offset on the drive, the tail rounded up to a whole sector
+			DWORD nPadded = (pReq->nBytes + 511) & ~511U;
+			memset((BYTE*)pReq->pBuff + pReq->nBytes, 0, nPadded - pReq->nBytes);
+
+			pSlot->pData = pSlot->pBuff;
+			pSlot->nBytes = nPadded;
+
+			pReq->dwOp = m_Options.bDelta ? IOQ_READ : IOQ_WRITE;
+			pReq->pDevice = &m_PhysicalDrive;
+			pReq->pBuff = m_Options.bDelta ? pSlot->pCompare : pSlot->pBuff;
+			pReq->nBytes = nPadded;
+
+			if(pQueue->Submit(pReq))
+				continue;
 
-		UINT64 bo = _byteswap_ulong(bat[b]) * 512LL;
+			bFailed = TRUE;
+		}
+		else if(pReq->dwOp == IOQ_WRITE)
+			nBytesWritten += pReq->nBytes;
 
-		filepointer.QuadPart = bo;
+		ppFree[nFree++] = pSlot;
 
-		bReturn = SetFilePointerEx(m_hVhdFile, filepointer, NULL, FILE_BEGIN);
-		if(!bReturn) goto clean;
+		if(bFailed)
+			continue;
 
-		bReturn = ReadFile(m_hVhdFile, bitmap, 512 * blockBitmapSectorCount, &dwByteRead, 0);
-		if(!bReturn) goto clean;
+		nDone += pSlot->nBytes;
 
-		UINT64 opos = 0xffffffffffffffffLL;
+		char sText[256] = {0};
+		snprintf(sText, sizeof(sText), "dumping... %llu/%llu MB"
+			, (unsigned long long)(nDone >> 20), (unsigned long long)(diskSize >> 20));
 
-		filepointer.QuadPart = bo + 512 * blockBitmapSectorCount;
+		pSink->Status(sText);
+		pSink->Progress(nDone, diskSize);
+	}
 
-		bReturn = SetFilePointerEx(m_hVhdFile, filepointer, NULL, FILE_BEGIN);
-		if(!bReturn) goto clean;
+	bReturn = !bFailed;
 
-		bReturn = ReadFile(m_hVhdFile, pBuff, 512 * sectorsPerBlock, &dwByteRead, 0);
-		if(!bReturn) goto clean;
+	if(bReturn && m_Options.bDelta)
+	{
+		char sText[256] = {0};
+		snprintf(sText, sizeof(sText), "%llu MB already up to date, %llu MB written"
+			, (unsigned long long)(nUnchanged >> 20), (unsigned long long)(nBytesWritten >> 20));
 
-		filepointer.QuadPart = (b * sectorsPerBlock ) * 512LL;
+		pSink->Status(sText);
+	}
 
-		TRACE("Writing at %lld\n", filepointer.QuadPart);
+clean:
 
-		SetFilePointerEx(m_hPhysicalDrive, filepointer, NULL, FILE_BEGIN);
+	if(pQueue) delete pQueue;
 
-		bReturn = WriteFile(m_hPhysicalDrive, pBuff, 512 * sectorsPerBlock, &dwByteRead, 0);
-		if(!bReturn)
+	if(pSlots)
+	{
+		for(UINT32 i = 0; i < nDepth; i++)
 		{
-			
-			MessageBox(NULL
-						, L"Can't write on physical drive. It's probably mounted.\n"
-								L"You need to put it off line before to be able to write on it.\n"
-								L"Microsoft choose this way for security reason...\n"
-								L"It's nice for us and avoid to overwrite a non wanted drive." 
-						, L"error"
-						, 0);
-			
-			goto clean;
+			if(pSlots[i].pBuff) FreeAligned(pSlots[i].pBuff);
+			if(pSlots[i].pCompare) FreeAligned(pSlots[i].pCompare);
+		}
+		delete[] pSlots;
+	}
+
+	if(ppFree) delete[] ppFree;
+
+	return bReturn;
+}
+
+// One block of the merged disk: read run by run from the layers that own its
+// sectors, then written as one request per run of owned sectors
+typedef struct _CHAIN_SLOT
+{
+	BYTE*		pData;
+	BYTE*		pCompare;	// delta: the target under the owned runs
+	VHD_RUN*	pRuns;
+	IO_REQUEST*	pReqs;		// room for a layer and a target read per run
+	UINT32		nRuns;
+	UINT32		nPending;
+	BOOL		bWriting;
+	BOOL		bRewrite;	// delta: part of the target was unreadable
+} CHAIN_SLOT;
+
+// Differencing disk: every sector is read once, from the topmost layer of
+// the chain holding it. Sectors no layer holds are the empty ranges: left
+// alone on the target, or zeroed/discarded as dwEmptyBlocks asks.
+BOOL CVhdToDisk::DumpChain(LPCPATH sPath, CProgressSink* pSink)
+{
+	BOOL bReturn = FALSE;
+	BOOL bFailed = FALSE;
+	CVhdChain chain;
+
+	UINT32 sectorsPerBlock = _byteswap_ulong(m_Dyn.blockSize) / 512;
+	UINT64 diskSectors = (_byteswap_uint64(m_Foot.currentSize) + 511) / 512;
+	UINT32 nBlocks = (UINT32)((diskSectors + sectorsPerBlock - 1) / sectorsPerBlock);
+	UINT32 nDepth = m_Options.nQueueDepth ? m_Options.nQueueDepth : 1;
+	UINT32 nNext = 0;
+	UINT32 nDone = 0;
+	UINT32 nFree = 0;
+	UINT64 nUnchanged = 0;
+	UINT64 nBytesWritten = 0;
+
+	CIoQueue* pQueue = NULL;
+	CHAIN_SLOT* pSlots = NULL;
+	CHAIN_SLOT** ppFree = NULL;
+
+	chain.SetUseBitmaps(m_Options.bUseBitmap);
+
+	if(!chain.Open(sPath))
+	{
+		pSink->Error("Can't open the parent disks of the differencing VHD.\n"
+						"They must sit where the VHD records them or next to it.");
+		return FALSE;
+	}
+
+	TRACE("Differencing chain of %u layers\n", chain.GetLayerCount());
+
+	pQueue = CIoQueue::Create(nDepth);
+	if(!pQueue) goto clean;
+
+	pSlots = new CHAIN_SLOT[nDepth];
+	ppFree = new CHAIN_SLOT*[nDepth];
+	ZeroMemory(pSlots, nDepth * sizeof(CHAIN_SLOT));
+
+	for(UINT32 i = 0; i < nDepth; i++)
+	{
+		pSlots[i].pData = (BYTE*)AllocAligned(sectorsPerBlock * 512);
+		if(!pSlots[i].pData) goto clean;
+
+		if(m_Options.bDelta)
+		{
+			pSlots[i].pCompare = (BYTE*)AllocAligned(sectorsPerBlock * 512);
+			if(!pSlots[i].pCompare) goto clean;
 		}
 
-/*
-		for (s = 0; s < sectorsPerBlock; s++)
+		pSlots[i].pRuns = new VHD_RUN[sectorsPerBlock];
+		pSlots[i].pReqs = new IO_REQUEST[sectorsPerBlock * 2];
+		ZeroMemory(pSlots[i].pReqs, sectorsPerBlock * 2 * sizeof(IO_REQUEST));
+
+		for(UINT32 j = 0; j < sectorsPerBlock * 2; j++)
+			pSlots[i].pReqs[j].pContext = &pSlots[i];
+
+		ppFree[nFree++] = &pSlots[i];
+	}
+
+	pSink->Status("Start dumping...");
+	pSink->Progress(0, nBlocks);
+
+	for(;;)
+	{
+		while(!bFailed && nFree && nNext < nBlocks)
 		{
-			int empty = 1;
-			for (k = 0; k < 512; k++)
+			CHAIN_SLOT* pSlot = ppFree[nFree - 1];
+			UINT64 nFirst = (UINT64)nNext * sectorsPerBlock;
+			UINT32 nSectors = sectorsPerBlock;
+
+			if(nFirst + nSectors > diskSectors)
+				nSectors = (UINT32)(diskSectors - nFirst);
+
+			if(!chain.MapSectors(nFirst, nSectors, pSlot->pRuns, &pSlot->nRuns))
+			{
+				TRACE("Failed to read the sector bitmaps of block %u\n", nNext);
+				bFailed = TRUE;
+				break;
+			}
+
+			nNext++;
+
+			// one read per run, straight into place in the block buffer
+			pSlot->nPending = 0;
+			pSlot->bWriting = FALSE;
+			pSlot->bRewrite = FALSE;
+
+			for(UINT32 r = 0; r < pSlot->nRuns && !bFailed; r++)
 			{
-				if (pBuff[k + (512 * s)])
+				VHD_RUN* pRun = &pSlot->pRuns[r];
+				if(!pRun->pFile)
+				{
+					if(m_Options.dwEmptyBlocks != RESTORE_EMPTY_KEEP
+						&& !ClearRange(pRun->nSector * 512, pRun->nCount * 512ULL))
+					{
+						pSink->Error("Can't clear the unused sectors on the target drive.");
+						bFailed = TRUE;
+					}
+					continue;
+				}
+
+				IO_REQUEST* pReq = &pSlot->pReqs[pSlot->nPending];
+				pReq->dwOp = IOQ_READ;
+				pReq->pDevice = pRun->pFile;
+				pReq->nOffset = pRun->nOffset;
+				pReq->pBuff = pSlot->pData + (pRun->nSector - nFirst) * 512;
+				pReq->nBytes = pRun->nCount * 512;
+
+				if(!pQueue->Submit(pReq))
+				{
+					bFailed = TRUE;
+					break;
+				}
+				pSlot->nPending++;
+
+				if(!m_Options.bDelta)
+					continue;
+
+				// delta: the same sectors of the target, to compare against
+				pReq = &pSlot->pReqs[pSlot->nPending];
+				pReq->dwOp = IOQ_READ;
+				pReq->pDevice = &m_PhysicalDrive;
+				pReq->nOffset = pRun->nSector * 512;
+				pReq->pBuff = pSlot->pCompare + (pRun->nSector - nFirst) * 512;
+				pReq->nBytes = pRun->nCount * 512;
+
+				if(!pQueue->Submit(pReq))
 				{
-					empty = 0;
+					bFailed = TRUE;
 					break;
 				}
+				pSlot->nPending++;
 			}
 
-			if ((bitmap[s/8] & (1<<(7-s%8))) == 0) 
+			if(pSlot->nPending)
+				nFree--;
+			else if(!bFailed)
+				nDone++;	// nothing in any layer
+		}
+
+		IO_REQUEST* pReq = pQueue->WaitCompletion();
+		if(!pReq) break;
+
+		if(pReq->dwOp == IOQ_WRITE && pReq->bSuccess && !bFailed && !AddWritten(pReq->nDone))
+		{
+			pSink->Error("Can't flush the physical drive.");
+			bFailed = TRUE;
+		}
+
+		if(pReq->dwOp == IOQ_WRITE && pReq->bSuccess)
+			nBytesWritten += pReq->nDone;
+
+		CHAIN_SLOT* pSlot = (CHAIN_SLOT*)pReq->pContext;
+
+		if(pReq->dwOp == IOQ_READ && pReq->pDevice == &m_PhysicalDrive)
+		{
+			// delta: unreadable or short target ranges are simply rewritten
+			if(!pReq->bSuccess || pReq->nDone != pReq->nBytes)
+				pSlot->bRewrite = TRUE;
+		}
+		else if(pReq->bSuccess && pReq->dwOp == IOQ_READ && pReq->nDone < pReq->nBytes
+			&& chain.MayReadShort(pReq->pDevice, pReq->nOffset))
+		{
+			// the last block of a layer may be stored short, anything else is truncation
+			memset((BYTE*)pReq->pBuff + pReq->nDone, 0, pReq->nBytes - pReq->nDone);
+			pReq->nDone = pReq->nBytes;
+		}
+		else if(!pReq->bSuccess || pReq->nDone != pReq->nBytes)
+		{
+			if(pReq->dwOp == IOQ_WRITE && !bFailed)
+			{
+				pSink->Error("Can't write on physical drive. It's probably mounted.\n"
+								"You need to put it off line before to be able to write on it.\n"
+								"Microsoft choose this way for security reason...\n"
+								"It's nice for us and avoid to overwrite a non wanted drive.");
+			}
+
+			TRACE("I/O failed at %llu with error 0x%08X\n", (unsigned long long)pReq->nOffset, pReq->dwError);
+			bFailed = TRUE;
+		}
+
+		if(--pSlot->nPending)
+			continue;
+
+		if(!pSlot->bWriting && !bFailed)
+		{
+			// all reads are in: one write per run of sectors some layer holds
+			UINT32 nWrites = 0;
+
+			for(UINT32 r = 0; r < pSlot->nRuns; r++)
 			{
-				emptySectors++;
-				if (!empty) 
-					TRACE("block %d, sector %d should be empty and isn't.\n", b, s);
+				VHD_RUN* pRun = &pSlot->pRuns[r];
+				if(!pRun->pFile)
+					continue;
+
+				IO_REQUEST* pWrite = &pSlot->pReqs[nWrites];
 
+				if(nWrites && pWrite[-1].nOffset + pWrite[-1].nBytes == pRun->nSector * 512)
+				{
+					pWrite[-1].nBytes += pRun->nCount * 512;
+					continue;
+				}
+
+				pWrite->dwOp = IOQ_WRITE;
+				pWrite->pDevice = &m_PhysicalDrive;
+				pWrite->nOffset = pRun->nSector * 512;
+				pWrite->pBuff = pSlot->pData + (pRun->nSector - pSlot->pRuns[0].nSector) * 512;
+				pWrite->nBytes = pRun->nCount * 512;
+				nWrites++;
 			}
-			else
+
+			pSlot->bWriting = TRUE;
+
+			for(UINT32 i = 0; i < nWrites; i++)
 			{
-				usedSectors++;
-				if (empty)
-					usedZeroes++;
-				else
+				IO_REQUEST* pWrite = &pSlot->pReqs[i];
+
+				if(m_Options.bDelta && !pSlot->bRewrite
+					&& memcmp(pWrite->pBuff, pSlot->pCompare + ((BYTE*)pWrite->pBuff - pSlot->pData), pWrite->nBytes) == 0)
 				{
-					filepointer.QuadPart = (b * sectorsPerBlock + s) * 512LL;
-					TRACE("Writing at %lld\n", filepointer.QuadPart);
-					
-					SetFilePointerEx(m_hPhysicalDrive, filepointer, NULL, FILE_BEGIN);
+					nUnchanged += pWrite->nBytes;
+					continue;
+				}
 
-					WriteFile(m_hPhysicalDrive, pBuff + (s * 512), 512, &dwByteRead, 0);
-					
+				if(!pQueue->Submit(pWrite))
+				{
+					bFailed = TRUE;
+					break;
 				}
+				pSlot->nPending++;
 			}
+
+			if(pSlot->nPending)
+				continue;
 		}
-		*/
+
+		ppFree[nFree++] = pSlot;
+
+		if(bFailed)
+			continue;
+
+		if(++nDone % 100 == 0)
+		{
+			char sText[256] = {0};
+			snprintf(sText, sizeof(sText), "dumping blocks... %u/%u", nDone, nBlocks);
+
+			pSink->Status(sText);
+			pSink->Progress(nDone, nBlocks);
+		}
+	}
+
+	bReturn = !bFailed;
+
+	if(bReturn)
+		pSink->Progress(nBlocks, nBlocks);
+
+	if(bReturn && m_Options.bDelta)
+	{
+		char sText[256] = {0};
+		snprintf(sText, sizeof(sText), "%llu MB already up to date, %llu MB written"
+			, (unsigned long long)(nUnchanged >> 20), (unsigned long long)(nBytesWritten >> 20));
+
+		pSink->Status(sText);
 	}
 
 clean:
 
-	if(bitmap) delete[] bitmap;
-	if(bat) delete[] bat;
-	if(pBuff) delete[] pBuff;
+	if(pQueue) delete pQueue;
+
+	if(pSlots)
+	{
+		for(UINT32 i = 0; i < nDepth; i++)
+		{
+			if(pSlots[i].pData) FreeAligned(pSlots[i].pData);
+			if(pSlots[i].pCompare) FreeAligned(pSlots[i].pCompare);
+			if(pSlots[i].pRuns) delete[] pSlots[i].pRuns;
+			if(pSlots[i].pReqs) delete[] pSlots[i].pReqs;
+		}
+		delete[] pSlots;
+	}
+
+	if(ppFree) delete[] ppFree;
 
 	return bReturn;
 }
 
-BOOL CVhdToDisk::DumpVhdToDisk(const LPWSTR sPath, const LPWSTR sDrive, const HWND phWnd)
+BOOL CVhdToDisk::DumpVhdToDisk(LPCPATH sPath, LPCPATH sDrive, CProgressSink* pSink)
 {
 	BOOL bReturn = FALSE;
 
-	if(m_hVhdFile == NULL)
+	if(!m_VhdFile.IsOpen())
 	{
 		bReturn = OpenVhdFile(sPath);
 		if(!bReturn)
 		{
-			TRACE("Failed to open %s\n", sPath);
+			TRACE("Failed to open the VHD file\n");
 			goto exit;
 		}
 	}
@@ -445,19 +1513,50 @@ BOOL CVhdToDisk::DumpVhdToDisk(const LPWSTR sPath, const LPWSTR sDrive, const HW
 	bReturn = OpenPhysicalDrive(sDrive);
 	if(!bReturn)
 	{
-		TRACE("Failed to open physical drive: %S\n", sDrive);
+		TRACE("Failed to open physical drive\n");
 		CloseVhdFile();
 		goto exit;
 	}
 	
 
+	if(!(m_VhdFile.GetFlags() & BDEV_STREAM) && CVhdxFile::Probe(&m_VhdFile))
+	{
+		if(!m_Vhdx.IsOpen() && !m_Vhdx.Open(&m_VhdFile))
+		{
+			pSink->Error("Invalid or unsupported VHDX file.");
+			bReturn = FALSE;
+			goto clean;
+		}
+
+		if(m_Vhdx.HasParent())
+		{
+			pSink->Error("Differencing VHDX files are not supported.");
+			bReturn = FALSE;
+			goto clean;
+		}
+
+		bReturn = DumpVhdx(pSink);
+		goto clean;
+	}
+
 	bReturn = ReadFooter();
 	if(!bReturn)
 	{
+		// only dynamic disks have a footer copy up front
+		if(m_VhdFile.GetFlags() & BDEV_STREAM)
+			pSink->Error("No dynamic VHD header at the start of the stream.\n"
+							"Fixed VHDs keep their footer at the end and can't be restored from a stream.");
+
 		TRACE("Failed to read footer\n");
 		goto clean;
 	}
 
+	if(_byteswap_ulong(m_Foot.diskType) == VHD_TYPE_FIXED)
+	{
+		bReturn = DumpFixed(pSink);
+		goto clean;
+	}
+
 	bReturn = ReadDynHeader();
 	if(!bReturn)
 	{
@@ -465,7 +1564,21 @@ BOOL CVhdToDisk::DumpVhdToDisk(const LPWSTR sPath, const LPWSTR sDrive, const HW
 		goto clean;
 	}
 
-	bReturn = Dump(phWnd);
+	if(_byteswap_ulong(m_Foot.diskType) == VHD_TYPE_DIFFERENCING)
+	{
+		// parents are found relative to the child's path
+		if(m_VhdFile.GetFlags() & BDEV_STREAM)
+		{
+			pSink->Error("A differencing VHD can't be restored from a stream.");
+			bReturn = FALSE;
+			goto clean;
+		}
+
+		bReturn = DumpChain(sPath, pSink);
+		goto clean;
+	}
+
+	bReturn = Dump(pSink);
 	if(!bReturn)
 	{
 		TRACE("Failed to Dump\n");
@@ -474,6 +1587,10 @@ BOOL CVhdToDisk::DumpVhdToDisk(const LPWSTR sPath, const LPWSTR sDrive, const HW
 
 clean:
 
+	if(bReturn)
+		bReturn = FlushTarget(pSink);
+
+	m_Vhdx.Close();
 	CloseVhdFile();
 	ClosePhysicalDrive();
 
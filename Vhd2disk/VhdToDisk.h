@@ -1,5 +1,9 @@
 #pragma once
 
+#include "BlockDevice.h"
+#include "ProgressSink.h"
+#include "VhdxFile.h"
+#include "MappedFile.h"
 
 typedef struct
 {
@@ -29,6 +33,11 @@ typedef struct _VHD_FOOTER
 	UCHAR padding[427];
 }VHD_FOOTER, *PVHD_FOOTER;
 
+// VHD_FOOTER::diskType
+#define VHD_TYPE_FIXED			2
+#define VHD_TYPE_DYNAMIC		3
+#define VHD_TYPE_DIFFERENCING	4
+
 
 typedef struct
 {
@@ -55,30 +64,77 @@ typedef struct
 } VHD_DYNAMIC;
 
 
+// What happens to the target under unallocated BAT entries
+#define RESTORE_EMPTY_KEEP		0	// left as is
+#define RESTORE_EMPTY_ZERO		1	// reads back as zeroes (write-zeroes offload, hole punching)
+#define RESTORE_EMPTY_DISCARD	2	// TRIM/UNMAP, zeroed instead where discard isn't supported
+
+// When restored data is forced out of the target's write cache
+#define RESTORE_DURABLE_EACH	0	// every write goes through (write-through handle)
+#define RESTORE_DURABLE_BARRIER	1	// a cache flush every nBarrierBytes written, and one at the end
+#define RESTORE_DURABLE_END		2	// a single cache flush at the end, which must succeed
+
+// Tuning for CVhdToDisk::DumpVhdToDisk, see InitRestoreOptions for defaults
+typedef struct _RESTORE_OPTIONS
+{
+	UINT32	nQueueDepth;		// extents being read or written at once (1 = one at a time)
+	BOOL	bOffsetOrder;		// read blocks by file offset instead of BAT order
+	UINT32	nMaxExtent;			// bytes of block data read at once from adjacent blocks
+	BOOL	bUseBitmap;			// write only the sectors marked used in the block bitmaps
+	DWORD	dwEmptyBlocks;		// RESTORE_EMPTY_*
+	BOOL	bDelta;				// read the target back and write only what differs
+	DWORD	dwDurability;		// RESTORE_DURABLE_*
+	UINT64	nBarrierBytes;		// RESTORE_DURABLE_BARRIER: bytes written between two flushes
+	BOOL	bMapImage;			// map the image and write aligned blocks straight out of the mapping
+} RESTORE_OPTIONS;
+
+void InitRestoreOptions(RESTORE_OPTIONS* pOptions);
+
+// Allocated block, scheduled for reading
+typedef struct _BLOCK_ENTRY
+{
+	UINT64		nSector;	// file offset of the block (of its bitmap in a VHD), in sectors
+	UINT32		nBlock;		// virtual block index
+} BLOCK_ENTRY;
+
+
 class CVhdToDisk
 {
 	VHD_FOOTER	m_Foot;
 	VHD_DYNAMIC m_Dyn;
 
-	HANDLE		m_hVhdFile;
-	HANDLE		m_hPhysicalDrive;
+	RESTORE_OPTIONS	m_Options;
+
+	CBlockDevice	m_VhdFile;
+	CBlockDevice	m_PhysicalDrive;
+
+	CVhdxFile		m_Vhdx;		// open when the image is a VHDX
+	CMappedFile		m_Map;		// open when bMapImage and the image is a regular file
+	UINT64			m_nUnflushed;	// bytes written since the last barrier
 
 public:
 	CVhdToDisk(void);
-	CVhdToDisk(LPWSTR sPath);
+	CVhdToDisk(LPCPATH sPath);
 	~CVhdToDisk(void);
 
-	BOOL DumpVhdToDisk(const LPWSTR sPath, const LPWSTR sDrive, const HWND);
+	BOOL DumpVhdToDisk(LPCPATH sPath, LPCPATH sDrive, CProgressSink* pSink);
+
+	void SetOptions(const RESTORE_OPTIONS& options) { m_Options = options; }
 
+	// Copies the first virtual sector (MBR) of the opened VHD into pSector (512 bytes)
+	BOOL ReadFirstSector(BYTE* pSector);
 
-	BOOL ParseFirstSector(HWND hDlg);
+	const VHD_FOOTER& GetFooter() const { return m_Foot; }
+	const VHD_DYNAMIC& GetDynHeader() const { return m_Dyn; }
+	const CVhdxFile& GetVhdx() const { return m_Vhdx; }
 
 protected:
 
-	BOOL OpenVhdFile(LPWSTR sPath);
+	BOOL OpenVhdFile(LPCPATH sPath);
 	BOOL CloseVhdFile();
+	BOOL ReadVhdAt(UINT64 nOffset, void* pBuff, DWORD nBytes, DWORD* pRead);
 
-	BOOL OpenPhysicalDrive(LPWSTR sDrive);
+	BOOL OpenPhysicalDrive(LPCPATH sDrive);
 	BOOL ClosePhysicalDrive();
 
 	BOOL ReadFooter();
@@ -87,5 +143,15 @@ protected:
 	
 	UINT64 GetFirstSectorAddress();
 	
-	BOOL Dump(HWND);
+	BOOL AddWritten(UINT64 nBytes);
+	BOOL FlushTarget(CProgressSink* pSink);
+
+	BOOL ClearRange(UINT64 nOffset, UINT64 nBytes);
+	BOOL ClearUnallocated(const BYTE* pAllocated, UINT32 nBlocks, UINT32 nBlockBytes, UINT64 nDiskBytes, CProgressSink* pSink);
+	BOOL DumpBlocks(BLOCK_ENTRY* pSchedule, UINT32 nAllocated, UINT32 nBitmapSectors, UINT32 nSectorsPerBlock
+		, UINT64 nDiskSectors, UINT64 nEmptySectors, CProgressSink* pSink);
+	BOOL Dump(CProgressSink* pSink);
+	BOOL DumpVhdx(CProgressSink* pSink);
+	BOOL DumpFixed(CProgressSink* pSink);
+	BOOL DumpChain(LPCPATH sPath, CProgressSink* pSink);
 };
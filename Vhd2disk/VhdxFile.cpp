@@ -0,0 +1,594 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "VhdxFile.h"
+
+const BYTE g_guidVhdxBat[16] =
+	{ 0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42, 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 };
+const BYTE g_guidVhdxMetadata[16] =
+	{ 0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B, 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E };
+const BYTE g_guidVhdxFileParameters[16] =
+	{ 0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D, 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B };
+const BYTE g_guidVhdxVirtualSize[16] =
+	{ 0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48, 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 };
+const BYTE g_guidVhdxLogicalSector[16] =
+	{ 0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47, 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F };
+const BYTE g_guidVhdxPhysicalSector[16] =
+	{ 0xC7, 0x48, 0xA3, 0xCD, 0x5D, 0x44, 0x71, 0x44, 0x9C, 0xC9, 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56 };
+const BYTE g_guidVhdxPage83[16] =
+	{ 0xAB, 0x12, 0xCA, 0xBE, 0xE6, 0xB2, 0x23, 0x45, 0x93, 0xEF, 0xC3, 0x09, 0xE0, 0x00, 0xC7, 0x46 };
+const BYTE g_guidVhdxParentLocator[16] =
+	{ 0x2D, 0x5F, 0xD3, 0xA8, 0x0B, 0xB3, 0x4D, 0x45, 0xAB, 0xF7, 0xD3, 0xD8, 0x48, 0x34, 0xAB, 0x0C };
+
+static UINT32 s_crcTable[256];
+
+UINT32 VhdxCrc32c(const void* pBuff, size_t nBytes)
+{
+	const BYTE* p = (const BYTE*)pBuff;
+	UINT32 crc = 0xFFFFFFFF;
+
+	if(!s_crcTable[1])
+	{
+		for(UINT32 i = 0; i < 256; i++)
+		{
+			UINT32 c = i;
+			for(int k = 0; k < 8; k++)
+				c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+			s_crcTable[i] = c;
+		}
+	}
+
+	for(size_t i = 0; i < nBytes; i++)
+		crc = s_crcTable[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+// Checksum of a structure whose UINT32 checksum field sits at offset 4
+static BOOL CheckCrc(BYTE* pBuff, size_t nBytes)
+{
+	UINT32 nChecksum;
+
+	memcpy(&nChecksum, pBuff + 4, 4);
+	memset(pBuff + 4, 0, 4);
+	BOOL bValid = (VhdxCrc32c(pBuff, nBytes) == nChecksum);
+	memcpy(pBuff + 4, &nChecksum, 4);
+
+	return bValid;
+}
+
+// Copies the log entry at nOffset out of the circular log into pEntry and
+// checks it: entry and data sector sequence numbers, descriptors, checksum.
+// Returns the entry length, 0 if there's no valid entry there.
+static UINT32 ReadLogEntry(const BYTE* pLog, UINT32 nLogLength, UINT32 nOffset, const BYTE* logGuid, BYTE* pEntry)
+{
+	const VHDX_LOG_ENTRY* pHead = (const VHDX_LOG_ENTRY*)(pLog + nOffset);
+	UINT32 nLength = pHead->entryLength;
+
+	if(memcmp(pHead->signature, "loge", 4) != 0 || memcmp(pHead->logGuid, logGuid, 16) != 0)
+		return 0;
+
+	if(!nLength || nLength % VHDX_LOG_SECTOR || nLength > nLogLength
+		|| pHead->tail % VHDX_LOG_SECTOR || pHead->tail >= nLogLength || !pHead->sequenceNumber)
+		return 0;
+
+	// an entry may wrap around the end of the log
+	for(UINT32 i = 0; i < nLength; i += VHDX_LOG_SECTOR)
+		memcpy(pEntry + i, pLog + (nOffset + i) % nLogLength, VHDX_LOG_SECTOR);
+
+	const VHDX_LOG_ENTRY* pHdr = (const VHDX_LOG_ENTRY*)pEntry;
+	const VHDX_LOG_DESCRIPTOR* pDesc = (const VHDX_LOG_DESCRIPTOR*)(pEntry + sizeof(VHDX_LOG_ENTRY));
+	UINT64 nDescBytes = sizeof(VHDX_LOG_ENTRY) + (UINT64)pHdr->descriptorCount * sizeof(VHDX_LOG_DESCRIPTOR);
+	UINT32 nSectors = (UINT32)((nDescBytes + VHDX_LOG_SECTOR - 1) / VHDX_LOG_SECTOR);
+
+	if(nDescBytes > nLength)
+		return 0;
+
+	for(UINT32 i = 0; i < pHdr->descriptorCount; i++)
+	{
+		if(pDesc[i].sequenceNumber != pHdr->sequenceNumber)
+			return 0;
+
+		if(memcmp(pDesc[i].signature, "zero", 4) == 0)
+			continue;
+
+		if(memcmp(pDesc[i].signature, "desc", 4) != 0 || pDesc[i].fileOffset % VHDX_LOG_SECTOR)
+			return 0;
+
+		if((nSectors + 1) * (UINT64)VHDX_LOG_SECTOR > nLength)
+			return 0;
+
+		const VHDX_LOG_DATA* pData = (const VHDX_LOG_DATA*)(pEntry + nSectors * VHDX_LOG_SECTOR);
+		if(memcmp(pData->signature, "data", 4) != 0
+			|| (((UINT64)pData->sequenceHigh << 32) | pData->sequenceLow) != pHdr->sequenceNumber)
+			return 0;
+
+		nSectors++;
+	}
+
+	if(nSectors * VHDX_LOG_SECTOR != nLength || !CheckCrc(pEntry, nLength))
+		return 0;
+
+	return nLength;
+}
+
+CVhdxFile::CVhdxFile(void)
+{
+	m_pFile = NULL;
+	m_pBat = NULL;
+	m_pPatchData = NULL;
+	m_pPatches = NULL;
+	Close();
+}
+
+CVhdxFile::~CVhdxFile(void)
+{
+	Close();
+}
+
+void CVhdxFile::Close()
+{
+	if(m_pBat) delete[] m_pBat;
+	if(m_pPatchData) delete[] m_pPatchData;
+	if(m_pPatches) delete[] m_pPatches;
+
+	m_pFile = NULL;
+	m_pBat = NULL;
+	m_pPatchData = NULL;
+	m_pPatches = NULL;
+	m_nPatches = 0;
+	m_nLogEntries = 0;
+	m_nFileEnd = 0;
+	m_nVirtualSize = 0;
+	m_nBlockSize = 0;
+	m_nLogicalSector = 0;
+	m_nPhysicalSector = 0;
+	m_bHasParent = FALSE;
+	m_nBlocks = 0;
+	ZeroMemory(&m_Header, sizeof(VHDX_HEADER));
+}
+
+BOOL CVhdxFile::Probe(CBlockDevice* pFile)
+{
+	CHAR signature[8];
+	DWORD dwRead = 0;
+
+	return pFile->ReadAt(0, signature, sizeof(signature), &dwRead)
+		&& dwRead == sizeof(signature) && memcmp(signature, "vhdxfile", 8) == 0;
+}
+
+BOOL CVhdxFile::ReadImage(UINT64 nOffset, void* pBuff, DWORD nBytes)
+{
+	DWORD dwRead = 0;
+
+	if(!m_pFile->ReadAt(nOffset, pBuff, nBytes, &dwRead))
+		return FALSE;
+
+	if(dwRead < nBytes)
+	{
+		// the log may have grown the file past its current end
+		if(nOffset + nBytes > m_nFileEnd)
+			return FALSE;
+
+		memset((BYTE*)pBuff + dwRead, 0, nBytes - dwRead);
+	}
+
+	ApplyLog(nOffset, pBuff, nBytes);
+
+	return TRUE;
+}
+
+void CVhdxFile::ApplyLog(UINT64 nOffset, void* pBuff, DWORD nBytes) const
+{
+	// in replay order, later writes win
+	for(UINT32 i = 0; i < m_nPatches; i++)
+	{
+		const VHDX_PATCH* pPatch = &m_pPatches[i];
+
+		if(pPatch->nOffset >= nOffset + nBytes || pPatch->nOffset + pPatch->nBytes <= nOffset)
+			continue;
+
+		UINT64 nStart = pPatch->nOffset > nOffset ? pPatch->nOffset : nOffset;
+		UINT64 nEnd = pPatch->nOffset + pPatch->nBytes;
+		if(nEnd > nOffset + nBytes)
+			nEnd = nOffset + nBytes;
+
+		BYTE* pDst = (BYTE*)pBuff + (nStart - nOffset);
+
+		if(pPatch->pData)
+			memcpy(pDst, pPatch->pData + (nStart - pPatch->nOffset), (size_t)(nEnd - nStart));
+		else
+			memset(pDst, 0, (size_t)(nEnd - nStart));
+	}
+}
+
+// The valid header with the highest sequence number is the current one
+BOOL CVhdxFile::ReadHeaders()
+{
+	VHDX_HEADER header;
+	BOOL bFound = FALSE;
+
+	for(UINT32 i = 0; i < 2; i++)
+	{
+		if(!ReadImage(VHDX_HEADER_OFFSET * (i + 1), &header, sizeof(VHDX_HEADER)))
+			continue;
+
+		if(memcmp(header.signature, "head", 4) != 0 || header.version != 1
+			|| !CheckCrc((BYTE*)&header, sizeof(VHDX_HEADER)))
+		{
+			TRACE("VHDX header %u is invalid\n", i + 1);
+			continue;
+		}
+
+		if(!bFound || header.sequenceNumber > m_Header.sequenceNumber)
+			m_Header = header;
+		bFound = TRUE;
+	}
+
+	return bFound;
+}
+
+// Replays the active log sequence into m_pPatches. The active sequence ends at
+// the newest valid entry whose tail leads up to it through entries numbered
+// one after the other; replay runs from that tail to it.
+BOOL CVhdxFile::ReplayLog()
+{
+	static const BYTE zeroGuid[16] = {0};
+
+	BOOL bReturn = FALSE;
+	UINT32 nLogLength = m_Header.logLength;
+	UINT32 nSectors = nLogLength / VHDX_LOG_SECTOR;
+	UINT32 nHead = 0;
+	UINT64 nHeadSeq = 0;
+	UINT32 nDescriptors = 0;
+	UINT32 nData = 0;
+	DWORD dwRead = 0;
+
+	BYTE* pLog = NULL;
+	BYTE* pEntry = NULL;
+	UINT64* pSeq = NULL;
+	UINT32* pNext = NULL;
+
+	if(memcmp(m_Header.logGuid, zeroGuid, 16) == 0)
+		return TRUE;
+
+	if(m_Header.logVersion != 0 || !nSectors || nLogLength % VHDX_LOG_SECTOR)
+	{
+		TRACE("Unsupported VHDX log (version %u, %u bytes)\n", m_Header.logVersion, nLogLength);
+		return FALSE;
+	}
+
+	pLog = new BYTE[nLogLength];
+	pEntry = new BYTE[nLogLength];
+	pSeq = new UINT64[nSectors];
+	pNext = new UINT32[nSectors];
+
+	if(!m_pFile->ReadAt(m_Header.logOffset, pLog, nLogLength, &dwRead) || dwRead != nLogLength)
+	{
+		TRACE("Failed to read the VHDX log with error 0x%08X\n", m_pFile->GetLastError());
+		goto clean;
+	}
+
+	// every valid entry: sequence number (0 = none) and where the next one starts
+	for(UINT32 i = 0; i < nSectors; i++)
+	{
+		UINT32 nLength = ReadLogEntry(pLog, nLogLength, i * VHDX_LOG_SECTOR, m_Header.logGuid, pEntry);
+
+		pSeq[i] = nLength ? ((VHDX_LOG_ENTRY*)pEntry)->sequenceNumber : 0;
+		pNext[i] = (i + nLength / VHDX_LOG_SECTOR) % nSectors;
+	}
+
+	for(UINT32 i = 0; i < nSectors; i++)
+	{
+		if(pSeq[i] <= nHeadSeq)
+			continue;
+
+		UINT32 n = ((VHDX_LOG_ENTRY*)(pLog + i * VHDX_LOG_SECTOR))->tail / VHDX_LOG_SECTOR;
+		UINT32 nSteps = 0;
+
+		while(n != i && pSeq[n] && nSteps++ < nSectors)
+		{
+			if(pSeq[pNext[n]] != pSeq[n] + 1)
+				break;
+			n = pNext[n];
+		}
+
+		if(n == i)
+		{
+			nHead = i;
+			nHeadSeq = pSeq[i];
+		}
+	}
+
+	if(!nHeadSeq)
+	{
+		// a log GUID with no usable entry: nothing was ever written to it
+		TRACE("No active sequence in the VHDX log\n");
+		bReturn = TRUE;
+		goto clean;
+	}
+
+	// size the patch list, then fill it
+	for(int nPass = 0; nPass < 2; nPass++)
+	{
+		UINT32 n = ((VHDX_LOG_ENTRY*)(pLog + nHead * VHDX_LOG_SECTOR))->tail / VHDX_LOG_SECTOR;
+
+		if(nPass)
+		{
+			m_pPatches = new VHDX_PATCH[nDescriptors ? nDescriptors : 1];
+			m_pPatchData = new BYTE[(nData ? nData : 1) * (size_t)VHDX_LOG_SECTOR];
+			nData = 0;
+		}
+
+		for(;;)
+		{
+			ReadLogEntry(pLog, nLogLength, n * VHDX_LOG_SECTOR, m_Header.logGuid, pEntry);
+
+			const VHDX_LOG_ENTRY* pHdr = (const VHDX_LOG_ENTRY*)pEntry;
+			const VHDX_LOG_DESCRIPTOR* pDesc = (const VHDX_LOG_DESCRIPTOR*)(pEntry + sizeof(VHDX_LOG_ENTRY));
+			UINT32 nSector = (UINT32)((sizeof(VHDX_LOG_ENTRY) + pHdr->descriptorCount * sizeof(VHDX_LOG_DESCRIPTOR)
+				+ VHDX_LOG_SECTOR - 1) / VHDX_LOG_SECTOR);
+
+			if(!nPass)
+			{
+				nDescriptors += pHdr->descriptorCount;
+				nData += pHdr->entryLength / VHDX_LOG_SECTOR - nSector;
+			}
+			else
+			{
+				for(UINT32 d = 0; d < pHdr->descriptorCount; d++)
+				{
+					VHDX_PATCH* pPatch = &m_pPatches[m_nPatches++];
+					pPatch->nOffset = pDesc[d].fileOffset;
+
+					if(memcmp(pDesc[d].signature, "zero", 4) == 0)
+					{
+						pPatch->nBytes = pDesc[d].leadingBytes;
+						pPatch->pData = NULL;
+						continue;
+					}
+
+					// the 4 KB sector is split across the descriptor and the data sector
+					const VHDX_LOG_DATA* pSrc = (const VHDX_LOG_DATA*)(pEntry + nSector++ * VHDX_LOG_SECTOR);
+					BYTE* pDst = m_pPatchData + (size_t)nData++ * VHDX_LOG_SECTOR;
+
+					memcpy(pDst, &pDesc[d].leadingBytes, 8);
+					memcpy(pDst + 8, pSrc->data, sizeof(pSrc->data));
+					memcpy(pDst + 8 + sizeof(pSrc->data), &pDesc[d].trailingBytes, 4);
+
+					pPatch->nBytes = VHDX_LOG_SECTOR;
+					pPatch->pData = pDst;
+				}
+
+				m_nLogEntries++;
+
+				// the file is at least as long as the newest entry says
+				if(n == nHead && pHdr->lastFileOffset > m_nFileEnd)
+					m_nFileEnd = pHdr->lastFileOffset;
+			}
+
+			if(n == nHead)
+				break;
+			n = pNext[n];
+		}
+	}
+
+	TRACE("Replayed %u VHDX log entries, %u writes\n", m_nLogEntries, m_nPatches);
+
+	bReturn = TRUE;
+
+clean:
+
+	delete[] pLog;
+	delete[] pEntry;
+	delete[] pSeq;
+	delete[] pNext;
+
+	return bReturn;
+}
+
+BOOL CVhdxFile::ReadMetadata(const VHDX_REGION_ENTRY* pRegion)
+{
+	BOOL bReturn = FALSE;
+	VHDX_METADATA_TABLE* pTable = new VHDX_METADATA_TABLE;
+
+	if(pRegion->length < sizeof(VHDX_METADATA_TABLE)
+		|| !ReadImage(pRegion->fileOffset, pTable, sizeof(VHDX_METADATA_TABLE)))
+		goto clean;
+
+	if(memcmp(pTable->signature, "metadata", 8) != 0 || pTable->entryCount > 2047)
+	{
+		TRACE("Invalid VHDX metadata table\n");
+		goto clean;
+	}
+
+	for(UINT32 i = 0; i < pTable->entryCount; i++)
+	{
+		const VHDX_METADATA_ENTRY* pItem = &pTable->entries[i];
+		UINT64 nOffset = pRegion->fileOffset + pItem->offset;
+		UINT32 value[2] = {0};
+
+		if(memcmp(pItem->itemId, g_guidVhdxFileParameters, 16) == 0)
+		{
+			if(pItem->length < 8 || !ReadImage(nOffset, value, 8))
+				goto clean;
+
+			m_nBlockSize = value[0];
+			m_bHasParent = (value[1] & 0x2) != 0;
+		}
+		else if(memcmp(pItem->itemId, g_guidVhdxVirtualSize, 16) == 0)
+		{
+			if(pItem->length < 8 || !ReadImage(nOffset, &m_nVirtualSize, 8))
+				goto clean;
+		}
+		else if(memcmp(pItem->itemId, g_guidVhdxLogicalSector, 16) == 0)
+		{
+			if(pItem->length < 4 || !ReadImage(nOffset, &m_nLogicalSector, 4))
+				goto clean;
+		}
+		else if(memcmp(pItem->itemId, g_guidVhdxPhysicalSector, 16) == 0)
+		{
+			if(pItem->length < 4 || !ReadImage(nOffset, &m_nPhysicalSector, 4))
+				goto clean;
+		}
+		else if(memcmp(pItem->itemId, g_guidVhdxPage83, 16) == 0 || memcmp(pItem->itemId, g_guidVhdxParentLocator, 16) == 0)
+			continue;	// disk id and parent paths: not needed to restore
+		else if(pItem->flags & VHDX_META_IS_REQUIRED)
+		{
+			TRACE("Unknown required VHDX metadata item %u\n", i);
+			goto clean;
+		}
+	}
+
+	// block size: a power of two from 1 MB to 256 MB
+	if(m_nBlockSize < 1024 * 1024 || m_nBlockSize > 256 * 1024 * 1024 || (m_nBlockSize & (m_nBlockSize - 1))
+		|| (m_nLogicalSector != 512 && m_nLogicalSector != 4096)
+		|| !m_nVirtualSize || m_nVirtualSize % m_nLogicalSector)
+	{
+		TRACE("Invalid VHDX metadata: block %u, sector %u, size %llu\n", m_nBlockSize, m_nLogicalSector, (unsigned long long)m_nVirtualSize);
+		goto clean;
+	}
+
+	if(!m_nPhysicalSector)
+		m_nPhysicalSector = m_nLogicalSector;
+
+	bReturn = TRUE;
+
+clean:
+
+	delete pTable;
+
+	return bReturn;
+}
+
+// The BAT interleaves one sector bitmap entry after every chunk of payload
+// entries; only the payload entries are kept
+BOOL CVhdxFile::ReadBat(const VHDX_REGION_ENTRY* pRegion)
+{
+	UINT32 nChunkRatio = (UINT32)((1ULL << 23) * m_nLogicalSector / m_nBlockSize);
+	UINT64 nBlocks = (m_nVirtualSize + m_nBlockSize - 1) / m_nBlockSize;
+	UINT64 nEntries = nBlocks + (nBlocks - 1) / nChunkRatio;
+
+	if(nBlocks > 0xFFFFFFFF || nEntries * 8 > pRegion->length)
+	{
+		TRACE("VHDX BAT region too small for %llu blocks\n", (unsigned long long)nBlocks);
+		return FALSE;
+	}
+
+	UINT64* pRaw = new UINT64[(size_t)nEntries];
+
+	if(!ReadImage(pRegion->fileOffset, pRaw, (DWORD)(nEntries * 8)))
+	{
+		TRACE("Failed to read the VHDX BAT with error 0x%08X\n", m_pFile->GetLastError());
+		delete[] pRaw;
+		return FALSE;
+	}
+
+	m_nBlocks = (UINT32)nBlocks;
+	m_pBat = new UINT64[m_nBlocks];
+
+	for(UINT32 b = 0; b < m_nBlocks; b++)
+		m_pBat[b] = pRaw[b + b / nChunkRatio];
+
+	delete[] pRaw;
+
+	return TRUE;
+}
+
+BOOL CVhdxFile::Open(CBlockDevice* pFile)
+{
+	BOOL bReturn = FALSE;
+	VHDX_REGION_TABLE* pRegions = new VHDX_REGION_TABLE;
+	const VHDX_REGION_ENTRY* pBat = NULL;
+	const VHDX_REGION_ENTRY* pMetadata = NULL;
+	UINT32 i;
+
+	Close();
+
+	m_pFile = pFile;
+	m_nFileEnd = pFile->GetSize();
+
+	if(!Probe(pFile))
+		goto clean;
+
+	if(!ReadHeaders())
+	{
+		TRACE("No valid VHDX header\n");
+		goto clean;
+	}
+
+	// everything past the headers is read through the log
+	if(!ReplayLog())
+		goto clean;
+
+	for(i = 0; i < 2; i++)
+	{
+		if(ReadImage(VHDX_REGION_OFFSET + i * 64 * 1024, pRegions, sizeof(VHDX_REGION_TABLE))
+			&& memcmp(pRegions->signature, "regi", 4) == 0 && pRegions->entryCount <= 2047
+			&& CheckCrc((BYTE*)pRegions, sizeof(VHDX_REGION_TABLE)))
+			break;
+	}
+
+	if(i == 2)
+	{
+		TRACE("No valid VHDX region table\n");
+		goto clean;
+	}
+
+	for(i = 0; i < pRegions->entryCount; i++)
+	{
+		const VHDX_REGION_ENTRY* pEntry = &pRegions->entries[i];
+
+		if(memcmp(pEntry->guid, g_guidVhdxBat, 16) == 0)
+			pBat = pEntry;
+		else if(memcmp(pEntry->guid, g_guidVhdxMetadata, 16) == 0)
+			pMetadata = pEntry;
+		else if(pEntry->required & 1)
+		{
+			TRACE("Unknown required VHDX region %u\n", i);
+			goto clean;
+		}
+	}
+
+	if(!pBat || !pMetadata)
+		goto clean;
+
+	if(!ReadMetadata(pMetadata) || !ReadBat(pBat))
+		goto clean;
+
+	bReturn = TRUE;
+
+clean:
+
+	delete pRegions;
+
+	if(!bReturn)
+		Close();
+
+	return bReturn;
+}
+
+BOOL CVhdxFile::ReadVirtual(UINT64 nOffset, void* pBuff, DWORD nBytes)
+{
+	BYTE* p = (BYTE*)pBuff;
+
+	while(nBytes)
+	{
+		UINT32 nBlock = (UINT32)(nOffset / m_nBlockSize);
+		UINT32 nIn = (UINT32)(nOffset % m_nBlockSize);
+		DWORD nChunk = m_nBlockSize - nIn < nBytes ? m_nBlockSize - nIn : nBytes;
+
+		if(nBlock < m_nBlocks && GetBlockState(nBlock) == VHDX_BLOCK_FULLY_PRESENT)
+		{
+			if(!ReadImage(GetBlockOffset(nBlock) + nIn, p, nChunk))
+				return FALSE;
+		}
+		else
+			memset(p, 0, nChunk);
+
+		p += nChunk;
+		nOffset += nChunk;
+		nBytes -= nChunk;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "BlockDevice.h"
+
+// VHDX reader (MS-VHDX v1). All on-disk fields are little endian, GUIDs are
+// kept as their on-disk bytes.
+
+#pragma pack(push, 1)
+
+typedef struct _VHDX_HEADER
+{
+	CHAR	signature[4];		// "head"
+	UINT32	checksum;			// CRC-32C of the 4 KB header, this field zeroed
+	UINT64	sequenceNumber;
+	BYTE	fileWriteGuid[16];
+	BYTE	dataWriteGuid[16];
+	BYTE	logGuid[16];		// all zero: the log is empty
+	UINT16	logVersion;
+	UINT16	version;
+	UINT32	logLength;
+	UINT64	logOffset;
+	BYTE	reserved[4016];
+} VHDX_HEADER;
+
+typedef struct _VHDX_REGION_ENTRY
+{
+	BYTE	guid[16];
+	UINT64	fileOffset;
+	UINT32	length;
+	UINT32	required;
+} VHDX_REGION_ENTRY;
+
+typedef struct _VHDX_REGION_TABLE
+{
+	CHAR	signature[4];		// "regi"
+	UINT32	checksum;			// CRC-32C of the 64 KB table
+	UINT32	entryCount;
+	UINT32	reserved;
+	VHDX_REGION_ENTRY	entries[2047];
+	BYTE	padding[16];
+} VHDX_REGION_TABLE;
+
+typedef struct _VHDX_METADATA_ENTRY
+{
+	BYTE	itemId[16];
+	UINT32	offset;				// from the start of the metadata region
+	UINT32	length;
+	UINT32	flags;				// VHDX_META_*
+	UINT32	reserved;
+} VHDX_METADATA_ENTRY;
+
+typedef struct _VHDX_METADATA_TABLE
+{
+	CHAR	signature[8];		// "metadata"
+	UINT16	reserved;
+	UINT16	entryCount;
+	UINT32	reserved2[5];
+	VHDX_METADATA_ENTRY	entries[2047];
+} VHDX_METADATA_TABLE;
+
+typedef struct _VHDX_LOG_ENTRY
+{
+	CHAR	signature[4];		// "loge"
+	UINT32	checksum;			// CRC-32C of the whole entry, this field zeroed
+	UINT32	entryLength;
+	UINT32	tail;				// log offset of the oldest entry still needed
+	UINT64	sequenceNumber;
+	UINT32	descriptorCount;
+	UINT32	reserved;
+	BYTE	logGuid[16];
+	UINT64	flushedFileOffset;
+	UINT64	lastFileOffset;
+} VHDX_LOG_ENTRY;
+
+// "desc" (4 KB of data follows in a data sector) or "zero" descriptor
+typedef struct _VHDX_LOG_DESCRIPTOR
+{
+	CHAR	signature[4];
+	UINT32	trailingBytes;		// "desc": last 4 bytes of the 4 KB
+	UINT64	leadingBytes;		// "desc": first 8 bytes, "zero": length to zero
+	UINT64	fileOffset;
+	UINT64	sequenceNumber;
+} VHDX_LOG_DESCRIPTOR;
+
+typedef struct _VHDX_LOG_DATA
+{
+	CHAR	signature[4];		// "data"
+	UINT32	sequenceHigh;
+	BYTE	data[4084];
+	UINT32	sequenceLow;
+} VHDX_LOG_DATA;
+
+#pragma pack(pop)
+
+// Region and metadata item GUIDs, in their on-disk byte order
+extern const BYTE g_guidVhdxBat[16];
+extern const BYTE g_guidVhdxMetadata[16];
+extern const BYTE g_guidVhdxFileParameters[16];
+extern const BYTE g_guidVhdxVirtualSize[16];
+extern const BYTE g_guidVhdxLogicalSector[16];
+extern const BYTE g_guidVhdxPhysicalSector[16];
+extern const BYTE g_guidVhdxPage83[16];
+extern const BYTE g_guidVhdxParentLocator[16];
+
+// CRC-32C (Castagnoli), the checksum of every VHDX structure
+UINT32 VhdxCrc32c(const void* pBuff, size_t nBytes);
+
+#define VHDX_HEADER_OFFSET		(64 * 1024)		// then the second copy at 128 KB
+#define VHDX_REGION_OFFSET		(192 * 1024)	// then the second copy at 256 KB
+#define VHDX_LOG_SECTOR			4096
+
+// VHDX_METADATA_ENTRY::flags
+#define VHDX_META_IS_USER		0x1
+#define VHDX_META_IS_VIRTUAL	0x2
+#define VHDX_META_IS_REQUIRED	0x4
+
+// BAT entry state, low 3 bits
+#define VHDX_BLOCK_NOT_PRESENT		0
+#define VHDX_BLOCK_UNDEFINED		1
+#define VHDX_BLOCK_ZERO				2
+#define VHDX_BLOCK_UNMAPPED			3
+#define VHDX_BLOCK_FULLY_PRESENT	6
+#define VHDX_BLOCK_PARTIALLY_PRESENT	7
+
+// A write replayed from the log, kept in memory and laid over every read:
+// the image itself is never modified
+typedef struct _VHDX_PATCH
+{
+	UINT64	nOffset;
+	UINT64	nBytes;
+	const BYTE*	pData;			// NULL: zeroes
+} VHDX_PATCH;
+
+class CVhdxFile
+{
+	CBlockDevice*	m_pFile;
+	VHDX_HEADER		m_Header;
+
+	UINT64		m_nVirtualSize;
+	UINT32		m_nBlockSize;
+	UINT32		m_nLogicalSector;
+	UINT32		m_nPhysicalSector;
+	BOOL		m_bHasParent;
+	UINT32		m_nBlocks;
+	UINT64*		m_pBat;			// payload entries only, sector bitmap entries dropped
+
+	BYTE*		m_pPatchData;	// 4 KB sectors rebuilt from the log
+	VHDX_PATCH*	m_pPatches;
+	UINT32		m_nPatches;
+	UINT32		m_nLogEntries;	// entries replayed
+	UINT64		m_nFileEnd;		// file size, as extended by the log
+
+public:
+	CVhdxFile(void);
+	~CVhdxFile(void);
+
+	// TRUE if pFile starts with the VHDX file identifier
+	static BOOL Probe(CBlockDevice* pFile);
+
+	// Reads the headers, replays the log in memory, then the region table,
+	// the metadata and the BAT. pFile must stay open while this is in use.
+	BOOL Open(CBlockDevice* pFile);
+	void Close();
+	BOOL IsOpen() const { return m_pBat != NULL; }
+
+	UINT64 GetVirtualSize() const { return m_nVirtualSize; }
+	UINT32 GetBlockSize() const { return m_nBlockSize; }
+	UINT32 GetLogicalSectorSize() const { return m_nLogicalSector; }
+	UINT32 GetPhysicalSectorSize() const { return m_nPhysicalSector; }
+	UINT32 GetBlockCount() const { return m_nBlocks; }
+	UINT32 GetLogEntries() const { return m_nLogEntries; }
+	BOOL HasParent() const { return m_bHasParent; }
+
+	UINT32 GetBlockState(UINT32 nBlock) const { return (UINT32)(m_pBat[nBlock] & 7); }
+	UINT64 GetBlockOffset(UINT32 nBlock) const { return m_pBat[nBlock] & ~0xFFFFFULL; }
+
+	// Reads from the virtual disk, blocks that aren't present read as zeroes
+	BOOL ReadVirtual(UINT64 nOffset, void* pBuff, DWORD nBytes);
+
+	// Lays the replayed log over nBytes read from the file at nOffset
+	void ApplyLog(UINT64 nOffset, void* pBuff, DWORD nBytes) const;
+
+protected:
+	BOOL ReadImage(UINT64 nOffset, void* pBuff, DWORD nBytes);
+	BOOL ReadHeaders();
+	BOOL ReplayLog();
+	BOOL ReadMetadata(const VHDX_REGION_ENTRY* pRegion);
+	BOOL ReadBat(const VHDX_REGION_ENTRY* pRegion);
+
+private:
+	CVhdxFile(const CVhdxFile&);
+	CVhdxFile& operator=(const CVhdxFile&);
+};
@@ -0,0 +1,372 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "VhdxWriter.h"
+#include <time.h>
+
+#define VHDX_MB					(1024ULL * 1024)
+#define VHDX_LOG_OFFSET			(1 * VHDX_MB)
+#define VHDX_METADATA_OFFSET	(2 * VHDX_MB)
+#define VHDX_BAT_OFFSET			(3 * VHDX_MB)
+
+static void RandomGuid(BYTE* pGuid)
+{
+	for(int i = 0; i < 16; i++)
+		pGuid[i] = (BYTE)(rand() % 256);
+}
+
+static void AddMetadataItem(VHDX_METADATA_TABLE* pTable, const BYTE* pGuid, UINT32 nOffset, UINT32 nLength, UINT32 dwFlags)
+{
+	VHDX_METADATA_ENTRY* pItem = &pTable->entries[pTable->entryCount++];
+
+	memcpy(pItem->itemId, pGuid, 16);
+	pItem->offset = nOffset;
+	pItem->length = nLength;
+	pItem->flags = dwFlags;
+}
+
+CVhdxWriter::CVhdxWriter(void)
+{
+	m_pBat = NULL;
+	m_pDirty = NULL;
+	m_pLogEntry = NULL;
+	Release();
+}
+
+CVhdxWriter::~CVhdxWriter(void)
+{
+	Release();
+}
+
+void CVhdxWriter::Release()
+{
+	if(m_pBat) delete[] m_pBat;
+	if(m_pDirty) delete[] m_pDirty;
+	if(m_pLogEntry) delete[] m_pLogEntry;
+
+	m_Payload.Close();
+
+	m_pFile = NULL;
+	m_pBat = NULL;
+	m_pDirty = NULL;
+	m_pLogEntry = NULL;
+	m_nHeader = 1;
+	m_nVirtualSize = 0;
+	m_nBlockSize = 0;
+	m_nChunkRatio = 0;
+	m_nBlocks = 0;
+	m_nBatSectors = 0;
+	m_nBatOffset = 0;
+	m_nDirty = 0;
+	m_nFileEnd = 0;
+	m_nPending = 0;
+	m_nLogSeq = 0;
+	m_nLogPos = 0;
+	ZeroMemory(&m_Header, sizeof(VHDX_HEADER));
+}
+
+BOOL CVhdxWriter::Create(CBlockDevice* pFile, UINT64 nVirtualSize, UINT32 nBlockSize, UINT32 nLogicalSector, UINT32 nPhysicalSector)
+{
+	BOOL bReturn = FALSE;
+	DWORD dwWritten = 0;
+	BYTE* pBuff = NULL;
+	UINT64 nEntries;
+	UINT64 nBatLength;
+
+	Release();
+
+	// block size: a power of two from 1 MB to 256 MB; at most 64 TB
+	if(nBlockSize < VHDX_MB || nBlockSize > 256 * VHDX_MB || (nBlockSize & (nBlockSize - 1))
+		|| (nLogicalSector != 512 && nLogicalSector != 4096)
+		|| (nPhysicalSector != 512 && nPhysicalSector != 4096)
+		|| !nVirtualSize || nVirtualSize % nLogicalSector || nVirtualSize > 64 * VHDX_MB * VHDX_MB)
+	{
+		TRACE("Invalid VHDX parameters: block %u, sectors %u/%u, size %llu\n"
+			, nBlockSize, nLogicalSector, nPhysicalSector, (unsigned long long)nVirtualSize);
+		return FALSE;
+	}
+
+	m_pFile = pFile;
+	m_nVirtualSize = nVirtualSize;
+	m_nBlockSize = nBlockSize;
+	m_nChunkRatio = (UINT32)((1ULL << 23) * nLogicalSector / nBlockSize);
+	m_nBlocks = (UINT32)((nVirtualSize + nBlockSize - 1) / nBlockSize);
+
+	// one sector bitmap entry after every chunk of payload entries
+	nEntries = m_nBlocks + (m_nBlocks - 1) / m_nChunkRatio;
+	m_nBatSectors = (UINT32)((nEntries * 8 + VHDX_LOG_SECTOR - 1) / VHDX_LOG_SECTOR);
+	m_nBatOffset = VHDX_BAT_OFFSET;
+	nBatLength = (m_nBatSectors * (UINT64)VHDX_LOG_SECTOR + VHDX_MB - 1) & ~(VHDX_MB - 1);
+
+	m_pBat = new UINT64[m_nBatSectors * (VHDX_LOG_SECTOR / 8)];
+	m_pDirty = new BYTE[m_nBatSectors];
+	m_pLogEntry = new BYTE[(1 + VHDX_CHECKPOINT_SECTORS) * VHDX_LOG_SECTOR];
+	ZeroMemory(m_pBat, m_nBatSectors * (size_t)VHDX_LOG_SECTOR);
+	ZeroMemory(m_pDirty, m_nBatSectors);
+
+	m_nFileEnd = m_nBatOffset + nBatLength;
+	m_nLogSeq = 1;
+
+	pBuff = new BYTE[64 * 1024];
+
+	// file identifier, creator in UTF-16
+	ZeroMemory(pBuff, 64 * 1024);
+	memcpy(pBuff, "vhdxfile", 8);
+	for(int i = 0; i < 8; i++)
+		pBuff[8 + 2 * i] = "vhd2disk"[i];
+
+	if(!m_pFile->WriteAt(0, pBuff, 64 * 1024, &dwWritten) || dwWritten != 64 * 1024)
+		goto clean;
+
+	// region table, twice
+	{
+		VHDX_REGION_TABLE* pRegions = (VHDX_REGION_TABLE*)pBuff;
+
+		ZeroMemory(pBuff, 64 * 1024);
+		memcpy(pRegions->signature, "regi", 4);
+		pRegions->entryCount = 2;
+
+		memcpy(pRegions->entries[0].guid, g_guidVhdxBat, 16);
+		pRegions->entries[0].fileOffset = m_nBatOffset;
+		pRegions->entries[0].length = (UINT32)nBatLength;
+		pRegions->entries[0].required = 1;
+
+		memcpy(pRegions->entries[1].guid, g_guidVhdxMetadata, 16);
+		pRegions->entries[1].fileOffset = VHDX_METADATA_OFFSET;
+		pRegions->entries[1].length = (UINT32)VHDX_MB;
+		pRegions->entries[1].required = 1;
+
+		pRegions->checksum = VhdxCrc32c(pRegions, sizeof(VHDX_REGION_TABLE));
+
+		for(UINT32 i = 0; i < 2; i++)
+		{
+			if(!m_pFile->WriteAt(VHDX_REGION_OFFSET + i * 64 * 1024, pBuff, 64 * 1024, &dwWritten) || dwWritten != 64 * 1024)
+				goto clean;
+		}
+	}
+
+	// metadata table, the items right behind it
+	{
+		VHDX_METADATA_TABLE* pTable = (VHDX_METADATA_TABLE*)pBuff;
+		BYTE items[4096] = {0};
+		UINT32 dwParameters[2] = { nBlockSize, 0 };
+
+		ZeroMemory(pBuff, 64 * 1024);
+		memcpy(pTable->signature, "metadata", 8);
+
+		AddMetadataItem(pTable, g_guidVhdxFileParameters, 64 * 1024, 8, VHDX_META_IS_REQUIRED);
+		memcpy(items, dwParameters, 8);
+		AddMetadataItem(pTable, g_guidVhdxVirtualSize, 64 * 1024 + 8, 8, VHDX_META_IS_VIRTUAL | VHDX_META_IS_REQUIRED);
+		memcpy(items + 8, &nVirtualSize, 8);
+		AddMetadataItem(pTable, g_guidVhdxLogicalSector, 64 * 1024 + 16, 4, VHDX_META_IS_VIRTUAL | VHDX_META_IS_REQUIRED);
+		memcpy(items + 16, &nLogicalSector, 4);
+		AddMetadataItem(pTable, g_guidVhdxPhysicalSector, 64 * 1024 + 20, 4, VHDX_META_IS_VIRTUAL | VHDX_META_IS_REQUIRED);
+		memcpy(items + 20, &nPhysicalSector, 4);
+		AddMetadataItem(pTable, g_guidVhdxPage83, 64 * 1024 + 24, 16, VHDX_META_IS_VIRTUAL | VHDX_META_IS_REQUIRED);
+		srand((unsigned int)time(NULL));
+		RandomGuid(items + 24);
+
+		if(!m_pFile->WriteAt(VHDX_METADATA_OFFSET, pBuff, 64 * 1024, &dwWritten) || dwWritten != 64 * 1024
+			|| !m_pFile->WriteAt(VHDX_METADATA_OFFSET + 64 * 1024, items, sizeof(items), &dwWritten) || dwWritten != sizeof(items))
+			goto clean;
+	}
+
+	// empty log, every block not present
+	if(!m_pFile->ZeroRange(VHDX_LOG_OFFSET, VHDX_LOG_LENGTH) || !m_pFile->ZeroRange(m_nBatOffset, nBatLength))
+		goto clean;
+
+	// the headers go last: the file is a valid empty VHDX from here on
+	memcpy(m_Header.signature, "head", 4);
+	RandomGuid(m_Header.fileWriteGuid);
+	RandomGuid(m_Header.dataWriteGuid);
+	m_Header.version = 1;
+	m_Header.logLength = VHDX_LOG_LENGTH;
+	m_Header.logOffset = VHDX_LOG_OFFSET;
+
+	if(!m_pFile->Flush() || !WriteHeader(FALSE) || !WriteHeader(FALSE))
+		goto clean;
+
+	if(!m_Payload.Create(m_pFile, TRUE))
+		goto clean;
+
+	bReturn = TRUE;
+
+clean:
+
+	if(!bReturn)
+		TRACE("Failed to lay out the VHDX with error 0x%08X\n", m_pFile->GetLastError());
+
+	delete[] pBuff;
+
+	return bReturn;
+}
+
+// Writes the header slot not holding the current header, with the next
+// sequence number, so one valid header survives a torn write
+BOOL CVhdxWriter::WriteHeader(BOOL bLogActive)
+{
+	DWORD dwWritten = 0;
+
+	if(!bLogActive)
+		ZeroMemory(m_Header.logGuid, 16);
+	else
+		RandomGuid(m_Header.logGuid);
+
+	m_Header.sequenceNumber++;
+	m_Header.checksum = 0;
+	m_Header.checksum = VhdxCrc32c(&m_Header, sizeof(VHDX_HEADER));
+	m_nHeader ^= 1;
+
+	return m_pFile->WriteAt(VHDX_HEADER_OFFSET * (m_nHeader + 1), &m_Header, sizeof(VHDX_HEADER), &dwWritten)
+		&& dwWritten == sizeof(VHDX_HEADER) && m_pFile->Flush();
+}
+
+// One log entry carrying the listed BAT sectors. Every earlier entry has
+// been applied already, so the entry is its own tail.
+BOOL CVhdxWriter::WriteLogEntry(const UINT32* pSectors, UINT32 nSectors)
+{
+	UINT32 nLength = (1 + nSectors) * VHDX_LOG_SECTOR;
+	UINT32 nFirst = VHDX_LOG_LENGTH - m_nLogPos;
+	DWORD dwWritten = 0;
+
+	VHDX_LOG_ENTRY* pHdr = (VHDX_LOG_ENTRY*)m_pLogEntry;
+	VHDX_LOG_DESCRIPTOR* pDesc = (VHDX_LOG_DESCRIPTOR*)(m_pLogEntry + sizeof(VHDX_LOG_ENTRY));
+
+	ZeroMemory(m_pLogEntry, VHDX_LOG_SECTOR);
+	memcpy(pHdr->signature, "loge", 4);
+	pHdr->entryLength = nLength;
+	pHdr->tail = m_nLogPos;
+	pHdr->sequenceNumber = m_nLogSeq;
+	pHdr->descriptorCount = nSectors;
+	memcpy(pHdr->logGuid, m_Header.logGuid, 16);
+	pHdr->flushedFileOffset = m_nFileEnd;
+	pHdr->lastFileOffset = m_nFileEnd;
+
+	for(UINT32 i = 0; i < nSectors; i++)
+	{
+		const BYTE* pSector = (const BYTE*)m_pBat + (size_t)pSectors[i] * VHDX_LOG_SECTOR;
+		VHDX_LOG_DATA* pData = (VHDX_LOG_DATA*)(m_pLogEntry + (1 + i) * VHDX_LOG_SECTOR);
+
+		// the first 8 and last 4 bytes of the sector ride in the descriptor
+		memcpy(pDesc[i].signature, "desc", 4);
+		memcpy(&pDesc[i].trailingBytes, pSector + VHDX_LOG_SECTOR - 4, 4);
+		memcpy(&pDesc[i].leadingBytes, pSector, 8);
+		pDesc[i].fileOffset = m_nBatOffset + (UINT64)pSectors[i] * VHDX_LOG_SECTOR;
+		pDesc[i].sequenceNumber = m_nLogSeq;
+
+		memcpy(pData->signature, "data", 4);
+		pData->sequenceHigh = (UINT32)(m_nLogSeq >> 32);
+		memcpy(pData->data, pSector + 8, sizeof(pData->data));
+		pData->sequenceLow = (UINT32)m_nLogSeq;
+	}
+
+	pHdr->checksum = VhdxCrc32c(m_pLogEntry, nLength);
+
+	// the log is circular, the entry may wrap around its end
+	if(nFirst > nLength)
+		nFirst = nLength;
+
+	if(!m_pFile->WriteAt(VHDX_LOG_OFFSET + m_nLogPos, m_pLogEntry, nFirst, &dwWritten) || dwWritten != nFirst)
+		return FALSE;
+
+	if(nFirst < nLength
+		&& (!m_pFile->WriteAt(VHDX_LOG_OFFSET, m_pLogEntry + nFirst, nLength - nFirst, &dwWritten) || dwWritten != nLength - nFirst))
+		return FALSE;
+
+	m_nLogPos = (m_nLogPos + nLength) % VHDX_LOG_LENGTH;
+	m_nLogSeq++;
+
+	return TRUE;
+}
+
+BOOL CVhdxWriter::WriteBlock(UINT32 nBlock, const void* pData, DWORD nBytes, void* pTag)
+{
+	UINT64 nOffset = m_nFileEnd;
+	UINT32 nEntry = nBlock + nBlock / m_nChunkRatio;
+
+	if(!m_Payload.Append(nOffset, pData, nBytes, pTag))
+		return FALSE;
+
+	// a short last block still takes its whole size in the file
+	if(nBytes < m_nBlockSize && !m_pFile->ZeroRange(nOffset + nBytes, m_nBlockSize - nBytes))
+		return FALSE;
+
+	// blocks are whole MBs, so the offset stays MB aligned
+	m_pBat[nEntry] = nOffset | VHDX_BLOCK_FULLY_PRESENT;
+
+	if(!m_pDirty[nEntry / 512])
+	{
+		m_pDirty[nEntry / 512] = 1;
+		m_nDirty++;
+	}
+
+	m_nFileEnd += m_nBlockSize;
+	m_nPending += m_nBlockSize;
+
+	if(m_nPending >= VHDX_CHECKPOINT_BYTES || m_nDirty >= VHDX_CHECKPOINT_SECTORS)
+		return Checkpoint();
+
+	return TRUE;
+}
+
+// Payload flushed, then the changed BAT sectors logged and flushed, then
+// written in place and flushed. A crash in between leaves either the old
+// BAT or a log that brings it up to date.
+BOOL CVhdxWriter::Checkpoint()
+{
+	static const BYTE zeroGuid[16] = {0};
+
+	UINT32 pSectors[VHDX_CHECKPOINT_SECTORS];
+	UINT32 nSectors = 0;
+	DWORD dwWritten = 0;
+
+	if(!m_nDirty)
+		return TRUE;
+
+	if(!m_Payload.Flush() || !m_pFile->Flush())
+		return FALSE;
+
+	// first BAT update: the log becomes active
+	if(memcmp(m_Header.logGuid, zeroGuid, 16) == 0 && !WriteHeader(TRUE))
+		return FALSE;
+
+	for(UINT32 s = 0; s < m_nBatSectors && nSectors < VHDX_CHECKPOINT_SECTORS; s++)
+		if(m_pDirty[s])
+			pSectors[nSectors++] = s;
+
+	if(!WriteLogEntry(pSectors, nSectors) || !m_pFile->Flush())
+		return FALSE;
+
+	for(UINT32 i = 0; i < nSectors; i++)
+	{
+		UINT32 s = pSectors[i];
+
+		if(!m_pFile->WriteAt(m_nBatOffset + (UINT64)s * VHDX_LOG_SECTOR, (const BYTE*)m_pBat + (size_t)s * VHDX_LOG_SECTOR
+			, VHDX_LOG_SECTOR, &dwWritten) || dwWritten != VHDX_LOG_SECTOR)
+			return FALSE;
+
+		m_pDirty[s] = 0;
+	}
+
+	if(!m_pFile->Flush())
+		return FALSE;
+
+	m_nDirty = 0;
+	m_nPending = 0;
+
+	return TRUE;
+}
+
+BOOL CVhdxWriter::Close()
+{
+	static const BYTE zeroGuid[16] = {0};
+
+	BOOL bReturn = (m_pFile != NULL) && Checkpoint();
+
+	// the BAT is all in place, nothing left to replay
+	if(bReturn && memcmp(m_Header.logGuid, zeroGuid, 16) != 0)
+		bReturn = WriteHeader(FALSE);
+
+	Release();
+
+	return bReturn;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "VhdxFile.h"
+#include "WriteBehind.h"
+
+// Dynamic VHDX output, written so a crash at any point leaves a valid file:
+// payload blocks are flushed before the BAT points at them, and BAT updates
+// go through the log first, so a torn BAT sector is repaired on next open.
+
+#define VHDX_LOG_LENGTH			(1024 * 1024)
+#define VHDX_CHECKPOINT_BYTES	(1024ULL * 1024 * 1024)	// payload between two BAT updates
+#define VHDX_CHECKPOINT_SECTORS	64						// dirty BAT sectors per log entry, at most
+
+class CVhdxWriter
+{
+	CBlockDevice*	m_pFile;
+	VHDX_HEADER		m_Header;
+	UINT32		m_nHeader;		// slot (0 or 1) m_Header was last written to
+
+	UINT64		m_nVirtualSize;
+	UINT32		m_nBlockSize;
+	UINT32		m_nChunkRatio;
+	UINT32		m_nBlocks;
+
+	UINT64*		m_pBat;			// whole BAT, sector bitmap entries included
+	UINT32		m_nBatSectors;	// 4 KB sectors of BAT
+	UINT64		m_nBatOffset;
+	BYTE*		m_pDirty;		// per BAT sector: changed since the last checkpoint
+	UINT32		m_nDirty;
+
+	UINT64		m_nFileEnd;		// where the next payload block goes
+	CWriteBehind	m_Payload;	// blocks on their way to the file, flushed at each checkpoint
+	UINT64		m_nPending;		// payload bytes written since the last checkpoint
+	UINT64		m_nLogSeq;
+	UINT32		m_nLogPos;		// where the next entry goes in the log
+	BYTE*		m_pLogEntry;
+
+public:
+	CVhdxWriter(void);
+	~CVhdxWriter(void);
+
+	// Lays out an empty VHDX on pFile (created empty): headers, region tables,
+	// metadata, log and BAT. pFile must stay open until Close.
+	BOOL Create(CBlockDevice* pFile, UINT64 nVirtualSize, UINT32 nBlockSize, UINT32 nLogicalSector, UINT32 nPhysicalSector);
+
+	// Appends block nBlock to the file. nBytes (a multiple of 512) may fall
+	// short of the block size for the last block, the rest reads as zeroes.
+	// pData is written from where it is: pTag comes back from GetReleased
+	// once it may be reused.
+	BOOL WriteBlock(UINT32 nBlock, const void* pData, DWORD nBytes, void* pTag);
+
+	// See CWriteBehind
+	void* GetReleased() { return m_Payload.GetReleased(); }
+	BOOL WaitReleased() { return m_Payload.WaitReleased(); }
+
+	// Makes the blocks written so far durable and reachable from the BAT
+	BOOL Checkpoint();
+
+	// Last checkpoint, then marks the log empty
+	BOOL Close();
+
+	UINT32 GetBlockCount() const { return m_nBlocks; }
+	UINT64 GetFileSize() const { return m_nFileEnd; }
+
+protected:
+	BOOL WriteHeader(BOOL bLogActive);
+	BOOL WriteLogEntry(const UINT32* pSectors, UINT32 nSectors);
+	void Release();
+
+private:
+	CVhdxWriter(const CVhdxWriter&);
+	CVhdxWriter& operator=(const CVhdxWriter&);
+};
@@ -0,0 +1,307 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include "WriteBehind.h"
+
+CWriteBehind::CWriteBehind(void)
+{
+	m_pDevice = NULL;
+	m_pQueue = NULL;
+	m_pBatches = NULL;
+	m_nBatches = 0;
+	m_nBatchBytes = 0;
+	m_ppFree = NULL;
+	m_nFree = 0;
+	m_pFill = NULL;
+	m_ppReleased = NULL;
+	m_nReleasedHead = 0;
+	m_nReleased = 0;
+	m_nMaxTags = 0;
+	m_nHeld = 0;
+	m_bFailed = FALSE;
+	m_dwError = 0;
+}
+
+CWriteBehind::~CWriteBehind(void)
+{
+	Close();
+}
+
+BOOL CWriteBehind::Create(CBlockDevice* pDevice, BOOL bAsync, UINT32 nMaxTags, DWORD nBatchBytes, UINT32 nBatches)
+{
+	Close();
+
+	m_pDevice = pDevice;
+	m_nBatchBytes = nBatchBytes;
+	m_nBatches = nBatches ? nBatches : 1;
+	m_nMaxTags = nMaxTags ? nMaxTags : m_nBatches * WRITE_BEHIND_SEGMENTS;
+
+	if(bAsync)
+	{
+		m_pQueue = CIoQueue::Create(m_nBatches);
+		if(!m_pQueue)
+			goto fail;
+	}
+
+	m_pBatches = new WRITE_BATCH[m_nBatches];
+	m_ppFree = new WRITE_BATCH*[m_nBatches];
+	m_ppReleased = new void*[m_nMaxTags];
+	if(!m_pBatches || !m_ppFree || !m_ppReleased)
+		goto fail;
+
+	ZeroMemory(m_pBatches, m_nBatches * sizeof(WRITE_BATCH));
+
+	for(UINT32 i = 0; i < m_nBatches; i++)
+	{
+		m_pBatches[i].pSegments = new IO_SEGMENT[WRITE_BEHIND_SEGMENTS];
+		m_pBatches[i].ppTags = new void*[WRITE_BEHIND_SEGMENTS];
+		if(!m_pBatches[i].pSegments || !m_pBatches[i].ppTags)
+			goto fail;
+
+		m_pBatches[i].req.pContext = &m_pBatches[i];
+		m_ppFree[m_nFree++] = &m_pBatches[i];
+	}
+
+	return TRUE;
+
+fail:
+	Close();
+	return FALSE;
+}
+
+void CWriteBehind::Close()
+{
+	// the queue waits for what is still in flight before it goes
+	delete m_pQueue;
+	m_pQueue = NULL;
+
+	if(m_pBatches)
+	{
+		for(UINT32 i = 0; i < m_nBatches; i++)
+		{
+			delete[] m_pBatches[i].pSegments;
+			delete[] m_pBatches[i].ppTags;
+		}
+
+		delete[] m_pBatches;
+	}
+
+	delete[] m_ppFree;
+	delete[] m_ppReleased;
+
+	m_pBatches = NULL;
+	m_ppFree = NULL;
+	m_nFree = 0;
+	m_pFill = NULL;
+	m_ppReleased = NULL;
+	m_nReleasedHead = 0;
+	m_nReleased = 0;
+	m_nHeld = 0;
+	m_bFailed = FALSE;
+	m_dwError = 0;
+}
+
+BOOL CWriteBehind::RegisterBuffers(const IO_SEGMENT* pBuffers, UINT32 nBuffers)
+{
+	return m_pQueue && m_pQueue->RegisterBuffers(pBuffers, nBuffers);
+}
+
+void CWriteBehind::Fail(DWORD dwError)
+{
+	if(!m_bFailed)
+		m_dwError = dwError;
+
+	m_bFailed = TRUE;
+}
+
+// The batch's buffers are the caller's again
+void CWriteBehind::Release(WRITE_BATCH* pBatch)
+{
+	// Append keeps the tags held within the ring
+	for(UINT32 i = 0; i < pBatch->nTags; i++)
+		m_ppReleased[(m_nReleasedHead + m_nReleased++) % m_nMaxTags] = pBatch->ppTags[i];
+
+	pBatch->nTags = 0;
+	m_ppFree[m_nFree++] = pBatch;
+}
+
+void* CWriteBehind::GetReleased()
+{
+	if(!m_nReleased)
+		return NULL;
+
+	void* pTag = m_ppReleased[m_nReleasedHead];
+
+	m_nReleasedHead = (m_nReleasedHead + 1) % m_nMaxTags;
+	m_nReleased--;
+	m_nHeld--;
+
+	return pTag;
+}
+
+BOOL CWriteBehind::WaitReleased()
+{
+	while(!m_nReleased)
+	{
+		UINT32 nInFlight = m_nBatches - m_nFree - (m_pFill ? 1 : 0);
+
+		if(nInFlight)
+		{
+			if(!Reap())
+				return FALSE;
+		}
+		else if(m_pFill && m_pFill->nTags)
+			Submit();
+		else
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL CWriteBehind::Append(UINT64 nOffset, const void* pData, DWORD nBytes, void* pTag)
+{
+	if(!m_pBatches)
+		return FALSE;
+
+	// its tag would have nowhere to go once released
+	if(m_nHeld == m_nMaxTags)
+	{
+		TRACE("More than %u buffers appended and not taken back\n", m_nMaxTags);
+		return FALSE;
+	}
+
+	// a write somewhere else, or a batch that can't take more, goes out first
+	if(m_pFill && (m_pFill->req.nOffset + m_pFill->req.nBytes != nOffset
+		|| m_pFill->nTags == WRITE_BEHIND_SEGMENTS
+		|| m_pFill->req.nBytes + nBytes > m_nBatchBytes))
+	{
+		Submit();
+	}
+
+	if(!m_pFill && !m_bFailed)
+	{
+		while(!m_nFree)
+		{
+			if(!Reap())
+			{
+				Fail(0);
+				break;
+			}
+		}
+
+		if(m_nFree)
+		{
+			m_pFill = m_ppFree[--m_nFree];
+			m_pFill->req.nOffset = nOffset;
+			m_pFill->req.nBytes = 0;
+		}
+	}
+
+	// nothing more goes out after a failure
+	if(m_bFailed || !m_pFill)
+		return FALSE;
+
+	m_pFill->pSegments[m_pFill->nTags].pBuff = (void*)pData;
+	m_pFill->pSegments[m_pFill->nTags].nBytes = nBytes;
+	m_pFill->ppTags[m_pFill->nTags++] = pTag;
+	m_pFill->req.nBytes += nBytes;
+	m_nHeld++;
+
+	// pData is taken now and its tag comes back either way: a failed write
+	// shows on the next call
+	if(m_pFill->req.nBytes >= m_nBatchBytes)
+		Submit();
+
+	return TRUE;
+}
+
+// Hands the batch being gathered over to the device
+BOOL CWriteBehind::Submit()
+{
+	WRITE_BATCH* pBatch = m_pFill;
+	IO_REQUEST* pReq = &pBatch->req;
+
+	m_pFill = NULL;
+
+	pReq->dwOp = IOQ_WRITE;
+	pReq->pDevice = m_pDevice;
+
+	// a single buffer goes out as a plain write, which may use fixed buffers
+	if(pBatch->nTags == 1)
+	{
+		pReq->pBuff = pBatch->pSegments[0].pBuff;
+		pReq->pSegments = NULL;
+		pReq->nSegments = 0;
+	}
+	else
+	{
+		pReq->pBuff = NULL;
+		pReq->pSegments = pBatch->pSegments;
+		pReq->nSegments = pBatch->nTags;
+	}
+
+	if(!m_pQueue)
+	{
+		DWORD dwWritten = 0;
+		BOOL bWritten = pReq->nSegments ? m_pDevice->WriteV(pReq->nOffset, pReq->pSegments, pReq->nSegments, &dwWritten)
+			: m_pDevice->WriteAt(pReq->nOffset, pReq->pBuff, pReq->nBytes, &dwWritten);
+
+		if(!bWritten || dwWritten != pReq->nBytes)
+		{
+			TRACE("Failed to write %u bytes at %llu with error 0x%08X\n", pReq->nBytes, (unsigned long long)pReq->nOffset, m_pDevice->GetLastError());
+			Fail(m_pDevice->GetLastError());
+		}
+
+		Release(pBatch);
+		return !m_bFailed;
+	}
+
+	if(!m_pQueue->Submit(pReq))
+	{
+		Fail(0);
+		Release(pBatch);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Takes back one batch from the queue, FALSE if nothing was in flight. A
+// failed write is only recorded.
+BOOL CWriteBehind::Reap()
+{
+	IO_REQUEST* pReq = m_pQueue ? m_pQueue->WaitCompletion() : NULL;
+
+	if(!pReq)
+		return FALSE;
+
+	if(!pReq->bSuccess || pReq->nDone != pReq->nBytes)
+	{
+		TRACE("Failed to write %u bytes at %llu with error 0x%08X\n", pReq->nBytes, (unsigned long long)pReq->nOffset, pReq->dwError);
+		Fail(pReq->dwError);
+	}
+
+	Release((WRITE_BATCH*)pReq->pContext);
+
+	return TRUE;
+}
+
+BOOL CWriteBehind::Flush()
+{
+	if(!m_pBatches)
+		return FALSE;
+
+	if(m_pFill && m_pFill->nTags)
+		Submit();
+	else if(m_pFill)
+	{
+		m_ppFree[m_nFree++] = m_pFill;
+		m_pFill = NULL;
+	}
+
+	// every batch back, failed or not
+	while(m_pQueue && m_nFree < m_nBatches && Reap())
+		;
+
+	return !m_bFailed;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "IoQueue.h"
+
+// Write-behind for output files laid out front to back: appends to
+// consecutive offsets are gathered, without copying them, into a few large
+// writes, each one issued as a single request once big enough (or once an
+// append lands elsewhere). Asynchronous writers put them on a queue of their
+// own and the caller goes on with the next blocks; synchronous ones write
+// them in place, in order, as a pipe needs.
+//
+// The caller's buffers are written from where they are: each append carries
+// a tag that GetReleased hands back once the write holding it is over, and
+// the buffer must stay untouched until then. At most nMaxTags tags (by
+// default nBatches * WRITE_BEHIND_SEGMENTS) can be held, appended or released
+// and not yet taken back; an append past that is refused.
+//
+// Aligned appends of aligned sizes make aligned writes, as unbuffered
+// devices require.
+
+#define WRITE_BEHIND_BATCH		(8 * 1024 * 1024)	// bytes gathered into one write
+#define WRITE_BEHIND_BATCHES	4					// writes in flight at most
+#define WRITE_BEHIND_SEGMENTS	64					// appends gathered into one write
+
+// One gathered write and the tags of the appends it holds
+typedef struct _WRITE_BATCH
+{
+	IO_REQUEST		req;		// pSegments point at the caller's buffers
+	IO_SEGMENT*		pSegments;
+	void**			ppTags;		// one per segment
+	UINT32			nTags;
+} WRITE_BATCH;
+
+class CWriteBehind
+{
+	CBlockDevice*	m_pDevice;
+	CIoQueue*		m_pQueue;		// NULL: written synchronously
+	WRITE_BATCH*	m_pBatches;
+	UINT32			m_nBatches;
+	DWORD			m_nBatchBytes;
+
+	WRITE_BATCH**	m_ppFree;
+	UINT32			m_nFree;
+	WRITE_BATCH*	m_pFill;		// batch being gathered, req.nOffset/nBytes tell what it holds
+
+	void**			m_ppReleased;	// ring of tags whose write is over
+	UINT32			m_nReleasedHead;
+	UINT32			m_nReleased;
+	UINT32			m_nMaxTags;		// size of the ring
+	UINT32			m_nHeld;		// tags appended and not taken back yet
+
+	BOOL			m_bFailed;		// sticky, every later call fails too
+	DWORD			m_dwError;
+
+public:
+	CWriteBehind(void);
+	~CWriteBehind(void);
+
+	// nMaxTags: the most buffers the caller appends without taking them back,
+	// 0 for the default
+	BOOL Create(CBlockDevice* pDevice, BOOL bAsync, UINT32 nMaxTags = 0
+		, DWORD nBatchBytes = WRITE_BEHIND_BATCH, UINT32 nBatches = WRITE_BEHIND_BATCHES);
+
+	// Queues pData to be written at nOffset, pTag comes back from GetReleased
+	// once it was. FALSE once any write failed, pData is not kept then; a
+	// write failing once pData was kept shows on the next Append or Flush.
+	BOOL Append(UINT64 nOffset, const void* pData, DWORD nBytes, void* pTag);
+
+	// Next tag whose buffer may be reused, NULL if none yet
+	void* GetReleased();
+
+	// Waits until a tag is released, writing out what is gathered if nothing
+	// is in flight. FALSE if no append holds a buffer.
+	BOOL WaitReleased();
+
+	// Writes whatever is gathered and waits until all of it landed
+	BOOL Flush();
+
+	// Waits for the writes in flight (without checking them) and frees the
+	// batches; the caller's buffers are all free afterwards
+	void Close();
+
+	// Hint that appends come from these buffers, see CIoQueue::RegisterBuffers
+	BOOL RegisterBuffers(const IO_SEGMENT* pBuffers, UINT32 nBuffers);
+
+	BOOL IsOpen() const { return m_pBatches != NULL; }
+	DWORD GetLastError() const { return m_dwError; }
+
+protected:
+	BOOL Submit();
+	BOOL Reap();
+	void Release(WRITE_BATCH* pBatch);
+	void Fail(DWORD dwError);
+
+private:
+	CWriteBehind(const CWriteBehind&);
+	CWriteBehind& operator=(const CWriteBehind&);
+};
@@ -0,0 +1,222 @@
+#include "stdafx.h"
+#include "ZeroScan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ZEROSCAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ZEROSCAN_TARGET(x)
+#else
+#include <cpuid.h>
+#define ZEROSCAN_TARGET(x)	__attribute__((target(x)))
+#endif
+#endif
+
+typedef BOOL (*ZEROSCAN_FN)(const BYTE* p, size_t n);
+
+static BOOL IsZeroScalar(const BYTE* p, size_t n)
+{
+	for(; n >= 32; p += 32, n -= 32)
+	{
+		const UINT64* q = (const UINT64*)p;
+		if(q[0] | q[1] | q[2] | q[3])
+			return FALSE;
+	}
+
+	for(; n; p++, n--)
+		if(*p) return FALSE;
+
+	return TRUE;
+}
+
+#ifdef ZEROSCAN_X86
+
+// Each kernel ORs 4 vectors together before testing, the scalar loop takes
+// whatever is left
+
+ZEROSCAN_TARGET("sse2")
+static BOOL IsZeroSse2(const BYTE* p, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for(; n >= 64; p += 64, n -= 64)
+	{
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i*)(p + 32)), _mm_loadu_si128((const __m128i*)(p + 48))));
+
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+			return FALSE;
+	}
+
+	return IsZeroScalar(p, n);
+}
+
+ZEROSCAN_TARGET("avx2")
+static BOOL IsZeroAvx2(const BYTE* p, size_t n)
+{
+	for(; n >= 128; p += 128, n -= 128)
+	{
+		__m256i v = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i*)p), _mm256_loadu_si256((const __m256i*)(p + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + 64)), _mm256_loadu_si256((const __m256i*)(p + 96))));
+
+		if(!_mm256_testz_si256(v, v))
+			return FALSE;
+	}
+
+	return IsZeroScalar(p, n);
+}
+
+ZEROSCAN_TARGET("avx512f")
+static BOOL IsZeroAvx512(const BYTE* p, size_t n)
+{
+	for(; n >= 256; p += 256, n -= 256)
+	{
+		__m512i v = _mm512_or_si512(
+			_mm512_or_si512(_mm512_loadu_si512((const void*)p), _mm512_loadu_si512((const void*)(p + 64))),
+			_mm512_or_si512(_mm512_loadu_si512((const void*)(p + 128)), _mm512_loadu_si512((const void*)(p + 192))));
+
+		if(_mm512_test_epi64_mask(v, v))
+			return FALSE;
+	}
+
+	return IsZeroScalar(p, n);
+}
+
+static void CpuId(UINT32 nLeaf, UINT32* pRegs)
+{
+#ifdef _MSC_VER
+	__cpuidex((int*)pRegs, (int)nLeaf, 0);
+#else
+	__cpuid_count(nLeaf, 0, pRegs[0], pRegs[1], pRegs[2], pRegs[3]);
+#endif
+}
+
+// Register state the OS saves on context switch (XCR0)
+static UINT64 GetXcr0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	UINT32 lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((UINT64)hi << 32) | lo;
+#endif
+}
+
+static DWORD DetectLevel()
+{
+	UINT32 regs[4];
+	DWORD dwLevel = ZEROSCAN_SCALAR;
+
+	CpuId(0, regs);
+	UINT32 nMaxLeaf = regs[0];
+
+	CpuId(1, regs);
+	if(!(regs[3] & (1 << 26)))
+		return dwLevel;
+	dwLevel = ZEROSCAN_SSE2;
+
+	// AVX needs OSXSAVE and the OS saving XMM and YMM state
+	if(!(regs[2] & (1 << 27)) || nMaxLeaf < 7)
+		return dwLevel;
+
+	UINT64 xcr0 = GetXcr0();
+	if((xcr0 & 0x06) != 0x06)
+		return dwLevel;
+
+	CpuId(7, regs);
+	if(regs[1] & (1 << 5))
+		dwLevel = ZEROSCAN_AVX2;
+
+	// AVX-512 also needs the opmask and ZMM state
+	if((regs[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6)
+		dwLevel = ZEROSCAN_AVX512;
+
+	return dwLevel;
+}
+
+static const ZEROSCAN_FN s_pKernels[ZEROSCAN_LEVELS] = { IsZeroScalar, IsZeroSse2, IsZeroAvx2, IsZeroAvx512 };
+
+#else // !ZEROSCAN_X86
+
+static DWORD DetectLevel()
+{
+	return ZEROSCAN_SCALAR;
+}
+
+static const ZEROSCAN_FN s_pKernels[ZEROSCAN_LEVELS] = { IsZeroScalar, NULL, NULL, NULL };
+
+#endif // ZEROSCAN_X86
+
+static const char* s_sNames[ZEROSCAN_LEVELS] = { "scalar", "SSE2", "AVX2", "AVX-512" };
+
+// Picked on first use; races only ever store the same value
+static DWORD s_dwSupport = (DWORD)-1;
+static DWORD s_dwLevel = (DWORD)-1;
+static ZEROSCAN_FN s_pIsZero = NULL;
+
+static ZEROSCAN_FN GetKernel()
+{
+	if(!s_pIsZero)
+		SetZeroScanLevel(GetZeroScanSupport());
+
+	return s_pIsZero;
+}
+
+DWORD GetZeroScanSupport()
+{
+	if(s_dwSupport == (DWORD)-1)
+		s_dwSupport = DetectLevel();
+
+	return s_dwSupport;
+}
+
+DWORD GetZeroScanLevel()
+{
+	GetKernel();
+	return s_dwLevel;
+}
+
+BOOL SetZeroScanLevel(DWORD dwLevel)
+{
+	if(dwLevel > GetZeroScanSupport())
+		return FALSE;
+
+	s_dwLevel = dwLevel;
+	s_pIsZero = s_pKernels[dwLevel];
+
+	return TRUE;
+}
+
+const char* GetZeroScanName(DWORD dwLevel)
+{
+	return dwLevel < ZEROSCAN_LEVELS ? s_sNames[dwLevel] : "?";
+}
+
+BOOL IsZeroBlock(const void* pBuff, size_t nBytes)
+{
+	return GetKernel()((const BYTE*)pBuff, nBytes);
+}
+
+UINT32 GetDataSectorMask(const void* pBuff, UINT32 nSectors, BYTE* pMask)
+{
+	ZEROSCAN_FN pIsZero = GetKernel();
+	const BYTE* p = (const BYTE*)pBuff;
+	UINT32 nData = 0;
+
+	memset(pMask, 0, (nSectors + 7) / 8);
+
+	for(UINT32 s = 0; s < nSectors; s++, p += 512)
+	{
+		if(pIsZero(p, 512))
+			continue;
+
+		pMask[s / 8] |= 0x80 >> (s % 8);
+		nData++;
+	}
+
+	return nData;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// All-zero detection for capture, the hot loop on fast sources. SSE2, AVX2
+// and AVX-512 kernels are picked at runtime from what the CPU and OS support,
+// with a plain 64-bit loop elsewhere. Every kernel returns on the first
+// non-zero vector.
+
+#define ZEROSCAN_SCALAR		0
+#define ZEROSCAN_SSE2		1
+#define ZEROSCAN_AVX2		2
+#define ZEROSCAN_AVX512		3
+#define ZEROSCAN_LEVELS		4
+
+// Best level the machine supports
+DWORD GetZeroScanSupport();
+
+// Level in use, the best supported one unless forced lower
+DWORD GetZeroScanLevel();
+BOOL SetZeroScanLevel(DWORD dwLevel);
+const char* GetZeroScanName(DWORD dwLevel);
+
+BOOL IsZeroBlock(const void* pBuff, size_t nBytes);
+
+// Sets a bit in pMask for each 512 byte sector holding data, MSB first as in
+// VHD block bitmaps, and clears the others. Returns how many sectors hold data.
+UINT32 GetDataSectorMask(const void* pBuff, UINT32 nSectors, BYTE* pMask);
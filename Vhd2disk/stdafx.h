@@ -5,6 +5,8 @@
 
 #pragma once
 
+#ifdef _WIN32
+
 #include "targetver.h"
 
 #define WIN32_LEAN_AND_MEAN             // Exclure les en-ttes Windows rarement utiliss
@@ -24,6 +26,6 @@
 #define MYWM_UPDATE_STATUS (WM_USER + 666)
 #define MYWM_UPDATE_PROGRESSBAR (WM_USER + 999)
 
+#endif // _WIN32
 
-
-
+#include "Portable.h"